@@ -0,0 +1,128 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "async_op.h"
+#include "trace.h"
+
+struct async_op* create_async_op(struct gpu_context* context,
+                                 async_op_callback callback, void* user_data,
+                                 cl_int* error)
+{
+    assert(context);
+    assert(error);
+
+    struct async_op* const op = calloc(1, sizeof(struct async_op));
+    if (!op)
+    {
+        *error = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    op->context = context;
+    op->callback = callback;
+    op->user_data = user_data;
+    op->start_ns = host_time_ns();
+    pthread_mutex_init(&op->lock, NULL);
+    pthread_cond_init(&op->finished_cond, NULL);
+
+    *error = 0;
+    return op;
+}
+
+/// Returns the buffers, collects the timing and notifies the waiters
+static
+void finish_async_op(struct async_op* op, cl_int status, bool notify)
+{
+    op->status = status;
+
+    memset(&op->timing, 0, sizeof(struct op_timing));
+    if (!status)
+    {
+        for (size_t i = 0; i < op->num_transfers; ++i)
+            op->timing.transfer_ns += event_elapsed_ns(op->transfers[i]);
+        for (size_t i = 0; i < op->num_kernels; ++i)
+            op->timing.kernel_ns += event_elapsed_ns(op->kernels[i]);
+    }
+    op->timing.total_ns = host_time_ns() - op->start_ns;
+
+    for (size_t i = 0; i < op->num_buffers; ++i)
+        release_buffer(&op->context->buffer_pool, op->buffers[i]);
+    op->num_buffers = 0;
+
+    if (notify && op->callback)
+        op->callback(op, status, op->user_data);
+
+    pthread_mutex_lock(&op->lock);
+    op->finished = true;
+    pthread_cond_broadcast(&op->finished_cond);
+    pthread_mutex_unlock(&op->lock);
+}
+
+static
+void CL_CALLBACK on_done_event(cl_event event, cl_int status, void* user_data)
+{
+    (void) event;
+    finish_async_op(user_data, status < 0 ? status : 0, true);
+}
+
+cl_int start_async_op(struct async_op* op, cl_int status)
+{
+    assert(op);
+
+    if (!status && op->done_event)
+        status = clSetEventCallback(op->done_event, CL_COMPLETE, on_done_event, op);
+    else if (!status)
+        status = CL_INVALID_EVENT;
+
+    if (status)
+    {
+        /// Commands enqueued before the failure may still use the buffers
+        clFinish(op->context->command_queue);
+        finish_async_op(op, status, false);
+    }
+    return status;
+}
+
+bool poll_async_op(struct async_op* op)
+{
+    assert(op);
+
+    pthread_mutex_lock(&op->lock);
+    bool const finished = op->finished;
+    pthread_mutex_unlock(&op->lock);
+    return finished;
+}
+
+cl_int wait_async_op(struct async_op* op, struct op_timing* timing)
+{
+    assert(op);
+
+    pthread_mutex_lock(&op->lock);
+    while (!op->finished)
+        pthread_cond_wait(&op->finished_cond, &op->lock);
+    pthread_mutex_unlock(&op->lock);
+
+    if (timing)
+        *timing = op->timing;
+    return op->status;
+}
+
+void release_async_op(struct async_op* op)
+{
+    if (!op)
+        return;
+
+    wait_async_op(op, NULL);
+
+    trace_commands(op->transfers, op->num_transfers);
+    trace_commands(op->kernels, op->num_kernels);
+    for (size_t i = 0; i < op->num_transfers; ++i)
+        clReleaseEvent(op->transfers[i]);
+    for (size_t i = 0; i < op->num_kernels; ++i)
+        clReleaseEvent(op->kernels[i]);
+
+    pthread_cond_destroy(&op->finished_cond);
+    pthread_mutex_destroy(&op->lock);
+    free(op);
+}
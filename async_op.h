@@ -0,0 +1,103 @@
+#ifndef OPENCL_FUN_ASYNC_OP_H
+#define OPENCL_FUN_ASYNC_OP_H
+
+#include <pthread.h>
+
+#include "clfun.h"
+
+/// Most device buffers and commands of a single operation
+#define ASYNC_OP_MAX_BUFFERS    4
+#define ASYNC_OP_MAX_EVENTS     4
+
+struct async_op;
+
+/**
+ * Completion callback of an operation, called from a thread of the OpenCL
+ * runtime once the result is in host memory.
+ * \param status Zero on success, error code of the failed command otherwise
+ */
+typedef void (*async_op_callback)(struct async_op* op, cl_int status,
+                                  void* user_data);
+
+/**
+ * Operation submitted to the device and possibly still running.
+ * Buffers go back to the context's pool as soon as it completes, events
+ * are kept for the timing until \ref release_async_op.
+ */
+struct async_op
+{
+    struct gpu_context*     context;
+
+    cl_mem                  buffers[ASYNC_OP_MAX_BUFFERS];
+    size_t                  num_buffers;
+    cl_event                transfers[ASYNC_OP_MAX_EVENTS];
+    size_t                  num_transfers;
+    cl_event                kernels[ASYNC_OP_MAX_EVENTS];
+    size_t                  num_kernels;
+    cl_event                done_event;     //!< Last command reading the result, one of transfers
+
+    async_op_callback       callback;
+    void*                   user_data;
+
+    cl_ulong                start_ns;
+    struct op_timing        timing;         //!< Valid once finished
+    cl_int                  status;
+
+    pthread_mutex_t         lock;
+    pthread_cond_t          finished_cond;
+    bool                    finished;       //!< Callback has run, guarded by lock
+};
+
+/**
+ * Creates an operation of the context, commands are added by the submitting
+ * function, see submit_gemm and submit_scan in clfun.h.
+ * \param callback Called on completion if not NULL
+ */
+struct async_op* create_async_op(struct gpu_context* context,
+                                 async_op_callback callback, void* user_data,
+                                 cl_int* error);
+
+/**
+ * Starts watching the operation's last command, called once all its commands
+ * have been enqueued. Operations which failed to enqueue are finished with
+ * \p status instead, without calling the callback.
+ */
+cl_int start_async_op(struct async_op* op, cl_int status);
+
+/// Checks without blocking whether the operation has finished
+bool poll_async_op(struct async_op* op);
+
+/**
+ * Blocks until the operation has finished and its callback has returned.
+ * \param timing Filled if not NULL
+ * \return Status of the operation
+ */
+cl_int wait_async_op(struct async_op* op, struct op_timing* timing);
+
+/**
+ * Destructor for \ref async_op, waits for the operation first.
+ * Must not be called from the operation's callback.
+ */
+void release_async_op(struct async_op* op);
+
+/**
+ * Non-blocking \ref run_gemm: enqueues the copies and the kernel and returns
+ * at once. \p a and \p b must stay untouched and \p c unread until the
+ * operation has finished. May be called from several threads on the same
+ * context, as may run_gemm.
+ * \param callback Called on completion if not NULL
+ * \return New operation, NULL if it couldn't be enqueued
+ */
+struct async_op* submit_gemm(struct gpu_context* context,
+                             float const* a, float const* b, float* c,
+                             size_t n, size_t m, size_t k,
+                             async_op_callback callback, void* user_data,
+                             cl_int* error);
+
+/// Non-blocking \ref run_scan, see \ref submit_gemm
+struct async_op* submit_scan(struct gpu_context* context,
+                             float const* in, float* out, size_t n,
+                             async_op_callback callback, void* user_data,
+                             cl_int* error);
+
+#endif //OPENCL_FUN_ASYNC_OP_H
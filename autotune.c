@@ -0,0 +1,421 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "autotune.h"
+
+static
+char const* tuning_db_file(void)
+{
+    char const* file = getenv(TUNING_DB_ENV);
+    return file && *file ? file : TUNING_DB_DEFAULT_FILE;
+}
+
+static
+unsigned floor_log2(size_t x)
+{
+    unsigned result = 0;
+    while (x > 1)
+    {
+        x >>= 1;
+        ++result;
+    }
+    return result;
+}
+
+void gemm_shape_class(char* buf, size_t buf_sz, size_t n, size_t m, size_t k)
+{
+    snprintf(
+        buf, buf_sz, "%u:%u:%u", floor_log2(n), floor_log2(m), floor_log2(k)
+    );
+}
+
+/// Device part of the database key: tuning is only valid for the same driver
+static
+void device_key(struct gpu_context* context, char* buf, size_t buf_sz)
+{
+    snprintf(
+        buf, buf_sz, "%s|%s", context->device_name, context->driver_version
+    );
+}
+
+/**
+ * Splits tab-separated database line into fields.
+ * Line format: device key, shape class, tile size, elems per thread, kernel ns,
+ * gemm kernel. Lines without the last field are gemm4's.
+ * \return number of fields found
+ */
+static
+size_t split_line(char* line, char** fields, size_t max_fields)
+{
+    size_t num = 0;
+    line[strcspn(line, "\n")] = '\0';
+
+    while (num < max_fields)
+    {
+        fields[num++] = line;
+        line = strchr(line, '\t');
+        if (!line)
+            break;
+        *line++ = '\0';
+    }
+    return num;
+}
+
+/// Entries are kept per shape class and kernel
+static
+bool same_entry_key(struct tuning_entry const* entry, char const* shape_class,
+                    enum gemm_kernel kernel)
+{
+    return !strcmp(entry->shape_class, shape_class) && entry->config.kernel == kernel;
+}
+
+/// Parses the kernel field of a line split into \p num_fields
+static
+bool parse_entry_kernel(char** fields, size_t num_fields, enum gemm_kernel* kernel)
+{
+    *kernel = GEMM_KERNEL_TILED;
+    return num_fields == 5 || parse_gemm_kernel(fields[5], kernel);
+}
+
+static
+cl_int put_entry(struct gpu_context* context, struct tuning_entry const* entry)
+{
+    for (size_t i = 0; i < context->num_tuning_entries; ++i)
+    {
+        if (same_entry_key(&context->tuning_entries[i], entry->shape_class,
+                           entry->config.kernel))
+        {
+            context->tuning_entries[i] = *entry;
+            return 0;
+        }
+    }
+
+    struct tuning_entry* entries = realloc(
+        context->tuning_entries,
+        (context->num_tuning_entries + 1) * sizeof(struct tuning_entry)
+    );
+    if (!entries)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    context->tuning_entries = entries;
+    context->tuning_entries[context->num_tuning_entries++] = *entry;
+    return 0;
+}
+
+cl_int load_tuning_db(struct gpu_context* context)
+{
+    assert(context);
+
+    FILE* file = fopen(tuning_db_file(), "r");
+    if (!file)
+        return 0;
+
+    char key[256];
+    char line[512];
+    char* fields[6];
+    cl_int result = 0;
+    device_key(context, key, sizeof(key));
+
+    while (!result && fgets(line, sizeof(line), file))
+    {
+        size_t const num_fields = split_line(line, fields, 6);
+        enum gemm_kernel kernel;
+        if (num_fields < 5 || strcmp(fields[0], key)
+            || !parse_entry_kernel(fields, num_fields, &kernel))
+            continue;
+
+        struct tuning_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.config.kernel = kernel;
+        strncpy(entry.shape_class, fields[1], sizeof(entry.shape_class) - 1);
+        entry.config.tile_size = strtoul(fields[2], NULL, 10);
+        entry.config.elems_per_thread = strtoul(fields[3], NULL, 10);
+        entry.kernel_ns = strtoull(fields[4], NULL, 10);
+
+        result = put_entry(context, &entry);
+    }
+
+    fclose(file);
+
+    if (context->num_tuning_entries)
+        fprintf(
+            stderr, "Loaded %zu tuned gemm configs from %s\n",
+            context->num_tuning_entries, tuning_db_file()
+        );
+    return result;
+}
+
+cl_int save_tuning_entry(struct gpu_context* context,
+                         struct tuning_entry const* entry)
+{
+    assert(context);
+    assert(entry);
+
+    cl_int result = put_entry(context, entry);
+    if (result)
+        return result;
+
+    char const* file_name = tuning_db_file();
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", file_name, (long) getpid());
+
+    FILE* out = fopen(tmp_name, "w");
+    if (!out)
+    {
+        perror("Error writing tuning database");
+        return -1;
+    }
+
+    char key[256];
+    device_key(context, key, sizeof(key));
+
+    /// Other devices' and shapes' entries are kept as is
+    FILE* in = fopen(file_name, "r");
+    if (in)
+    {
+        char line[512];
+        char copy[512];
+        char* fields[6];
+        while (fgets(line, sizeof(line), in))
+        {
+            strcpy(copy, line);
+            size_t const num_fields = split_line(copy, fields, 6);
+            enum gemm_kernel kernel;
+            if (num_fields >= 5 && !strcmp(fields[0], key)
+                && !strcmp(fields[1], entry->shape_class)
+                && parse_entry_kernel(fields, num_fields, &kernel)
+                && kernel == entry->config.kernel)
+                continue;
+            fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    fprintf(
+        out, "%s\t%s\t%zu\t%zu\t%llu\t%s\n", key, entry->shape_class,
+        entry->config.tile_size, entry->config.elems_per_thread,
+        (unsigned long long) entry->kernel_ns, gemm_kernel_name(entry->config.kernel)
+    );
+
+    if (fclose(out) || rename(tmp_name, file_name))
+    {
+        perror("Error writing tuning database");
+        remove(tmp_name);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Fastest applicable entry of the shape's class, of the given kernel or of
+ * any if \p kernel is GEMM_KERNELS_NUM. NULL if there is none.
+ */
+static
+struct tuning_entry const* find_entry(struct gpu_context* context,
+                                      enum gemm_kernel kernel,
+                                      size_t n, size_t m, size_t k)
+{
+    char shape_class[32];
+    gemm_shape_class(shape_class, sizeof(shape_class), n, m, k);
+
+    struct tuning_entry const* best = NULL;
+    for (size_t i = 0; i < context->num_tuning_entries; ++i)
+    {
+        struct tuning_entry const* entry = &context->tuning_entries[i];
+        if (strcmp(entry->shape_class, shape_class)
+            || (kernel != GEMM_KERNELS_NUM && entry->config.kernel != kernel))
+            continue;
+
+        /// Shapes no tile divides run with edge checks whatever the config,
+        /// shapes the kernel's default divides keep to configs without them
+        struct gemm_config const fallback = default_gemm_kernel_config(
+            entry->config.kernel
+        );
+        bool const ragged = !gemm_config_fits(&fallback, n, m, k);
+        if ((ragged ? gemm_config_valid(&entry->config)
+                    : gemm_config_fits(&entry->config, n, m, k))
+            && (!best || entry->kernel_ns < best->kernel_ns))
+            best = entry;
+    }
+    return best;
+}
+
+struct gemm_config lookup_gemm_config(struct gpu_context* context,
+                                      size_t n, size_t m, size_t k)
+{
+    struct tuning_entry const* entry = find_entry(
+        context, GEMM_KERNELS_NUM, n, m, k
+    );
+    return entry ? entry->config : default_gemm_config();
+}
+
+struct gemm_config lookup_gemm_kernel_config(struct gpu_context* context,
+                                             enum gemm_kernel kernel,
+                                             size_t n, size_t m, size_t k)
+{
+    struct tuning_entry const* entry = find_entry(context, kernel, n, m, k);
+    return entry ? entry->config : default_gemm_kernel_config(kernel);
+}
+
+static inline
+void fill_array(float* ptr, size_t cnt)
+{
+    for (size_t i = 0; i < cnt; ++i)
+        ptr[i] = (float) ((double) rand() / (double) (RAND_MAX));
+}
+
+/**
+ * Work items in a work group of the config's kernel. A work group computes
+ * exactly one result tile, each item a column of ELEMS_PER_THREAD results
+ * (an ELEMS_PER_THREAD^2 block in gemm5), and the tiles are loaded indexed by
+ * the local ids, so the local size follows from the tiling: {T, T / E}, or
+ * {T / E, T / E} for gemm5. Sweeping the elems per thread sweeps it.
+ */
+static
+size_t gemm_group_size(struct gemm_config const* config)
+{
+    size_t const side = config->tile_size / config->elems_per_thread;
+    return config->kernel == GEMM_KERNEL_MICRO_TILE ? side * side
+                                                    : config->tile_size * side;
+}
+
+/**
+ * Times every legal tiling of the kernel, returns the fastest one in
+ * \p winner, its kernel_ns is zero if none could run.
+ */
+static
+void tune_kernel(struct gpu_context* context, enum gemm_kernel kernel,
+                 cl_ulong local_mem_size, float const* a, float const* b,
+                 float* c, size_t n, size_t m, size_t k,
+                 struct tuning_entry* winner)
+{
+    static size_t const tile_sizes[] = {4, 8, 16, 32, 64, 128};
+    static size_t const elems_per_thread[] = {1, 2, 4, 8, 16};
+
+    /// Shapes the kernel's default tile doesn't divide are tuned with edge checks
+    struct gemm_config const fallback = default_gemm_kernel_config(kernel);
+    bool const ragged = !gemm_config_fits(&fallback, n, m, k);
+    char const* const name = gemm_kernel_name(kernel);
+
+    for (size_t i = 0; i < sizeof(tile_sizes) / sizeof(size_t); ++i)
+    {
+        for (size_t j = 0; j < sizeof(elems_per_thread) / sizeof(size_t); ++j)
+        {
+            struct gemm_config const config = {tile_sizes[i], elems_per_thread[j], kernel};
+
+            if (!(ragged ? gemm_config_valid(&config)
+                         : gemm_config_fits(&config, n, m, k))
+                || gemm_local_mem_size(&config, 0) > local_mem_size
+                || gemm_group_size(&config) > context->max_work_group_size)
+                continue;
+
+            /// First run builds the variant and warms the device up
+            struct op_timing timing;
+            cl_int result = run_gemm_with_config(context, &config, a, b, c, n, m, k, &timing);
+            if (result)
+            {
+                fprintf(
+                    stderr, "%s tile %zu, elems per thread %zu: failed (%d)\n",
+                    name, config.tile_size, config.elems_per_thread, result
+                );
+                continue;
+            }
+
+            cl_ulong best_ns = 0;
+            for (size_t rep = 0; !result && rep < AUTOTUNE_REPS; ++rep)
+            {
+                result = run_gemm_with_config(context, &config, a, b, c, n, m, k, &timing);
+                if (!rep || timing.kernel_ns < best_ns)
+                    best_ns = timing.kernel_ns;
+            }
+            if (result)
+                continue;
+
+            fprintf(
+                stderr, "%s tile %zu, elems per thread %zu, work group %zu: %.4f ms\n",
+                name, config.tile_size, config.elems_per_thread,
+                gemm_group_size(&config), best_ns / 1e6
+            );
+
+            if (!winner->kernel_ns || best_ns < winner->kernel_ns)
+            {
+                winner->config = config;
+                winner->kernel_ns = best_ns;
+            }
+        }
+    }
+}
+
+cl_int autotune_gemm(struct gpu_context* context,
+                     size_t n, size_t m, size_t k,
+                     struct gemm_config* best)
+{
+    assert(context);
+
+    cl_ulong local_mem_size = 0;
+    cl_int result = clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_LOCAL_MEM_SIZE,
+        sizeof(cl_ulong), &local_mem_size, 0
+    );
+    CHECK_AND_RET_ERR("Failed to get local memory size", result);
+
+    float* const a = malloc(n * m * sizeof(float));
+    float* const b = malloc(m * k * sizeof(float));
+    float* const c = malloc(n * k * sizeof(float));
+    if (!a || !b || !c)
+    {
+        result = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
+
+    fill_array(a, n * m);
+    fill_array(b, m * k);
+
+    char shape_class[32];
+    gemm_shape_class(shape_class, sizeof(shape_class), n, m, k);
+
+    fprintf(
+        stderr, "Autotuning gemm for %zux%zux%zu (class %s) on %s\n",
+        n, m, k, shape_class, context->device_name
+    );
+
+    /// Every kernel keeps its own winner, lookups pick the fastest of them
+    struct tuning_entry overall;
+    memset(&overall, 0, sizeof(overall));
+    for (size_t i = 0; !result && i < GEMM_KERNELS_NUM; ++i)
+    {
+        struct tuning_entry winner;
+        memset(&winner, 0, sizeof(winner));
+        strcpy(winner.shape_class, shape_class);
+
+        tune_kernel(context, i, local_mem_size, a, b, c, n, m, k, &winner);
+        if (!winner.kernel_ns)
+            continue;
+
+        fprintf(
+            stderr, "Best %s config: tile %zu, elems per thread %zu (%.4f ms)\n",
+            gemm_kernel_name(i), winner.config.tile_size,
+            winner.config.elems_per_thread, winner.kernel_ns / 1e6
+        );
+
+        result = save_tuning_entry(context, &winner);
+        if (!overall.kernel_ns || winner.kernel_ns < overall.kernel_ns)
+            overall = winner;
+    }
+
+    if (!result && !overall.kernel_ns)
+    {
+        fprintf(stderr, "No gemm config could run on this shape\n");
+        result = CL_INVALID_VALUE;
+    }
+    if (!result && best)
+        *best = overall.config;
+
+free_arrays:
+    free(a);
+    free(b);
+    free(c);
+    return result;
+}
@@ -0,0 +1,54 @@
+#ifndef OPENCL_FUN_AUTOTUNE_H
+#define OPENCL_FUN_AUTOTUNE_H
+
+#include "clfun.h"
+
+/// Environment variable overriding the tuning database file
+#define TUNING_DB_ENV           "CLFUN_TUNING_DB"
+#define TUNING_DB_DEFAULT_FILE  "clfun_tuning.txt"
+
+/// Kernel runs per candidate config, the fastest one counts
+#define AUTOTUNE_REPS 3
+
+/// Best known config of a gemm kernel on a device for a class of shapes
+struct tuning_entry
+{
+    char                shape_class[32];
+    struct gemm_config  config;
+    cl_ulong            kernel_ns;  //!< Kernel time measured while tuning
+};
+
+/// Shapes are classified by the binary logarithms of their dimensions
+void gemm_shape_class(char* buf, size_t buf_sz, size_t n, size_t m, size_t k);
+
+/// Loads the entries of the context's device from the tuning database
+cl_int load_tuning_db(struct gpu_context* context);
+
+/// Adds or replaces the entry of the context's device and the entry's kernel
+/// in the tuning database
+cl_int save_tuning_entry(struct gpu_context* context,
+                         struct tuning_entry const* entry);
+
+/// Fastest tuned config of any kernel for the shape if known and applicable,
+/// the default gemm4 one otherwise
+struct gemm_config lookup_gemm_config(struct gpu_context* context,
+                                      size_t n, size_t m, size_t k);
+
+/// \ref lookup_gemm_config restricted to the kernel
+struct gemm_config lookup_gemm_kernel_config(struct gpu_context* context,
+                                             enum gemm_kernel kernel,
+                                             size_t n, size_t m, size_t k);
+
+/**
+ * Times every legal tiling of every gemm kernel on the shape and saves the
+ * fastest one of each kernel. Tiles must fit CL_DEVICE_LOCAL_MEM_SIZE and work
+ * groups CL_DEVICE_MAX_WORK_GROUP_SIZE.
+ * Local sizes are not swept apart from the tilings: a kernel's work group
+ * covers one tile, so tile size and elems per thread determine it.
+ * \param best Set to the fastest of the winners if not NULL
+ */
+cl_int autotune_gemm(struct gpu_context* context,
+                     size_t n, size_t m, size_t k,
+                     struct gemm_config* best);
+
+#endif //OPENCL_FUN_AUTOTUNE_H
@@ -0,0 +1,1247 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clfun.h"
+#include "async_op.h"
+#include "autotune.h"
+#include "const.h"
+#include "roofline.h"
+
+/// Benchmarked operations
+enum bench_kernel
+{
+    BENCH_GEMM1,    //!< gemm1.cl, naive, rows along the first dimension
+    BENCH_GEMM2,    //!< gemm2.cl, naive, columns along the first dimension
+    BENCH_GEMM3,    //!< gemm3.cl, local memory tiles
+    BENCH_GEMM4,    //!< run_gemm_with_config, gemm4.cl as tuned for the device
+    BENCH_GEMM4DB,  //!< gemm4.cl with double-buffered tiles as tuned
+    BENCH_GEMM5,    //!< run_gemm_with_config, gemm5.cl as tuned for the device
+    BENCH_GEMM6,    //!< gemm6.cl as tuned, on the device's preferred vector width
+    BENCH_GEMM6X1,  //!< gemm6.cl on scalars
+    BENCH_GEMM6X4,  //!< gemm6.cl on float4
+    BENCH_GEMM6X8,  //!< gemm6.cl on float8
+    BENCH_SCAN,     //!< run_scan of a single tile, par_scan.cl
+    BENCH_SCAN2,    //!< run_scan of several tiles, par_scan2.cl
+    BENCH_KERNELS_NUM
+};
+
+static char const* const bench_kernel_names[BENCH_KERNELS_NUM] =
+{
+    "gemm1", "gemm2", "gemm3", "gemm4", "gemm4db", "gemm5", "gemm6", "gemm6x1",
+    "gemm6x4", "gemm6x8", "scan", "scan2"
+};
+
+static inline
+bool is_gemm(enum bench_kernel kernel)
+{
+    return kernel < BENCH_SCAN;
+}
+
+
+/// Default sizes: square gemms and scans of n elements
+static char const* const default_sizes = "256,512,1024,2048";
+
+#define BENCH_DEFAULT_WARMUP    2
+#define BENCH_DEFAULT_REPS      10
+#define BENCH_MAX_SHAPES        64
+
+/// Percent the medians have to differ by to count as a change
+#define BENCH_DEFAULT_THRESHOLD 5.0
+
+/// Exit code of a comparison finding significant regressions
+#define BENCH_EXIT_REGRESSION   2
+
+/// Most kernel launches of a run timed one by one, scan2 launches two
+#define BENCH_MAX_PARTS         2
+
+enum bench_format
+{
+    BENCH_FORMAT_TABLE,
+    BENCH_FORMAT_CSV,
+    BENCH_FORMAT_JSON
+};
+
+/// Gemm shape, scans take n elements
+struct bench_shape
+{
+    size_t n;
+    size_t m;
+    size_t k;
+};
+
+struct bench_options
+{
+    bool                kernels[BENCH_KERNELS_NUM];
+    struct bench_shape  shapes[BENCH_MAX_SHAPES];
+    size_t              num_shapes;
+    size_t              warmup;
+    size_t              reps;
+    enum bench_format   format;
+    char const*         output;     //!< Output file, stdout if NULL
+    bool                roofline;   //!< Print roofline report of the runs
+    char const*         save_baseline;  //!< Baseline file to store the results in
+    char const*         compare;        //!< Baseline file to compare the results with
+    double              threshold;      //!< Percent of change below noise
+    enum clfun_backend  backend;
+};
+
+/// Order statistics of one metric over the repetitions, in nanoseconds
+struct bench_stats
+{
+    cl_ulong min;
+    cl_ulong median;
+    cl_ulong p95;
+    cl_ulong p99;
+};
+
+struct bench_result
+{
+    enum bench_kernel   kernel;
+    struct bench_shape  shape;
+    size_t              reps;
+    double              ops;        //!< Floating point operations of one run
+
+    struct bench_stats  kernel_time;
+    struct bench_stats  transfer_time;
+    struct bench_stats  total_time;
+
+    /// Kernel time of every launch of the run, local_scan and tiles_sum for scan2
+    struct bench_stats  part_time[BENCH_MAX_PARTS];
+    size_t              num_parts;
+};
+
+/// Stored kernel times of a case, see \ref save_baseline
+struct baseline_entry
+{
+    char                driver_version[64];
+    enum bench_kernel   kernel;
+    struct bench_shape  shape;
+    size_t              reps;
+    struct bench_stats  kernel_time;    //!< p99 isn't stored
+};
+
+#define BASELINE_FIELDS 10
+
+static inline
+void fill_array(float* ptr, size_t cnt)
+{
+    for (size_t i = 0; i < cnt; ++i)
+        ptr[i] = (float) ((double) rand() / (double) (RAND_MAX));
+}
+
+static
+int compare_ns(void const* lhs, void const* rhs)
+{
+    cl_ulong const a = *(cl_ulong const*) lhs;
+    cl_ulong const b = *(cl_ulong const*) rhs;
+    return (a > b) - (a < b);
+}
+
+/// Nearest-rank percentile of the sorted samples
+static
+cl_ulong percentile(cl_ulong const* sorted, size_t num, double p)
+{
+    size_t rank = (size_t) ceil(p / 100.0 * (double) num);
+    if (rank < 1)
+        rank = 1;
+    return sorted[rank - 1];
+}
+
+/// Sorts the samples in place and takes their statistics
+static
+struct bench_stats compute_stats(cl_ulong* samples, size_t num)
+{
+    qsort(samples, num, sizeof(cl_ulong), compare_ns);
+
+    struct bench_stats stats;
+    stats.min = samples[0];
+    stats.median = num % 2 ? samples[num / 2]
+                           : (samples[num / 2 - 1] + samples[num / 2]) / 2;
+    stats.p95 = percentile(samples, num, 95);
+    stats.p99 = percentile(samples, num, 99);
+    return stats;
+}
+
+/// Prints NxMxK for gemms and the number of elements for scans
+static
+void format_shape(enum bench_kernel kernel, struct bench_shape shape,
+                  char* buf, size_t buf_size)
+{
+    if (is_gemm(kernel))
+        snprintf(buf, buf_size, "%zux%zux%zu", shape.n, shape.m, shape.k);
+    else
+        snprintf(buf, buf_size, "%zu", shape.n);
+}
+
+/// Vector width of the gemm6 rows, 0 for the device's preferred one
+static
+size_t bench_vector_width(enum bench_kernel kernel)
+{
+    switch (kernel)
+    {
+    case BENCH_GEMM6X1:
+        return 1;
+    case BENCH_GEMM6X4:
+        return 4;
+    case BENCH_GEMM6X8:
+        return 8;
+    default:
+        return 0;
+    }
+}
+
+/// Tuned config of the library kernel behind gemm4, gemm4db, gemm5 and gemm6
+static
+struct gemm_config bench_gemm_config(struct gpu_context* context,
+                                     enum bench_kernel kernel,
+                                     struct bench_shape shape)
+{
+    enum gemm_kernel library_kernel = GEMM_KERNEL_TILED;
+    if (kernel == BENCH_GEMM4DB)
+        library_kernel = GEMM_KERNEL_DOUBLE_BUFFERED;
+    else if (kernel == BENCH_GEMM5)
+        library_kernel = GEMM_KERNEL_MICRO_TILE;
+    else if (kernel >= BENCH_GEMM6 && kernel <= BENCH_GEMM6X8)
+        library_kernel = GEMM_KERNEL_VECTOR;
+
+    struct gemm_config config = lookup_gemm_kernel_config(
+        context, library_kernel, shape.n, shape.m, shape.k
+    );
+    config.vector_width = bench_vector_width(kernel);
+    return config;
+}
+
+/// Tile of gemm2 and gemm3: the square work group has to fit the device
+static
+size_t lesson_tile_size(struct gpu_context* context, struct bench_shape shape)
+{
+    size_t tile = 32;
+    while (tile > 1 && (tile * tile > context->max_work_group_size
+                        || shape.n % tile || shape.m % tile || shape.k % tile))
+        tile /= 2;
+    return tile;
+}
+
+/// gemm3 takes shapes no tile divides with -DGEMM_EDGES and the largest tile
+static
+bool lesson_gemm3_edges(struct gpu_context* context, struct bench_shape shape,
+                        size_t* tile)
+{
+    *tile = lesson_tile_size(context, shape);
+    if (*tile >= 4)
+        return false;
+
+    *tile = 32;
+    while (*tile > 1 && *tile * *tile > context->max_work_group_size)
+        *tile /= 2;
+    return true;
+}
+
+/**
+ * Runs one of the lesson kernels gemm1..gemm3 on the context, built from its
+ * own source file, with the work sizes of the lesson's main.
+ */
+static
+cl_int run_lesson_gemm(struct gpu_context* context, enum bench_kernel kernel_id,
+                       float const* a, float const* b, float* c,
+                       struct bench_shape shape, struct op_timing* timing)
+{
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+
+    char file_name[16];
+    snprintf(file_name, sizeof(file_name), "%s.cl", bench_kernel_names[kernel_id]);
+    char const* const sources[] = {file_name};
+
+    size_t tile = lesson_tile_size(context, shape);
+    bool edges = false;
+    char options[64] = "";
+    if (kernel_id == BENCH_GEMM3)
+    {
+        edges = lesson_gemm3_edges(context, shape, &tile);
+        snprintf(
+            options, sizeof(options), "-DTILE_SIZE=%zu%s", tile,
+            edges ? " -DGEMM_EDGES" : ""
+        );
+    }
+
+    struct program_variant* variant = get_program_variant(
+        context, sources, 1, options, &result
+    );
+    CHECK_AND_RET_ERR("Failed to build lesson gemm", result);
+
+    cl_kernel kernel = get_variant_kernel(
+        variant, bench_kernel_names[kernel_id], &result
+    );
+    CHECK_AND_RET_ERR("Failed to create kernel", result);
+
+    size_t const n = shape.n, m = shape.m, k = shape.k;
+    cl_mem a_buf = NULL, b_buf = NULL, c_buf = NULL;
+    cl_event transfers[3] = {0}; //!< write A, write B, read C
+    cl_event run_event = NULL;
+
+    a_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, n * m * sizeof(float), &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    b_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, m * k * sizeof(float), &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    c_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_WRITE_ONLY, n * k * sizeof(float), &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, a_buf, false, 0, n * m * sizeof(float), a,
+        0, 0, &transfers[0]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+    result = clEnqueueWriteBuffer(
+        context->command_queue, b_buf, false, 0, m * k * sizeof(float), b,
+        0, 0, &transfers[1]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+
+    cl_uint const dims[] = {n, m, k};
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buf);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buf);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &c_buf);
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), &dims[0]);
+    clSetKernelArg(kernel, 4, sizeof(cl_uint), &dims[1]);
+    clSetKernelArg(kernel, 5, sizeof(cl_uint), &dims[2]);
+
+    /// gemm1 walks rows along the first dimension and leaves the work
+    /// groups to the runtime, the others walk columns in square groups
+    size_t work_size[] = {(k + tile - 1) / tile * tile, (n + tile - 1) / tile * tile};
+    size_t local_size[] = {tile, tile};
+    if (kernel_id == BENCH_GEMM1)
+    {
+        work_size[0] = n;
+        work_size[1] = k;
+    }
+    result = clEnqueueNDRangeKernel(
+        context->command_queue, kernel, 2, NULL, work_size,
+        kernel_id == BENCH_GEMM1 ? NULL : local_size, 0, 0, &run_event
+    );
+    CHECK_ERR("Error enqueuing kernel", result, release_buffers);
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, c_buf, true, 0, n * k * sizeof(float), c,
+        0, 0, &transfers[2]
+    );
+    CHECK_ERR("clEnqueueReadBuffer error", result, release_buffers);
+
+    if (timing)
+    {
+        timing->kernel_ns = event_elapsed_ns(run_event);
+        timing->transfer_ns = 0;
+        for (size_t i = 0; i < 3; ++i)
+            timing->transfer_ns += event_elapsed_ns(transfers[i]);
+        timing->total_ns = host_time_ns() - start_ns;
+    }
+
+release_buffers:
+    trace_commands(transfers, 3);
+    trace_command(run_event);
+    for (size_t i = 0; i < 3; ++i)
+        if (transfers[i])
+            clReleaseEvent(transfers[i]);
+    if (run_event)
+        clReleaseEvent(run_event);
+    release_buffer(&context->buffer_pool, a_buf);
+    release_buffer(&context->buffer_pool, b_buf);
+    release_buffer(&context->buffer_pool, c_buf);
+    return result;
+}
+
+/// Scan tile run_scan uses on the context
+static
+size_t scan_tile_size(struct gpu_context* context)
+{
+    size_t tile = SCAN_TILE_SIZE;
+    while (tile > context->max_work_group_size && tile > 1)
+        tile /= 2;
+    return tile;
+}
+
+/// Checks that the kernel can run the shape, prints why if it can't
+static
+bool shape_supported(struct gpu_context* context, enum bench_kernel kernel,
+                     struct bench_shape shape)
+{
+    char const* reason = NULL;
+    size_t const tile = scan_tile_size(context);
+
+    bool const native = context->backend == CLFUN_BACKEND_NATIVE;
+
+    switch (kernel)
+    {
+    case BENCH_GEMM1:
+        if (native)
+            reason = "lesson kernels need an OpenCL device";
+        break;
+    case BENCH_GEMM2:
+        if (native)
+            reason = "lesson kernels need an OpenCL device";
+        else if (lesson_tile_size(context, shape) < 4)
+            reason = "dimensions are not divisible by a tile";
+        break;
+    case BENCH_GEMM3:
+        if (native)
+            reason = "lesson kernels need an OpenCL device";
+        break;
+    case BENCH_GEMM4:
+        break;
+    case BENCH_GEMM4DB:
+    case BENCH_GEMM5:
+    case BENCH_GEMM6:
+        if (native)
+            reason = "the native backend has a single gemm, see gemm4";
+        break;
+    case BENCH_GEMM6X1:
+    case BENCH_GEMM6X4:
+    case BENCH_GEMM6X8:
+    {
+        struct gemm_config const config = bench_gemm_config(context, kernel, shape);
+        if (native)
+            reason = "the native backend has a single gemm, see gemm4";
+        else if (gemm_vector_width(context, &config) != config.vector_width)
+            reason = "the vector is wider than the tuned tile";
+        break;
+    }
+    case BENCH_SCAN:
+        if (shape.n > tile)
+            reason = "single tile scan takes at most a work group of elements";
+        break;
+    case BENCH_SCAN2:
+        if (shape.n <= tile || shape.n % tile)
+            reason = "tiled scan takes several whole tiles";
+        break;
+    default:
+        reason = "unknown kernel";
+    }
+
+    if (reason)
+    {
+        char name[48];
+        format_shape(kernel, shape, name, sizeof(name));
+        fprintf(
+            stderr, "Skipping %s %s: %s\n", bench_kernel_names[kernel], name,
+            reason
+        );
+    }
+    return !reason;
+}
+
+/// run_scan keeping the kernel time of every launch in \p part_ns
+static
+cl_int run_scan_parts(struct gpu_context* context, float const* in, float* out,
+                      size_t n, struct op_timing* timing, cl_ulong* part_ns,
+                      size_t* num_parts)
+{
+    /// Native scans are a single pass without launches to time apart
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return run_scan(context, in, out, n, timing);
+
+    cl_int result = 0;
+    struct async_op* op = submit_scan(context, in, out, n, NULL, NULL, &result);
+    if (!op)
+        return result;
+
+    result = wait_async_op(op, timing);
+    *num_parts = op->num_kernels < BENCH_MAX_PARTS ? op->num_kernels
+                                                   : BENCH_MAX_PARTS;
+    for (size_t i = 0; !result && i < *num_parts; ++i)
+        part_ns[i] = event_elapsed_ns(op->kernels[i]);
+
+    release_async_op(op);
+    return result;
+}
+
+/// Runs the kernel once on the prepared arrays
+static
+cl_int run_once(struct gpu_context* context, enum bench_kernel kernel,
+                struct bench_shape shape, float const* a, float const* b,
+                float* c, struct op_timing* timing, cl_ulong* part_ns,
+                size_t* num_parts)
+{
+    *num_parts = 1;
+    switch (kernel)
+    {
+    case BENCH_GEMM1:
+    case BENCH_GEMM2:
+    case BENCH_GEMM3:
+        return run_lesson_gemm(context, kernel, a, b, c, shape, timing);
+    case BENCH_GEMM4:
+    case BENCH_GEMM4DB:
+    case BENCH_GEMM5:
+    case BENCH_GEMM6:
+    case BENCH_GEMM6X1:
+    case BENCH_GEMM6X4:
+    case BENCH_GEMM6X8:
+    {
+        struct gemm_config const config = bench_gemm_config(context, kernel, shape);
+        return run_gemm_with_config(
+            context, &config, a, b, c, shape.n, shape.m, shape.k, timing
+        );
+    }
+    case BENCH_SCAN:
+    case BENCH_SCAN2:
+        return run_scan_parts(context, a, c, shape.n, timing, part_ns, num_parts);
+    default:
+        return CL_INVALID_VALUE;
+    }
+}
+
+/**
+ * Benchmarks the kernel on the shape: warm-up runs are discarded,
+ * statistics are taken over the timed ones.
+ */
+static
+cl_int bench_kernel(struct gpu_context* context, enum bench_kernel kernel,
+                    struct bench_shape shape, struct bench_options const* options,
+                    struct bench_result* result)
+{
+    bool const gemm = is_gemm(kernel);
+    size_t const a_size = gemm ? shape.n * shape.m : shape.n;
+    size_t const b_size = gemm ? shape.m * shape.k : 0;
+    size_t const c_size = gemm ? shape.n * shape.k : shape.n;
+    cl_int error_code = 0;
+
+    float* const a = malloc(a_size * sizeof(float));
+    float* const b = b_size ? malloc(b_size * sizeof(float)) : NULL;
+    float* const c = malloc(c_size * sizeof(float));
+    cl_ulong* const samples = calloc(
+        (3 + BENCH_MAX_PARTS) * options->reps, sizeof(cl_ulong)
+    );
+    if (!a || (b_size && !b) || !c || !samples)
+    {
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
+
+    cl_ulong const fill_start_ns = host_time_ns();
+    fill_array(a, a_size);
+    if (b)
+        fill_array(b, b_size);
+    trace_host_phase("generate_input", NULL, fill_start_ns, host_time_ns());
+
+    struct op_timing timing;
+    cl_ulong part_ns[BENCH_MAX_PARTS] = {0};
+    size_t num_parts = 1;
+    for (size_t i = 0; i < options->warmup; ++i)
+    {
+        error_code = run_once(
+            context, kernel, shape, a, b, c, &timing, part_ns, &num_parts
+        );
+        CHECK_ERR("Warm-up run failed", error_code, free_arrays);
+    }
+
+    cl_ulong* const kernel_ns = samples;
+    cl_ulong* const transfer_ns = samples + options->reps;
+    cl_ulong* const total_ns = samples + 2 * options->reps;
+    cl_ulong* const parts_ns = samples + 3 * options->reps;
+    for (size_t i = 0; i < options->reps; ++i)
+    {
+        error_code = run_once(
+            context, kernel, shape, a, b, c, &timing, part_ns, &num_parts
+        );
+        CHECK_ERR("Timed run failed", error_code, free_arrays);
+        kernel_ns[i] = timing.kernel_ns;
+        transfer_ns[i] = timing.transfer_ns;
+        total_ns[i] = timing.total_ns;
+        /// Single launch runs are their kernel time
+        for (size_t p = 0; p < BENCH_MAX_PARTS; ++p)
+            parts_ns[p * options->reps + i] = num_parts > 1 ? part_ns[p]
+                                                            : timing.kernel_ns;
+    }
+
+    result->kernel = kernel;
+    result->shape = shape;
+    result->reps = options->reps;
+    result->ops = gemm
+        ? 2.0 * shape.n * shape.m * shape.k
+        : 2.0 * shape.n * log2((double) shape.n);
+    result->kernel_time = compute_stats(kernel_ns, options->reps);
+    result->transfer_time = compute_stats(transfer_ns, options->reps);
+    result->total_time = compute_stats(total_ns, options->reps);
+    result->num_parts = num_parts;
+    for (size_t p = 0; p < num_parts; ++p)
+        result->part_time[p] = compute_stats(
+            parts_ns + p * options->reps, options->reps
+        );
+
+free_arrays:
+    free(a);
+    free(b);
+    free(c);
+    free(samples);
+    return error_code;
+}
+
+static
+void print_table_header(FILE* out)
+{
+    fprintf(
+        out, "%-7s %-16s %5s | %-36s | %-36s | %-36s | %9s\n",
+        "kernel", "shape", "reps",
+        "kernel ms: min median p95 p99", "transfer ms: min median p95 p99",
+        "total ms: min median p95 p99", "GFlops"
+    );
+}
+
+static
+void print_table_stats(FILE* out, struct bench_stats const* stats)
+{
+    fprintf(
+        out, "%8.4f %8.4f %8.4f %8.4f", stats->min / 1e6, stats->median / 1e6,
+        stats->p95 / 1e6, stats->p99 / 1e6
+    );
+}
+
+static
+void print_table_row(FILE* out, struct bench_result const* result)
+{
+    char shape[48];
+    format_shape(result->kernel, result->shape, shape, sizeof(shape));
+    fprintf(
+        out, "%-7s %-16s %5zu | ", bench_kernel_names[result->kernel], shape,
+        result->reps
+    );
+    print_table_stats(out, &result->kernel_time);
+    fprintf(out, " | ");
+    print_table_stats(out, &result->transfer_time);
+    fprintf(out, " | ");
+    print_table_stats(out, &result->total_time);
+    fprintf(out, " | %9.2f\n", result->ops / result->kernel_time.median);
+}
+
+static
+void print_csv_header(FILE* out)
+{
+    fprintf(out, "kernel,n,m,k,reps");
+    char const* const metrics[] = {"kernel", "transfer", "total"};
+    for (size_t i = 0; i < 3; ++i)
+        fprintf(
+            out, ",%s_min_ns,%s_median_ns,%s_p95_ns,%s_p99_ns",
+            metrics[i], metrics[i], metrics[i], metrics[i]
+        );
+    fprintf(out, ",gflops\n");
+}
+
+static
+void print_csv_row(FILE* out, struct bench_result const* result)
+{
+    fprintf(
+        out, "%s,%zu,%zu,%zu,%zu", bench_kernel_names[result->kernel],
+        result->shape.n, result->shape.m, result->shape.k, result->reps
+    );
+    struct bench_stats const* const stats[] =
+    {
+        &result->kernel_time, &result->transfer_time, &result->total_time
+    };
+    for (size_t i = 0; i < 3; ++i)
+        fprintf(
+            out, ",%llu,%llu,%llu,%llu", (unsigned long long) stats[i]->min,
+            (unsigned long long) stats[i]->median,
+            (unsigned long long) stats[i]->p95, (unsigned long long) stats[i]->p99
+        );
+    fprintf(out, ",%.4f\n", result->ops / result->kernel_time.median);
+}
+
+static
+void print_json_stats(FILE* out, char const* name, struct bench_stats const* stats)
+{
+    fprintf(
+        out, "\"%s\": {\"min\": %llu, \"median\": %llu, \"p95\": %llu, \"p99\": %llu}",
+        name, (unsigned long long) stats->min, (unsigned long long) stats->median,
+        (unsigned long long) stats->p95, (unsigned long long) stats->p99
+    );
+}
+
+static
+void print_json_row(FILE* out, struct bench_result const* result, bool last)
+{
+    fprintf(
+        out, "  {\"kernel\": \"%s\", \"n\": %zu, \"m\": %zu, \"k\": %zu, "
+        "\"reps\": %zu, ", bench_kernel_names[result->kernel],
+        result->shape.n, result->shape.m, result->shape.k, result->reps
+    );
+    print_json_stats(out, "kernel_ns", &result->kernel_time);
+    fprintf(out, ", ");
+    print_json_stats(out, "transfer_ns", &result->transfer_time);
+    fprintf(out, ", ");
+    print_json_stats(out, "total_ns", &result->total_time);
+    fprintf(
+        out, ", \"gflops\": %.4f}%s\n", result->ops / result->kernel_time.median,
+        last ? "" : ","
+    );
+}
+
+/// Writes the results in the requested format
+static
+void print_results(FILE* out, enum bench_format format,
+                   struct bench_result const* results, size_t num_results)
+{
+    switch (format)
+    {
+    case BENCH_FORMAT_TABLE:
+        print_table_header(out);
+        for (size_t i = 0; i < num_results; ++i)
+            print_table_row(out, &results[i]);
+        break;
+    case BENCH_FORMAT_CSV:
+        print_csv_header(out);
+        for (size_t i = 0; i < num_results; ++i)
+            print_csv_row(out, &results[i]);
+        break;
+    case BENCH_FORMAT_JSON:
+        fprintf(out, "[\n");
+        for (size_t i = 0; i < num_results; ++i)
+            print_json_row(out, &results[i], i + 1 == num_results);
+        fprintf(out, "]\n");
+        break;
+    }
+}
+
+/**
+ * Prints arithmetic intensity and percent of the roofline of every launch,
+ * at the median kernel time. Global bytes are modelled per kernel from the
+ * tiles it keeps in local memory.
+ */
+static
+cl_int print_roofline(struct gpu_context* context,
+                      struct bench_result const* results, size_t num_results,
+                      FILE* out)
+{
+    /// Peaks are measured with OpenCL kernels
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+    {
+        fprintf(stderr, "Skipping roofline: the native backend has no device peaks\n");
+        return 0;
+    }
+
+    struct device_peaks peaks;
+    cl_int const result = measure_device_peaks(context, &peaks);
+    CHECK_AND_RET_ERR("Failed to measure device peaks", result);
+
+    print_roofline_header(&peaks, out);
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        struct bench_result const* const r = &results[i];
+        struct bench_shape const shape = r->shape;
+        size_t const scan_tile = scan_tile_size(context);
+        char shape_name[48];
+        format_shape(r->kernel, shape, shape_name, sizeof(shape_name));
+
+        struct kernel_cost cost;
+        switch (r->kernel)
+        {
+        case BENCH_GEMM1:
+        case BENCH_GEMM2:
+            cost = gemm_cost(shape.n, shape.m, shape.k, 1);
+            break;
+        case BENCH_GEMM3:
+        {
+            size_t tile;
+            lesson_gemm3_edges(context, shape, &tile);
+            cost = gemm_cost(shape.n, shape.m, shape.k, tile);
+            break;
+        }
+        case BENCH_GEMM4:
+        case BENCH_GEMM4DB:
+        case BENCH_GEMM5:
+        case BENCH_GEMM6:
+        case BENCH_GEMM6X1:
+        case BENCH_GEMM6X4:
+        case BENCH_GEMM6X8:
+            cost = gemm_cost(
+                shape.n, shape.m, shape.k,
+                bench_gemm_config(context, r->kernel, shape).tile_size
+            );
+            break;
+        case BENCH_SCAN:
+            cost = local_scan_cost(shape.n, shape.n);
+            print_roofline_row(
+                "par_scan", shape_name, &cost, r->kernel_time.median, &peaks, out
+            );
+            continue;
+        case BENCH_SCAN2:
+            cost = local_scan_cost(shape.n, scan_tile);
+            print_roofline_row(
+                "local_scan", shape_name, &cost, r->part_time[0].median, &peaks, out
+            );
+            cost = tiles_sum_cost(shape.n, scan_tile);
+            print_roofline_row(
+                "tiles_sum", shape_name, &cost, r->part_time[1].median, &peaks, out
+            );
+            continue;
+        default:
+            continue;
+        }
+        print_roofline_row(
+            bench_kernel_names[r->kernel], shape_name, &cost,
+            r->kernel_time.median, &peaks, out
+        );
+    }
+    return 0;
+}
+
+/**
+ * Splits tab-separated baseline line into fields.
+ * Line format: device, driver version, kernel, n, m, k, reps,
+ * min, median and p95 kernel ns.
+ * \return number of fields found
+ */
+static
+size_t split_baseline_line(char* line, char** fields, size_t max_fields)
+{
+    size_t num = 0;
+    line[strcspn(line, "\n")] = '\0';
+
+    while (num < max_fields)
+    {
+        fields[num++] = line;
+        line = strchr(line, '\t');
+        if (!line)
+            break;
+        *line++ = '\0';
+    }
+    return num;
+}
+
+/// Parses baseline line of the device into \p entry
+static
+bool parse_baseline_line(char* line, struct gpu_context* context,
+                         struct baseline_entry* entry)
+{
+    char* fields[BASELINE_FIELDS];
+    if (split_baseline_line(line, fields, BASELINE_FIELDS) != BASELINE_FIELDS
+        || strcmp(fields[0], context->device_name))
+        return false;
+
+    memset(entry, 0, sizeof(struct baseline_entry));
+    strncpy(entry->driver_version, fields[1], sizeof(entry->driver_version) - 1);
+    entry->kernel = BENCH_KERNELS_NUM;
+    for (size_t i = 0; i < BENCH_KERNELS_NUM; ++i)
+        if (!strcmp(fields[2], bench_kernel_names[i]))
+            entry->kernel = i;
+    entry->shape.n = strtoul(fields[3], NULL, 10);
+    entry->shape.m = strtoul(fields[4], NULL, 10);
+    entry->shape.k = strtoul(fields[5], NULL, 10);
+    entry->reps = strtoul(fields[6], NULL, 10);
+    entry->kernel_time.min = strtoull(fields[7], NULL, 10);
+    entry->kernel_time.median = strtoull(fields[8], NULL, 10);
+    entry->kernel_time.p95 = strtoull(fields[9], NULL, 10);
+    return entry->kernel != BENCH_KERNELS_NUM && entry->kernel_time.median;
+}
+
+static
+bool same_case(enum bench_kernel kernel, struct bench_shape shape,
+               struct bench_result const* result)
+{
+    return kernel == result->kernel && shape.n == result->shape.n
+        && shape.m == result->shape.m && shape.k == result->shape.k;
+}
+
+/**
+ * Writes kernel times of the results to the baseline file. Entries of other
+ * devices and of cases which weren't run are kept as is.
+ */
+static
+cl_int save_baseline(struct gpu_context* context, char const* file_name,
+                     struct bench_result const* results, size_t num_results)
+{
+    char tmp_name[4096];
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", file_name, (long) getpid());
+
+    FILE* out = fopen(tmp_name, "w");
+    if (!out)
+    {
+        perror("Error writing baseline");
+        return -1;
+    }
+
+    FILE* in = fopen(file_name, "r");
+    if (in)
+    {
+        char line[512];
+        char copy[512];
+        struct baseline_entry entry;
+        while (fgets(line, sizeof(line), in))
+        {
+            strcpy(copy, line);
+            bool replaced = false;
+            if (parse_baseline_line(copy, context, &entry))
+                for (size_t i = 0; i < num_results && !replaced; ++i)
+                    replaced = same_case(entry.kernel, entry.shape, &results[i]);
+            if (!replaced)
+                fputs(line, out);
+        }
+        fclose(in);
+    }
+
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        struct bench_result const* const r = &results[i];
+        fprintf(
+            out, "%s\t%s\t%s\t%zu\t%zu\t%zu\t%zu\t%llu\t%llu\t%llu\n",
+            context->device_name, context->driver_version,
+            bench_kernel_names[r->kernel], r->shape.n, r->shape.m, r->shape.k,
+            r->reps, (unsigned long long) r->kernel_time.min,
+            (unsigned long long) r->kernel_time.median,
+            (unsigned long long) r->kernel_time.p95
+        );
+    }
+
+    if (fclose(out) || rename(tmp_name, file_name))
+    {
+        perror("Error writing baseline");
+        remove(tmp_name);
+        return -1;
+    }
+
+    fprintf(stderr, "Saved %zu cases to baseline %s\n", num_results, file_name);
+    return 0;
+}
+
+/**
+ * Compares median kernel times against the baseline of the device.
+ * A case is only significant if its medians differ by more than
+ * \p threshold percent and the runs don't overlap: every run of a
+ * regression is slower than the baseline's p95, every run of
+ * an improvement is faster than the baseline's min.
+ * \param regressions Set to the number of significant regressions
+ */
+static
+cl_int compare_baseline(struct gpu_context* context, char const* file_name,
+                        double threshold, struct bench_result const* results,
+                        size_t num_results, FILE* out, size_t* regressions)
+{
+    *regressions = 0;
+
+    FILE* in = fopen(file_name, "r");
+    if (!in)
+    {
+        perror("Error opening baseline");
+        return -1;
+    }
+
+    struct baseline_entry* const entries = calloc(
+        num_results, sizeof(struct baseline_entry)
+    );
+    if (!entries)
+    {
+        fclose(in);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    char line[512];
+    struct baseline_entry entry;
+    while (fgets(line, sizeof(line), in))
+    {
+        if (!parse_baseline_line(line, context, &entry))
+            continue;
+        for (size_t i = 0; i < num_results; ++i)
+            if (same_case(entry.kernel, entry.shape, &results[i]))
+                entries[i] = entry;
+    }
+    fclose(in);
+
+    fprintf(
+        out, "Baseline %s on %s, driver %s\n", file_name, context->device_name,
+        context->driver_version
+    );
+    fprintf(
+        out, "%-7s %-16s %12s %12s %9s %-11s\n", "kernel", "shape",
+        "base ms", "median ms", "speedup", "verdict"
+    );
+
+    for (size_t i = 0; i < num_results; ++i)
+    {
+        struct bench_result const* const r = &results[i];
+        struct bench_stats const* const base = &entries[i].kernel_time;
+        char shape[48];
+        format_shape(r->kernel, r->shape, shape, sizeof(shape));
+
+        if (!base->median)
+        {
+            fprintf(
+                out, "%-7s %-16s %12s %12.4f %9s %-11s\n",
+                bench_kernel_names[r->kernel], shape, "-",
+                r->kernel_time.median / 1e6, "-", "new"
+            );
+            continue;
+        }
+
+        double const speedup = (double) base->median / r->kernel_time.median;
+        char const* verdict = "same";
+        if (speedup < 1 / (1 + threshold / 100) && r->kernel_time.min > base->p95)
+        {
+            verdict = "REGRESSION";
+            ++*regressions;
+        }
+        else if (speedup > 1 + threshold / 100 && r->kernel_time.p95 < base->min)
+            verdict = "faster";
+
+        fprintf(
+            out, "%-7s %-16s %12.4f %12.4f %8.3fx %-11s", bench_kernel_names[r->kernel],
+            shape, base->median / 1e6, r->kernel_time.median / 1e6, speedup, verdict
+        );
+        if (strcmp(entries[i].driver_version, context->driver_version))
+            fprintf(out, " (baseline driver %s)", entries[i].driver_version);
+        fprintf(out, "\n");
+    }
+
+    free(entries);
+    return 0;
+}
+
+/// Parses comma-separated list of "N" or "NxMxK" shapes
+static
+bool parse_shapes(char const* list, struct bench_options* options)
+{
+    options->num_shapes = 0;
+    while (*list)
+    {
+        if (options->num_shapes == BENCH_MAX_SHAPES)
+            return false;
+
+        char* end = NULL;
+        struct bench_shape shape;
+        shape.n = strtoul(list, &end, 10);
+        shape.m = shape.k = shape.n;
+        if (*end == 'x')
+        {
+            shape.m = strtoul(end + 1, &end, 10);
+            if (*end != 'x')
+                return false;
+            shape.k = strtoul(end + 1, &end, 10);
+        }
+        if (!shape.n || !shape.m || !shape.k || (*end && *end != ','))
+            return false;
+
+        options->shapes[options->num_shapes++] = shape;
+        list = *end ? end + 1 : end;
+    }
+    return options->num_shapes > 0;
+}
+
+/// Parses comma-separated kernel names, "all" selects every kernel
+static
+bool parse_kernels(char const* list, struct bench_options* options)
+{
+    memset(options->kernels, 0, sizeof(options->kernels));
+    while (*list)
+    {
+        size_t const len = strcspn(list, ",");
+        bool found = false;
+        for (size_t i = 0; i < BENCH_KERNELS_NUM; ++i)
+        {
+            bool const all = len == 3 && !strncmp(list, "all", 3);
+            if (all || (strlen(bench_kernel_names[i]) == len
+                        && !strncmp(list, bench_kernel_names[i], len)))
+            {
+                options->kernels[i] = true;
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+        list += len + (list[len] == ',');
+    }
+    return true;
+}
+
+static
+void print_usage(char const* name)
+{
+    fprintf(
+        stderr,
+        "Usage: %s [--kernels all|gemm1,gemm2,gemm3,gemm4,gemm4db,gemm5,gemm6,\n"
+        "          gemm6x1,gemm6x4,gemm6x8,scan,scan2]\n"
+        "          [--sizes N|NxMxK,...] [--warmup W] [--reps R]\n"
+        "          [--format table|csv|json] [--output FILE] [--trace FILE]\n"
+        "          [--roofline] [--save-baseline FILE] [--compare FILE]\n"
+        "          [--threshold PCT] [--backend auto|opencl|native]\n"
+        "Gemm sizes are NxMxK or N for square matrices, scans take N elements.\n"
+        "gemm6 runs on the device's preferred vector width, gemm6xW on W floats.\n"
+        "--trace writes Chrome trace of the run, as does " TRACE_FILE_ENV "=FILE.\n"
+        "--roofline measures the device's peaks and prints the runs against them.\n"
+        "--save-baseline stores the kernel times of the device, --compare prints\n"
+        "speedups against them and exits with %d on slowdowns over PCT (default\n"
+        "%.0f) percent which are beyond the runs' spread.\n",
+        name, BENCH_EXIT_REGRESSION, BENCH_DEFAULT_THRESHOLD
+    );
+}
+
+static
+bool parse_options(int argc, char** argv, struct bench_options* options)
+{
+    memset(options, 0, sizeof(struct bench_options));
+    options->warmup = BENCH_DEFAULT_WARMUP;
+    options->reps = BENCH_DEFAULT_REPS;
+    options->format = BENCH_FORMAT_TABLE;
+    options->threshold = BENCH_DEFAULT_THRESHOLD;
+    char const* const backend = getenv(BACKEND_ENV);
+    if (backend && *backend)
+        parse_backend(backend, &options->backend);
+    parse_kernels("all", options);
+    parse_shapes(default_sizes, options);
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--roofline"))
+        {
+            options->roofline = true;
+            continue;
+        }
+
+        char const* const value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = value != NULL;
+
+        if (!strcmp(argv[i], "--kernels") && value)
+            ok = parse_kernels(value, options);
+        else if (!strcmp(argv[i], "--sizes") && value)
+            ok = parse_shapes(value, options);
+        else if (!strcmp(argv[i], "--warmup") && value)
+            options->warmup = strtoul(value, NULL, 10);
+        else if (!strcmp(argv[i], "--reps") && value)
+            ok = (options->reps = strtoul(value, NULL, 10)) > 0;
+        else if (!strcmp(argv[i], "--format") && value)
+        {
+            if (!strcmp(value, "table"))
+                options->format = BENCH_FORMAT_TABLE;
+            else if (!strcmp(value, "csv"))
+                options->format = BENCH_FORMAT_CSV;
+            else if (!strcmp(value, "json"))
+                options->format = BENCH_FORMAT_JSON;
+            else
+                ok = false;
+        }
+        else if (!strcmp(argv[i], "--output") && value)
+            options->output = value;
+        else if (!strcmp(argv[i], "--save-baseline") && value)
+            options->save_baseline = value;
+        else if (!strcmp(argv[i], "--compare") && value)
+            options->compare = value;
+        else if (!strcmp(argv[i], "--backend") && value)
+            ok = parse_backend(value, &options->backend);
+        else if (!strcmp(argv[i], "--threshold") && value)
+            ok = (options->threshold = strtod(value, NULL)) >= 0;
+        else if (!strcmp(argv[i], "--trace") && value)
+            ok = !enable_trace(value);
+        else
+            ok = false;
+
+        if (!ok)
+            return false;
+        ++i;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    struct bench_options options;
+    if (!parse_options(argc, argv, &options))
+    {
+        print_usage(argv[0]);
+        return -1;
+    }
+
+    cl_int error_code;
+
+    struct gpu_context* context = setup_gpu_context_with_backend(
+        options.backend, NULL, 0, &error_code
+    );
+    CHECK_AND_RET_ERR("startup failed", error_code);
+
+    if (context->backend == CLFUN_BACKEND_OPENCL)
+        fprintf(
+            stderr, "Preferred float vector width: %u\n",
+            context->preferred_vector_width
+        );
+
+    struct bench_result* const results = calloc(
+        BENCH_KERNELS_NUM * options.num_shapes, sizeof(struct bench_result)
+    );
+    size_t num_results = 0;
+    FILE* out = stdout;
+
+    if (!results)
+    {
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto return_error;
+    }
+
+    for (size_t i = 0; i < BENCH_KERNELS_NUM; ++i)
+    {
+        for (size_t j = 0; options.kernels[i] && j < options.num_shapes; ++j)
+        {
+            if (!shape_supported(context, i, options.shapes[j]))
+                continue;
+
+            char name[48];
+            format_shape(i, options.shapes[j], name, sizeof(name));
+            fprintf(stderr, "Running %s %s\n", bench_kernel_names[i], name);
+            error_code = bench_kernel(
+                context, i, options.shapes[j], &options, &results[num_results]
+            );
+            CHECK_ERR("benchmark failed", error_code, return_error);
+            ++num_results;
+        }
+    }
+
+    if (options.output)
+    {
+        out = fopen(options.output, "w");
+        if (!out)
+        {
+            perror("Error opening output file");
+            error_code = -1;
+            goto return_error;
+        }
+    }
+
+    print_results(out, options.format, results, num_results);
+
+    /// The report isn't CSV or JSON, so it goes to stderr along with them
+    if (options.roofline)
+        error_code = print_roofline(
+            context, results, num_results,
+            options.format == BENCH_FORMAT_TABLE ? out : stderr
+        );
+
+    /// Compared first, so that a run can be checked against the file it updates
+    size_t regressions = 0;
+    if (!error_code && options.compare)
+        error_code = compare_baseline(
+            context, options.compare, options.threshold, results, num_results,
+            options.format == BENCH_FORMAT_TABLE ? out : stderr, &regressions
+        );
+    if (!error_code && options.save_baseline)
+        error_code = save_baseline(
+            context, options.save_baseline, results, num_results
+        );
+
+    if (out != stdout)
+        fclose(out);
+
+    if (regressions)
+        fprintf(stderr, "%zu significant regressions\n", regressions);
+
+return_error:
+    free(results);
+    release_gpu_context(context);
+    if (error_code)
+        return -1;
+    return regressions ? BENCH_EXIT_REGRESSION : 0;
+}
@@ -0,0 +1,175 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer_pool.h"
+
+void init_buffer_pool(struct buffer_pool* pool, cl_context context)
+{
+    assert(pool);
+
+    memset(pool, 0, sizeof(struct buffer_pool));
+    pool->context = context;
+    pthread_mutex_init(&pool->lock, NULL);
+}
+
+void release_buffer_pool(struct buffer_pool* pool)
+{
+    if (!pool)
+        return;
+
+    trim_buffer_pool(pool);
+    free(pool->free_list);
+    pool->free_list = NULL;
+    pool->free_list_cap = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
+
+size_t buffer_size_class(size_t size)
+{
+    size_t const min_class = (size_t) 1 << BUFFER_POOL_MIN_CLASS_LOG;
+    if (size <= min_class)
+        return min_class;
+
+    /// Four classes per power of two keep the rounding waste under 25%
+    size_t log = 0;
+    while (((size_t) 1 << (log + 1)) <= size)
+        ++log;
+
+    size_t const step = (size_t) 1 << (log - 2);
+    return (size + step - 1) / step * step;
+}
+
+static
+void drop_free_entry(struct buffer_pool* pool, size_t i)
+{
+    clReleaseMemObject(pool->free_list[i].mem);
+    pool->allocated_bytes -= pool->free_list[i].size;
+    pool->free_list[i] = pool->free_list[--pool->num_free];
+}
+
+void set_buffer_pool_limit(struct buffer_pool* pool, size_t limit_bytes)
+{
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->limit_bytes = limit_bytes;
+    while (limit_bytes && pool->num_free && pool->allocated_bytes > limit_bytes)
+        drop_free_entry(pool, pool->num_free - 1);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+cl_mem acquire_buffer(struct buffer_pool* pool, cl_mem_flags flags,
+                      size_t size, cl_int* error)
+{
+    assert(pool);
+    assert(error);
+
+    size_t const size_class = buffer_size_class(size);
+    cl_mem mem = NULL;
+    *error = 0;
+
+    pthread_mutex_lock(&pool->lock);
+
+    for (size_t i = 0; i < pool->num_free; ++i)
+    {
+        struct pool_entry const entry = pool->free_list[i];
+        if (entry.size == size_class && entry.flags == flags)
+        {
+            pool->free_list[i] = pool->free_list[--pool->num_free];
+            pool->in_use_bytes += size_class;
+            ++pool->hits;
+            mem = entry.mem;
+            goto unlock;
+        }
+    }
+
+    /// Free buffers of other classes make room for the new one
+    while (pool->limit_bytes && pool->num_free
+           && pool->allocated_bytes + size_class > pool->limit_bytes)
+        drop_free_entry(pool, pool->num_free - 1);
+
+    if (pool->limit_bytes && pool->allocated_bytes + size_class > pool->limit_bytes)
+    {
+        *error = CL_MEM_OBJECT_ALLOCATION_FAILURE;
+        goto unlock;
+    }
+
+    mem = clCreateBuffer(pool->context, flags, size_class, 0, error);
+    if (*error)
+        goto unlock;
+
+    ++pool->misses;
+    pool->allocated_bytes += size_class;
+    pool->in_use_bytes += size_class;
+    if (pool->allocated_bytes > pool->high_water_mark)
+        pool->high_water_mark = pool->allocated_bytes;
+
+unlock:
+    pthread_mutex_unlock(&pool->lock);
+    return mem;
+}
+
+void release_buffer(struct buffer_pool* pool, cl_mem mem)
+{
+    assert(pool);
+
+    if (!mem)
+        return;
+
+    struct pool_entry entry = {mem, 0, 0};
+    clGetMemObjectInfo(mem, CL_MEM_FLAGS, sizeof(cl_mem_flags), &entry.flags, 0);
+    clGetMemObjectInfo(mem, CL_MEM_SIZE, sizeof(size_t), &entry.size, 0);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use_bytes -= entry.size;
+
+    if (pool->num_free == pool->free_list_cap)
+    {
+        size_t const new_cap = pool->free_list_cap ? pool->free_list_cap * 2 : 16;
+        struct pool_entry* free_list = realloc(
+            pool->free_list, new_cap * sizeof(struct pool_entry)
+        );
+
+        /// Can't keep it, so give it back to the driver
+        if (!free_list)
+        {
+            clReleaseMemObject(mem);
+            pool->allocated_bytes -= entry.size;
+            goto unlock;
+        }
+
+        pool->free_list = free_list;
+        pool->free_list_cap = new_cap;
+    }
+
+    pool->free_list[pool->num_free++] = entry;
+
+unlock:
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void trim_buffer_pool(struct buffer_pool* pool)
+{
+    assert(pool);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->num_free)
+        drop_free_entry(pool, pool->num_free - 1);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void print_buffer_pool_stats(struct buffer_pool const* pool, FILE* out)
+{
+    size_t const requests = pool->hits + pool->misses;
+    fprintf(
+        out,
+        "Buffer pool: %zu requests, %.1f%% reused, %.2f MiB held "
+        "(%.2f MiB in use, high-water mark %.2f MiB)\n",
+        requests, requests ? 100.0 * pool->hits / requests : 0.0,
+        pool->allocated_bytes / 1048576.0, pool->in_use_bytes / 1048576.0,
+        pool->high_water_mark / 1048576.0
+    );
+    if (pool->limit_bytes)
+        fprintf(out, "Buffer pool limit: %.2f MiB\n", pool->limit_bytes / 1048576.0);
+}
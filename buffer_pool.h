@@ -0,0 +1,77 @@
+#ifndef OPENCL_FUN_BUFFER_POOL_H
+#define OPENCL_FUN_BUFFER_POOL_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include <CL/opencl.h>
+
+/// Buffers smaller than 2^BUFFER_POOL_MIN_CLASS_LOG bytes share the smallest class
+#define BUFFER_POOL_MIN_CLASS_LOG 12
+
+/// Released buffer waiting to be reused
+struct pool_entry
+{
+    cl_mem          mem;
+    cl_mem_flags    flags;
+    size_t          size;   //!< Size class of the buffer, in bytes
+};
+
+/**
+ * Size-class pool of device buffers. Released buffers go to the free list and
+ * serve later requests of the same class and flags, so that same-sized
+ * operations stop paying for clCreateBuffer. All functions may be called
+ * from several threads, e.g. from completion callbacks.
+ */
+struct buffer_pool
+{
+    cl_context          context;
+    pthread_mutex_t     lock;
+
+    struct pool_entry*  free_list;
+    size_t              num_free;
+    size_t              free_list_cap;
+
+    size_t              allocated_bytes;    //!< Held by the pool, in use or free
+    size_t              in_use_bytes;       //!< Handed out and not released yet
+    size_t              high_water_mark;    //!< Max of allocated_bytes so far
+    size_t              limit_bytes;        //!< Bound of allocated_bytes, 0 if unbounded
+
+    size_t              hits;               //!< Requests served from the free list
+    size_t              misses;             //!< Requests which created a buffer
+};
+
+/// Initializes empty pool of the context's buffers
+void init_buffer_pool(struct buffer_pool* pool, cl_context context);
+
+/**
+ * Bounds the bytes the pool holds, in use or free, 0 removes the bound.
+ * Free buffers over the new bound are dropped at once, buffers in use are
+ * left to their owners and make later requests fail until released.
+ */
+void set_buffer_pool_limit(struct buffer_pool* pool, size_t limit_bytes);
+
+/// Releases all free buffers, buffers still in use are left to their owners
+void release_buffer_pool(struct buffer_pool* pool);
+
+/// Size class the pool rounds \p size up to
+size_t buffer_size_class(size_t size);
+
+/**
+ * Returns buffer of at least \p size bytes, reusing a free one if possible.
+ * When the pool limit would be exceeded free buffers are dropped first,
+ * after that CL_MEM_OBJECT_ALLOCATION_FAILURE is reported.
+ */
+cl_mem acquire_buffer(struct buffer_pool* pool, cl_mem_flags flags,
+                      size_t size, cl_int* error);
+
+/// Returns the buffer to the free list, NULL is ignored
+void release_buffer(struct buffer_pool* pool, cl_mem mem);
+
+/// Drops all free buffers
+void trim_buffer_pool(struct buffer_pool* pool);
+
+/// Prints hit rate and memory accounting of the pool
+void print_buffer_pool_stats(struct buffer_pool const* pool, FILE* out);
+
+#endif //OPENCL_FUN_BUFFER_POOL_H
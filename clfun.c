@@ -0,0 +1,1981 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "clfun.h"
+#include "const.h"
+#include "async_op.h"
+#include "autotune.h"
+#include "buffer_pool.h"
+#include "native.h"
+#include "program_cache.h"
+#include "trace.h"
+
+char const* const clfun_default_sources[] =
+{
+    "const.h",
+    "gemm4.cl",
+    "par_scan.cl",
+    "par_scan2.cl",
+    "array_sum.cl"
+};
+
+size_t const clfun_default_sources_num
+    = sizeof(clfun_default_sources) / sizeof(char const*);
+
+/// Gemm kernels: name, sources of the specialized variants, kernel function
+/// and the build options selecting the kernel in its sources
+static struct
+{
+    char const*     name;
+    char const*     sources[2];
+    char const*     function;
+    char const*     options;
+} const gemm_kernels[GEMM_KERNELS_NUM] =
+{
+    {"gemm4",   {"const.h", "gemm4.cl"}, "gemm4", ""},
+    {"gemm5",   {"const.h", "gemm5.cl"}, "gemm5", ""},
+    {"gemm6",   {"const.h", "gemm6.cl"}, "gemm6", ""},
+    {"gemm4db", {"const.h", "gemm4.cl"}, "gemm4", " -DGEMM_DOUBLE_BUFFER"},
+};
+
+/// Sources of the scan variants
+static char const* const scan_sources[] =
+{
+    "const.h",
+    "par_scan.cl",
+    "par_scan2.cl"
+};
+
+char* load_source_file(char const* file_name, size_t* len)
+{
+    FILE* source_file = fopen(file_name, "r");
+    if (!source_file)
+    {
+        perror("Error opening source file");
+        return NULL;
+    }
+
+    size_t const file_load_sz = 1024 * 1024;
+    char* program_code = malloc(file_load_sz);
+    if (!program_code)
+    {
+        fclose(source_file);
+        return NULL;
+    }
+
+    size_t code_len = fread(program_code, 1, file_load_sz - 1, source_file);
+    program_code[code_len] = '\0';
+    *len = code_len;
+
+    fclose(source_file);
+    return program_code;
+}
+
+cl_ulong event_elapsed_ns(cl_event event)
+{
+    cl_ulong t_start = 0, t_end = 0;
+    clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, 0
+    );
+    clGetEventProfilingInfo(
+        event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, 0
+    );
+    return t_end - t_start;
+}
+
+cl_ulong host_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (cl_ulong) ts.tv_sec * 1000000000ull + (cl_ulong) ts.tv_nsec;
+}
+
+/// Destructor for \ref program_variant
+static
+void release_program_variant(struct program_variant* variant)
+{
+    if (!variant)
+        return;
+
+    if (variant->kernels)
+    {
+        for (size_t i = 0; i < variant->num_kernels; ++i)
+        {
+            if (variant->kernels[i])
+                clReleaseKernel(variant->kernels[i]);
+            free(variant->kernel_names[i]);
+        }
+        free(variant->kernels);
+        free(variant->kernel_names);
+    }
+
+    if (variant->program)
+        clReleaseProgram(variant->program);
+    free(variant->sources_key);
+    free(variant->options);
+    free(variant);
+}
+
+void release_gpu_context(struct gpu_context* context)
+{
+    if (!context)
+        return;
+
+    for (size_t i = 0; i < context->num_variants; ++i)
+        release_program_variant(context->variants[i]);
+    free(context->variants);
+    free(context->tuning_entries);
+    release_buffer_pool(&context->buffer_pool);
+
+    if (context->transfer_queue)
+        clReleaseCommandQueue(context->transfer_queue);
+    if (context->command_queue)
+        clReleaseCommandQueue(context->command_queue);
+    if (context->context)
+        clReleaseContext(context->context);
+    if (context->selected_device)
+        clReleaseDevice(context->selected_device);
+    pthread_mutex_destroy(&context->submit_lock);
+    free(context);
+}
+
+static inline
+char const* get_mem_type_str(cl_device_local_mem_type t)
+{
+    switch (t)
+    {
+    case CL_LOCAL:
+        return "local";
+    case CL_GLOBAL:
+        return "global";
+    default:
+        return "other";
+    }
+}
+
+/// Creates context and command queue of the selected device
+static
+cl_int create_context_and_queue(struct gpu_context* context)
+{
+    cl_int error_code = 0;
+
+    context->context = clCreateContext(
+        0, 1, &context->selected_device, 0, 0, &error_code
+    );
+    CHECK_AND_RET_ERR("Error creating context", error_code);
+
+    context->command_queue = clCreateCommandQueue(
+        context->context, context->selected_device, CL_QUEUE_PROFILING_ENABLE,
+        &error_code
+    );
+    CHECK_AND_RET_ERR("Error creating command queue", error_code);
+
+    trace_queue(context->command_queue);
+    return 0;
+}
+
+cl_int select_device(struct gpu_context* context)
+{
+    assert(context);
+
+    cl_int error_code;
+    cl_uint num_platforms;
+
+    error_code = clGetPlatformIDs(0, 0, &num_platforms);
+    if (error_code)
+    {
+        fprintf(stderr, "Error getting platforms list!\n");
+        return error_code;
+    }
+
+    cl_platform_id* platforms = calloc(num_platforms, sizeof(cl_platform_id));
+
+    error_code = clGetPlatformIDs(num_platforms, platforms, &num_platforms);
+    if (error_code)
+    {
+        fprintf(stderr, "Error getting platforms list!\n");
+        free(platforms);
+        return error_code;
+    }
+
+    cl_uint num_devices = 0;
+    size_t max_devices = 42;
+    cl_device_id device_list[max_devices];
+    char device_name[64];
+
+    cl_device_local_mem_type mem_type = CL_NONE;
+    size_t max_work_group_size = 0;
+
+    for (size_t i = 0; i < num_platforms; ++i)
+    {
+        error_code = clGetDeviceIDs(
+            platforms[i], CL_DEVICE_TYPE_ALL, max_devices, device_list,
+            &num_devices
+        );
+
+        if (error_code) continue;
+
+        for (size_t j = 0; j < num_devices; ++j)
+        {
+            if (!context->selected_device)
+                context->selected_device = device_list[j];
+
+            size_t ret_sz = 0;
+            cl_device_local_mem_type cur_mem_type = 0;
+            size_t work_group_size = 0;
+
+            error_code = clGetDeviceInfo(
+                device_list[j], CL_DEVICE_LOCAL_MEM_TYPE,
+                sizeof(cl_device_local_mem_type), &cur_mem_type, &ret_sz
+            );
+
+            if (error_code)
+            {
+                if (context->selected_device != device_list[j])
+                    clReleaseDevice(device_list[j]);
+                continue;
+            }
+
+            error_code = clGetDeviceInfo(
+                device_list[j], CL_DEVICE_MAX_WORK_GROUP_SIZE,
+                sizeof(size_t), &work_group_size, &ret_sz
+            );
+
+            if (error_code)
+            {
+                if (context->selected_device != device_list[j])
+                    clReleaseDevice(device_list[j]);
+                continue;
+            }
+
+            error_code = clGetDeviceInfo(
+                device_list[j], CL_DEVICE_NAME, 63, device_name, &ret_sz
+            );
+
+            device_name[ret_sz] = '\0';
+            fprintf(
+                stderr,
+                "Found device \"%s\": mem type %s, max workgroup size %zu\n",
+                device_name, get_mem_type_str(cur_mem_type), work_group_size
+            );
+
+            if ((mem_type != CL_LOCAL && cur_mem_type == CL_LOCAL)
+                || (cur_mem_type == mem_type
+                    && max_work_group_size < work_group_size))
+            {
+                if (context->selected_device != device_list[j])
+                    clReleaseDevice(context->selected_device);
+                context->selected_device = device_list[j];
+                max_work_group_size = work_group_size;
+                mem_type = cur_mem_type;
+            }
+            else if (context->selected_device != device_list[j])
+                clReleaseDevice(device_list[j]);
+        }
+    }
+
+    free(platforms);
+
+    if (!context->selected_device)
+        return error_code ? error_code : CL_DEVICE_NOT_FOUND;
+    else
+    {
+        size_t ret_sz;
+        clGetDeviceInfo(
+            context->selected_device, CL_DEVICE_NAME, 63, device_name, &ret_sz
+        );
+        device_name[ret_sz] = '\0';
+
+        fprintf(stderr, "Selected device: %s\n", device_name);
+    }
+
+    return create_context_and_queue(context);
+}
+
+cl_int load_program(struct gpu_context* context,
+                    char const* const* sources_list, size_t src_list_sz,
+                    char const* options, struct program_variant* variant)
+{
+    assert(context);
+    assert(context->selected_device);
+    assert(context->context);
+    assert(variant);
+
+    char const* file_data[src_list_sz];
+    size_t lens[src_list_sz];
+    cl_int result = 0;
+    cl_ulong const phase_start_ns = host_time_ns();
+
+    memset(file_data, 0, sizeof(char const*) * src_list_sz);
+
+    for (size_t i = 0; i < src_list_sz; ++i)
+    {
+        file_data[i] = load_source_file(sources_list[i], &lens[i]);
+        if (!file_data[i])
+        {
+            result = -1;
+            goto return_error;
+        }
+    }
+
+    cl_ulong const start_ns = host_time_ns();
+    uint64_t const cache_key = program_cache_key(
+        context->selected_device, file_data, lens, src_list_sz, options
+    );
+
+    variant->program = load_cached_program(
+        context->context, context->selected_device, cache_key, options
+    );
+    if (variant->program)
+    {
+        variant->cache_hit = true;
+        variant->load_ns = host_time_ns() - start_ns;
+        fprintf(
+            stderr, "Program cache hit [%s]: loaded in %.3f ms\n",
+            options, variant->load_ns / 1e6
+        );
+        goto return_error;
+    }
+
+    variant->program = clCreateProgramWithSource(
+        context->context, src_list_sz, file_data, lens, &result
+    );
+    CHECK_ERR("Failed to create clProgram", result, return_error);
+
+    result = clBuildProgram(
+        variant->program, 1, &context->selected_device, options, 0, 0
+    );
+
+    if (result)
+    {
+        fprintf(stderr, "kernel compilation failed\n");
+        size_t log_len = 0;
+        cl_int saved_error_code = result;
+        char* build_log;
+
+        result = clGetProgramBuildInfo(
+            variant->program, context->selected_device,
+            CL_PROGRAM_BUILD_LOG, 0, 0, &log_len
+        );
+        CHECK_ERR("Failed to retrieve build's log", result, return_error);
+
+        build_log = malloc(log_len);
+        result = clGetProgramBuildInfo(
+            variant->program, context->selected_device,
+            CL_PROGRAM_BUILD_LOG, log_len, build_log, &log_len
+        );
+
+        if (result)
+        {
+            fprintf(stderr, "Failed to retrieve build's log: %d", result);
+            free(build_log);
+            goto return_error;
+        }
+
+        fprintf(stderr, "Kernel compilation log:\n%s\n", build_log);
+        free(build_log);
+        result = saved_error_code;
+        goto return_error;
+    }
+
+    variant->cache_hit = false;
+    variant->load_ns = host_time_ns() - start_ns;
+    fprintf(
+        stderr, "Program cache miss [%s]: built in %.3f ms\n",
+        options, variant->load_ns / 1e6
+    );
+
+    if (store_cached_program(variant->program, cache_key))
+        fprintf(stderr, "Failed to store program in the cache\n");
+
+return_error:
+    /// Program which failed to build is of no use to the variant
+    if (result && variant->program)
+    {
+        clReleaseProgram(variant->program);
+        variant->program = NULL;
+    }
+    if (variant->program)
+    {
+        char detail[256];
+        snprintf(
+            detail, sizeof(detail), "%s [%s]",
+            variant->cache_hit ? "cache hit" : "built", options
+        );
+        trace_host_phase("load_program", detail, phase_start_ns, host_time_ns());
+    }
+    for (size_t i = 0; i < src_list_sz; ++i)
+        free((void*) file_data[i]);
+    return result;
+}
+
+/// Allocates empty context, to be destroyed with \ref release_gpu_context
+static
+struct gpu_context* alloc_gpu_context(cl_int* error)
+{
+    struct gpu_context* const context = calloc(1, sizeof(struct gpu_context));
+    if (!context)
+    {
+        *error = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    pthread_mutex_init(&context->submit_lock, NULL);
+    return context;
+}
+
+/**
+ * Queries the selected device's properties and builds the program,
+ * everything \ref setup_gpu_context does after the device has been chosen.
+ */
+static
+cl_int init_gpu_context(struct gpu_context* context,
+                        char const* const* sources_list, size_t src_list_sz)
+{
+    cl_int result = 0;
+
+    if (!sources_list)
+    {
+        sources_list = clfun_default_sources;
+        src_list_sz = clfun_default_sources_num;
+    }
+
+    context->backend = CLFUN_BACKEND_OPENCL;
+    context->max_work_group_size = 0;
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+        sizeof(size_t), &context->max_work_group_size, 0
+    );
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_GLOBAL_MEM_SIZE,
+        sizeof(cl_ulong), &context->global_mem_size, 0
+    );
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_MAX_MEM_ALLOC_SIZE,
+        sizeof(cl_ulong), &context->max_mem_alloc_size, 0
+    );
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_LOCAL_MEM_SIZE,
+        sizeof(cl_ulong), &context->local_mem_size, 0
+    );
+    context->preferred_vector_width = 1;
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT,
+        sizeof(cl_uint), &context->preferred_vector_width, 0
+    );
+    context->specialize_shapes = false;
+    init_buffer_pool(&context->buffer_pool, context->context);
+
+    clGetDeviceInfo(
+        context->selected_device, CL_DEVICE_NAME,
+        sizeof(context->device_name) - 1, context->device_name, 0
+    );
+    clGetDeviceInfo(
+        context->selected_device, CL_DRIVER_VERSION,
+        sizeof(context->driver_version) - 1, context->driver_version, 0
+    );
+    load_tuning_db(context);
+
+    get_program_variant(context, sources_list, src_list_sz, "", &result);
+    return result;
+}
+
+bool parse_backend(char const* name, enum clfun_backend* backend)
+{
+    if (!strcmp(name, "auto"))
+        *backend = CLFUN_BACKEND_AUTO;
+    else if (!strcmp(name, "opencl"))
+        *backend = CLFUN_BACKEND_OPENCL;
+    else if (!strcmp(name, "native"))
+        *backend = CLFUN_BACKEND_NATIVE;
+    else
+        return false;
+    return true;
+}
+
+struct gpu_context* setup_gpu_context(char const* const* sources_list,
+                                      size_t src_list_sz,
+                                      cl_int* error)
+{
+    enum clfun_backend backend = CLFUN_BACKEND_AUTO;
+    char const* const name = getenv(BACKEND_ENV);
+    if (name && *name && !parse_backend(name, &backend))
+        fprintf(stderr, "Unknown %s \"%s\", using auto\n", BACKEND_ENV, name);
+
+    return setup_gpu_context_with_backend(
+        backend, sources_list, src_list_sz, error
+    );
+}
+
+struct gpu_context* setup_gpu_context_with_backend(enum clfun_backend backend,
+                                                   char const* const* sources_list,
+                                                   size_t src_list_sz,
+                                                   cl_int* error)
+{
+    assert(error != 0);
+
+    *error = 0;
+
+    struct gpu_context* context = alloc_gpu_context(error);
+    if (!context)
+        return NULL;
+
+    if (backend == CLFUN_BACKEND_NATIVE)
+    {
+        init_native_context(context);
+        return context;
+    }
+
+    cl_ulong const start_ns = host_time_ns();
+    *error = select_device(context);
+    trace_host_phase("select_device", NULL, start_ns, host_time_ns());
+
+    /// Hosts without any OpenCL platform or device still get a usable context
+    if (*error && backend == CLFUN_BACKEND_AUTO)
+    {
+        fprintf(
+            stderr, "No usable OpenCL device (%d), falling back to native backend\n",
+            *error
+        );
+        release_gpu_context(context);
+        return setup_gpu_context_with_backend(
+            CLFUN_BACKEND_NATIVE, sources_list, src_list_sz, error
+        );
+    }
+    if (*error)
+        goto return_error;
+
+    *error = init_gpu_context(context, sources_list, src_list_sz);
+    if (*error)
+        goto return_error;
+
+    return context;
+
+return_error:
+    release_gpu_context(context);
+    return NULL;
+}
+
+struct gpu_context* setup_gpu_context_on_device(cl_device_id device,
+                                                char const* const* sources_list,
+                                                size_t src_list_sz,
+                                                cl_int* error)
+{
+    assert(device);
+    assert(error != 0);
+
+    *error = 0;
+
+    struct gpu_context* const context = alloc_gpu_context(error);
+    if (!context)
+        return NULL;
+
+    /// The context releases its device
+    clRetainDevice(device);
+    context->selected_device = device;
+
+    *error = create_context_and_queue(context);
+    if (*error)
+        goto return_error;
+
+    *error = init_gpu_context(context, sources_list, src_list_sz);
+    if (*error)
+        goto return_error;
+
+    return context;
+
+return_error:
+    release_gpu_context(context);
+    return NULL;
+}
+
+/// Joins source file names into the key of a \ref program_variant
+static
+char* make_sources_key(char const* const* sources_list, size_t src_list_sz)
+{
+    size_t len = 1;
+    for (size_t i = 0; i < src_list_sz; ++i)
+        len += strlen(sources_list[i]) + 1;
+
+    char* key = calloc(len, 1);
+    if (!key)
+        return NULL;
+
+    for (size_t i = 0; i < src_list_sz; ++i)
+    {
+        strcat(key, sources_list[i]);
+        strcat(key, ";");
+    }
+    return key;
+}
+
+struct program_variant* get_program_variant(struct gpu_context* context,
+                                            char const* const* sources_list,
+                                            size_t src_list_sz,
+                                            char const* options,
+                                            cl_int* error)
+{
+    assert(context);
+    assert(error);
+
+    *error = 0;
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+    {
+        *error = CL_INVALID_OPERATION;
+        return NULL;
+    }
+
+    char* sources_key = make_sources_key(sources_list, src_list_sz);
+    if (!sources_key)
+    {
+        *error = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    for (size_t i = 0; i < context->num_variants; ++i)
+    {
+        struct program_variant* variant = context->variants[i];
+        if (!strcmp(variant->sources_key, sources_key)
+            && !strcmp(variant->options, options))
+        {
+            free(sources_key);
+            return variant;
+        }
+    }
+
+    struct program_variant* variant = calloc(1, sizeof(struct program_variant));
+    struct program_variant** variants = realloc(
+        context->variants,
+        (context->num_variants + 1) * sizeof(struct program_variant*)
+    );
+    if (variants)
+        context->variants = variants;
+
+    if (!variant || !variants)
+    {
+        free(sources_key);
+        free(variant);
+        *error = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    variant->sources_key = sources_key;
+    variant->options = strdup(options);
+
+    *error = load_program(
+        context, sources_list, src_list_sz, options, variant
+    );
+    if (*error)
+    {
+        release_program_variant(variant);
+        return NULL;
+    }
+
+    context->variants[context->num_variants++] = variant;
+    return variant;
+}
+
+cl_kernel get_variant_kernel(struct program_variant* variant,
+                             char const* kernel_name, cl_int* error)
+{
+    assert(variant);
+    assert(variant->program);
+    assert(error);
+
+    *error = 0;
+    for (size_t i = 0; i < variant->num_kernels; ++i)
+        if (!strcmp(variant->kernel_names[i], kernel_name))
+            return variant->kernels[i];
+
+    cl_kernel kernel = clCreateKernel(variant->program, kernel_name, error);
+    if (*error)
+        return NULL;
+
+    size_t const new_num = variant->num_kernels + 1;
+    cl_kernel* kernels = realloc(variant->kernels, new_num * sizeof(cl_kernel));
+    if (kernels)
+        variant->kernels = kernels;
+    char** names = realloc(variant->kernel_names, new_num * sizeof(char*));
+    if (names)
+        variant->kernel_names = names;
+
+    if (!kernels || !names)
+    {
+        clReleaseKernel(kernel);
+        *error = CL_OUT_OF_HOST_MEMORY;
+        return NULL;
+    }
+
+    variant->kernels[variant->num_kernels] = kernel;
+    variant->kernel_names[variant->num_kernels] = strdup(kernel_name);
+    variant->num_kernels = new_num;
+
+    return kernel;
+}
+
+cl_kernel get_kernel(struct gpu_context* context, char const* kernel_name,
+                     cl_int* error)
+{
+    assert(context);
+    assert(context->num_variants);
+
+    return get_variant_kernel(context->variants[0], kernel_name, error);
+}
+
+/// Fills \p timing from the profiled transfer and kernel events
+static
+void collect_timing(struct op_timing* timing, cl_ulong start_ns,
+                    cl_event const* transfers, size_t transfers_num,
+                    cl_event const* kernels, size_t kernels_num)
+{
+    if (!timing)
+        return;
+
+    memset(timing, 0, sizeof(struct op_timing));
+    for (size_t i = 0; i < transfers_num; ++i)
+        timing->transfer_ns += event_elapsed_ns(transfers[i]);
+    for (size_t i = 0; i < kernels_num; ++i)
+        timing->kernel_ns += event_elapsed_ns(kernels[i]);
+    timing->total_ns = host_time_ns() - start_ns;
+}
+
+static
+void release_events(cl_event* events, size_t events_num)
+{
+    trace_commands(events, events_num);
+    for (size_t i = 0; i < events_num; ++i)
+        if (events[i])
+            clReleaseEvent(events[i]);
+}
+
+struct gemm_config default_gemm_config(void)
+{
+    return default_gemm_kernel_config(GEMM_KERNEL_TILED);
+}
+
+struct gemm_config default_gemm_kernel_config(enum gemm_kernel kernel)
+{
+    struct gemm_config config = {TILE_SIZE, ELEMS_PER_THREAD, GEMM_KERNEL_TILED};
+    if (kernel == GEMM_KERNEL_MICRO_TILE)
+    {
+        config.tile_size = GEMM5_TILE_SIZE;
+        config.elems_per_thread = GEMM5_ELEMS_PER_THREAD;
+    }
+    if (kernel < GEMM_KERNELS_NUM)
+        config.kernel = kernel;
+    return config;
+}
+
+char const* gemm_kernel_name(enum gemm_kernel kernel)
+{
+    return kernel < GEMM_KERNELS_NUM ? gemm_kernels[kernel].name : "unknown";
+}
+
+bool parse_gemm_kernel(char const* name, enum gemm_kernel* kernel)
+{
+    for (size_t i = 0; i < GEMM_KERNELS_NUM; ++i)
+    {
+        if (!strcmp(name, gemm_kernels[i].name))
+        {
+            *kernel = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t gemm_config_k_block(struct gemm_config const* config)
+{
+    return config->kernel == GEMM_KERNEL_MICRO_TILE ? GEMM5_K_BLOCK
+                                                    : config->tile_size;
+}
+
+size_t gemm_local_mem_size(struct gemm_config const* config, unsigned flags)
+{
+    size_t const tile = config->tile_size;
+
+    /// Transposed tiles of gemm4 are padded by a column, see A_SUB_PAD
+    size_t const a_cols = tile + !!(flags & GEMM_TRANS_A);
+    size_t const b_cols = tile + !!(flags & GEMM_TRANS_B);
+    switch (config->kernel)
+    {
+    case GEMM_KERNEL_MICRO_TILE:
+        return (2 * tile + 1) * gemm_config_k_block(config) * sizeof(float);
+    case GEMM_KERNEL_VECTOR:
+        return (2 * tile + 1) * tile * sizeof(float);
+    case GEMM_KERNEL_DOUBLE_BUFFERED:
+        return 2 * tile * (a_cols + b_cols) * sizeof(float);
+    default:
+        return tile * (a_cols + b_cols) * sizeof(float);
+    }
+}
+
+size_t gemm_vector_width(struct gpu_context* context,
+                         struct gemm_config const* config)
+{
+    size_t width = config->vector_width ? config->vector_width
+                                        : context->preferred_vector_width;
+    size_t result = 1;
+    while (result * 2 <= width && result * 2 <= 16
+           && config->tile_size % (result * 2) == 0)
+        result *= 2;
+    return result;
+}
+
+bool gemm_config_valid(struct gemm_config const* config)
+{
+    return config->kernel < GEMM_KERNELS_NUM
+        && config->tile_size && config->elems_per_thread
+        && config->tile_size % config->elems_per_thread == 0;
+}
+
+bool gemm_config_fits(struct gemm_config const* config,
+                      size_t n, size_t m, size_t k)
+{
+    size_t const tile = config->tile_size;
+    return gemm_config_valid(config)
+        && n % tile == 0 && m % gemm_config_k_block(config) == 0 && k % tile == 0;
+}
+
+/// Build options of the \ref gemm_flags
+static struct
+{
+    unsigned        flag;
+    char const*     option;
+} const gemm_flag_options[] =
+{
+    {GEMM_ACCUMULATE,   "-DGEMM_ACCUMULATE"},
+    {GEMM_BATCHED,      "-DGEMM_BATCHED"},
+    {GEMM_EDGES,        "-DGEMM_EDGES"},
+    {GEMM_TRANS_A,      "-DGEMM_TRANS_A"},
+    {GEMM_TRANS_B,      "-DGEMM_TRANS_B"},
+};
+
+/// Only the gemm4.cl loops read transposed tiles
+static
+bool gemm_kernel_transposes(enum gemm_kernel kernel)
+{
+    return kernel == GEMM_KERNEL_TILED || kernel == GEMM_KERNEL_DOUBLE_BUFFERED;
+}
+
+cl_kernel get_gemm_kernel(struct gpu_context* context,
+                          struct gemm_config const* config, unsigned flags,
+                          size_t n, size_t m, size_t k, cl_int* error)
+{
+    /// Exact shape as compile-time constants lets the compiler fold index math
+    char options[256];
+    int options_len = snprintf(
+        options, sizeof(options), "-DTILE_SIZE=%zu -DELEMS_PER_THREAD=%zu%s",
+        config->tile_size, config->elems_per_thread,
+        gemm_kernels[config->kernel].options
+    );
+    if (config->kernel == GEMM_KERNEL_VECTOR)
+        options_len += snprintf(
+            options + options_len, sizeof(options) - options_len,
+            " -DVECTOR_WIDTH=%zu", gemm_vector_width(context, config)
+        );
+    if (context->specialize_shapes)
+        options_len += snprintf(
+            options + options_len, sizeof(options) - options_len,
+            " -DGEMM_N=%zu -DGEMM_M=%zu -DGEMM_K=%zu", n, m, k
+        );
+    for (size_t i = 0; i < sizeof(gemm_flag_options) / sizeof(gemm_flag_options[0]); ++i)
+        if (flags & gemm_flag_options[i].flag)
+            options_len += snprintf(
+                options + options_len, sizeof(options) - options_len,
+                " %s", gemm_flag_options[i].option
+            );
+
+    struct program_variant* variant = get_program_variant(
+        context, gemm_kernels[config->kernel].sources,
+        sizeof(gemm_kernels[0].sources) / sizeof(char const*), options, error
+    );
+    if (*error)
+        return NULL;
+
+    return get_variant_kernel(variant, gemm_kernels[config->kernel].function, error);
+}
+
+/// Enqueues gemm on \p batch_size matrices, the batch is the third dimension
+/// of the range with \ref GEMM_BATCHED
+static
+cl_int enqueue_gemm_range(struct gpu_context* context,
+                          struct gemm_config const* config, unsigned flags,
+                          cl_mem a_buf, cl_mem b_buf, cl_mem c_buf,
+                          size_t n, size_t m, size_t k, size_t batch_size,
+                          cl_uint num_events, cl_event const* wait_list,
+                          cl_event* run_event)
+{
+    assert(context);
+    assert(config);
+
+    if (!gemm_config_valid(config) || !batch_size)
+        return CL_INVALID_VALUE;
+    if ((flags & (GEMM_TRANS_A | GEMM_TRANS_B)) && !gemm_kernel_transposes(config->kernel))
+        return CL_INVALID_VALUE;
+
+    /// Shapes not divisible by the tiles take the guarded variant
+    if (!gemm_config_fits(config, n, m, k))
+        flags |= GEMM_EDGES;
+
+    cl_int result = 0;
+    cl_kernel kernel = get_gemm_kernel(context, config, flags, n, m, k, &result);
+    CHECK_AND_RET_ERR("Failed to create gemm kernel", result);
+
+    cl_uint const dims[] = {n, m, k};
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &a_buf);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &b_buf);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &c_buf);
+    clSetKernelArg(kernel, 3, sizeof(cl_uint), &dims[0]);
+    clSetKernelArg(kernel, 4, sizeof(cl_uint), &dims[1]);
+    clSetKernelArg(kernel, 5, sizeof(cl_uint), &dims[2]);
+
+    /// gemm5 spreads the register tile over the columns too
+    size_t const tile = config->tile_size;
+    size_t const elems = config->elems_per_thread;
+    size_t const col_elems = config->kernel == GEMM_KERNEL_MICRO_TILE ? elems : 1;
+    size_t work_size[] = {
+        (k + tile - 1) / tile * tile / col_elems, (n + tile - 1) / tile * tile / elems,
+        batch_size
+    };
+    size_t local_group_size[] = {tile / col_elems, tile / elems, 1};
+    return clEnqueueNDRangeKernel(
+        context->command_queue, kernel, flags & GEMM_BATCHED ? 3 : 2, NULL,
+        work_size, local_group_size, num_events, wait_list, run_event
+    );
+}
+
+cl_int enqueue_gemm(struct gpu_context* context,
+                    struct gemm_config const* config, unsigned flags,
+                    cl_mem a_buf, cl_mem b_buf, cl_mem c_buf,
+                    size_t n, size_t m, size_t k,
+                    cl_uint num_events, cl_event const* wait_list,
+                    cl_event* run_event)
+{
+    return enqueue_gemm_range(
+        context, config, flags & ~GEMM_BATCHED, a_buf, b_buf, c_buf, n, m, k, 1,
+        num_events, wait_list, run_event
+    );
+}
+
+cl_int enqueue_gemm_batched(struct gpu_context* context,
+                            struct gemm_config const* config, unsigned flags,
+                            cl_mem a_buf, cl_mem b_buf, cl_mem c_buf,
+                            size_t n, size_t m, size_t k, size_t batch_size,
+                            cl_uint num_events, cl_event const* wait_list,
+                            cl_event* run_event)
+{
+    return enqueue_gemm_range(
+        context, config, flags | GEMM_BATCHED, a_buf, b_buf, c_buf, n, m, k,
+        batch_size, num_events, wait_list, run_event
+    );
+}
+
+cl_int run_gemm(struct gpu_context* context,
+                float const* a, float const* b, float* c,
+                size_t n, size_t m, size_t k,
+                struct op_timing* timing)
+{
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    return run_gemm_with_config(context, &config, a, b, c, n, m, k, timing);
+}
+
+/// Enqueues copies of the matrices around the gemm, all owned by \p op
+static
+cl_int enqueue_gemm_op(struct gpu_context* context,
+                       struct gemm_config const* config, unsigned gemm_flags,
+                       float const* a, float const* b, float* c,
+                       size_t n, size_t m, size_t k, struct async_op* op)
+{
+    cl_int result = 0;
+
+    if (!gemm_config_valid(config))
+        return CL_INVALID_VALUE;
+
+    size_t const sizes[] = {n * m * sizeof(float), m * k * sizeof(float), n * k * sizeof(float)};
+    cl_mem_flags const flags[] = {CL_MEM_READ_ONLY, CL_MEM_READ_ONLY, CL_MEM_WRITE_ONLY};
+    for (size_t i = 0; i < 3; ++i)
+    {
+        op->buffers[op->num_buffers] = acquire_buffer(
+            &context->buffer_pool, flags[i], sizes[i], &result
+        );
+        CHECK_AND_RET_ERR("Error creating buffer", result);
+        ++op->num_buffers;
+    }
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, op->buffers[0], false, 0, sizes[0], a,
+        0, 0, &op->transfers[op->num_transfers++]
+    );
+    CHECK_AND_RET_ERR("clEnqueueWriteBuffer error", result);
+    result = clEnqueueWriteBuffer(
+        context->command_queue, op->buffers[1], false, 0, sizes[1], b,
+        0, 0, &op->transfers[op->num_transfers++]
+    );
+    CHECK_AND_RET_ERR("clEnqueueWriteBuffer error", result);
+
+    result = enqueue_gemm(
+        context, config, gemm_flags, op->buffers[0], op->buffers[1], op->buffers[2],
+        n, m, k, 0, 0, &op->kernels[op->num_kernels++]
+    );
+    CHECK_AND_RET_ERR("Error enqueuing kernel", result);
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, op->buffers[2], false, 0, sizes[2], c,
+        0, 0, &op->transfers[op->num_transfers++]
+    );
+    CHECK_AND_RET_ERR("clEnqueueReadBuffer error", result);
+
+    op->done_event = op->transfers[op->num_transfers - 1];
+    return clFlush(context->command_queue);
+}
+
+/// Enqueues \p op under the context's submit lock and starts watching it
+static
+cl_int submit_gemm_op(struct gpu_context* context,
+                      struct gemm_config const* config, unsigned gemm_flags,
+                      float const* a, float const* b, float* c,
+                      size_t n, size_t m, size_t k, struct async_op* op)
+{
+    pthread_mutex_lock(&context->submit_lock);
+    cl_int const result = enqueue_gemm_op(
+        context, config, gemm_flags, a, b, c, n, m, k, op
+    );
+    pthread_mutex_unlock(&context->submit_lock);
+    return start_async_op(op, result);
+}
+
+/// Runs \p op of the config's kernel with the flags and waits for it
+static
+cl_int run_gemm_op(struct gpu_context* context,
+                   struct gemm_config const* config, unsigned gemm_flags,
+                   float const* a, float const* b, float* c,
+                   size_t n, size_t m, size_t k,
+                   struct op_timing* timing)
+{
+    assert(context->command_queue);
+
+    cl_int result = 0;
+    struct async_op* const op = create_async_op(context, NULL, NULL, &result);
+    if (!op)
+        return result;
+
+    result = submit_gemm_op(context, config, gemm_flags, a, b, c, n, m, k, op);
+    if (!result)
+        result = wait_async_op(op, timing);
+
+    release_async_op(op);
+    return result;
+}
+
+cl_int run_gemm_with_config(struct gpu_context* context,
+                            struct gemm_config const* config,
+                            float const* a, float const* b, float* c,
+                            size_t n, size_t m, size_t k,
+                            struct op_timing* timing)
+{
+    assert(context);
+
+    /// The native gemm has no tiles to configure
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return run_native_gemm(a, b, c, n, m, k, timing);
+
+    return run_gemm_op(context, config, 0, a, b, c, n, m, k, timing);
+}
+
+cl_int run_gemm_transposed(struct gpu_context* context, unsigned flags,
+                           float const* a, float const* b, float* c,
+                           size_t n, size_t m, size_t k,
+                           struct op_timing* timing)
+{
+    assert(context);
+
+    if (flags & ~(GEMM_TRANS_A | GEMM_TRANS_B))
+        return CL_INVALID_VALUE;
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    struct gemm_config config = lookup_gemm_config(context, n, m, k);
+    if (!gemm_kernel_transposes(config.kernel))
+        config = lookup_gemm_kernel_config(context, GEMM_KERNEL_TILED, n, m, k);
+
+    /// Padded tiles of a config tuned to fill the local memory don't fit it,
+    /// such a config runs with halved tiles
+    while (context->local_mem_size
+           && gemm_local_mem_size(&config, flags) > context->local_mem_size
+           && config.tile_size / 2 % config.elems_per_thread == 0
+           && config.tile_size / 2 >= config.elems_per_thread)
+        config.tile_size /= 2;
+    if (context->local_mem_size
+        && gemm_local_mem_size(&config, flags) > context->local_mem_size)
+        return CL_OUT_OF_RESOURCES;
+
+    return run_gemm_op(context, &config, flags, a, b, c, n, m, k, timing);
+}
+
+struct async_op* submit_gemm(struct gpu_context* context,
+                             float const* a, float const* b, float* c,
+                             size_t n, size_t m, size_t k,
+                             async_op_callback callback, void* user_data,
+                             cl_int* error)
+{
+    assert(context);
+    assert(error);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+    {
+        *error = CL_INVALID_OPERATION;
+        return NULL;
+    }
+
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    struct async_op* op = create_async_op(context, callback, user_data, error);
+    if (!op)
+        return NULL;
+
+    *error = submit_gemm_op(context, &config, 0, a, b, c, n, m, k, op);
+    if (*error)
+    {
+        release_async_op(op);
+        return NULL;
+    }
+    return op;
+}
+
+cl_int run_gemm_batched(struct gpu_context* context,
+                        float const* a, float const* b, float* c,
+                        size_t n, size_t m, size_t k, size_t batch_size,
+                        struct op_timing* timing)
+{
+    assert(context);
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+    {
+        /// The matrices are multiplied one by one, each by all the threads
+        struct op_timing matrix_timing;
+        cl_ulong compute_ns = 0;
+        for (size_t i = 0; !result && i < batch_size; ++i)
+        {
+            result = run_native_gemm(
+                a + i * n * m, b + i * m * k, c + i * n * k, n, m, k,
+                &matrix_timing
+            );
+            compute_ns += matrix_timing.kernel_ns;
+        }
+        if (timing)
+        {
+            timing->kernel_ns = compute_ns;
+            timing->transfer_ns = 0;
+            timing->total_ns = host_time_ns() - start_ns;
+        }
+        return result;
+    }
+
+    assert(context->command_queue);
+
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    if (!gemm_config_valid(&config) || !batch_size)
+        return CL_INVALID_VALUE;
+
+    size_t const a_size = batch_size * n * m * sizeof(float);
+    size_t const b_size = batch_size * m * k * sizeof(float);
+    size_t const c_size = batch_size * n * k * sizeof(float);
+
+    cl_mem a_buf = NULL, b_buf = NULL, c_buf = NULL;
+    cl_event transfers[3] = {0}; //!< write A, write B, read C
+    cl_event run_event = NULL;
+
+    a_buf = acquire_buffer(&context->buffer_pool, CL_MEM_READ_ONLY, a_size, &result);
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    b_buf = acquire_buffer(&context->buffer_pool, CL_MEM_READ_ONLY, b_size, &result);
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    c_buf = acquire_buffer(&context->buffer_pool, CL_MEM_WRITE_ONLY, c_size, &result);
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, a_buf, false, 0, a_size, a, 0, 0, &transfers[0]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+    result = clEnqueueWriteBuffer(
+        context->command_queue, b_buf, false, 0, b_size, b, 0, 0, &transfers[1]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+
+    result = enqueue_gemm_batched(
+        context, &config, 0, a_buf, b_buf, c_buf, n, m, k, batch_size,
+        0, 0, &run_event
+    );
+    CHECK_ERR("Error enqueuing kernel", result, release_buffers);
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, c_buf, true, 0, c_size, c, 0, 0, &transfers[2]
+    );
+    CHECK_ERR("clEnqueueReadBuffer error", result, release_buffers);
+
+    collect_timing(timing, start_ns, transfers, 3, &run_event, 1);
+
+release_buffers:
+    release_events(transfers, 3);
+    release_events(&run_event, 1);
+    release_buffer(&context->buffer_pool, a_buf);
+    release_buffer(&context->buffer_pool, b_buf);
+    release_buffer(&context->buffer_pool, c_buf);
+    return result;
+}
+
+/// Creates the context's transfer queue on first use
+static
+cl_int ensure_transfer_queue(struct gpu_context* context)
+{
+    if (context->transfer_queue)
+        return 0;
+
+    cl_int result = 0;
+    context->transfer_queue = clCreateCommandQueue(
+        context->context, context->selected_device, CL_QUEUE_PROFILING_ENABLE,
+        &result
+    );
+    if (!result)
+        trace_queue(context->transfer_queue);
+    return result;
+}
+
+cl_int run_gemm_pipelined(struct gpu_context* context,
+                          float const* a, float const* b, float* c,
+                          size_t n, size_t m, size_t k, size_t panel_rows,
+                          struct op_timing* timing)
+{
+    assert(context);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    /// Panel i's buffers are reused by panel i + PIPELINE_SLOTS, so that
+    /// upload of i + 1 and download of i - 1 may run while i is computed
+    enum { PIPELINE_SLOTS = 3 };
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    size_t const tile = config.tile_size;
+    if (!n || !gemm_config_valid(&config))
+        return CL_INVALID_VALUE;
+
+    /// Matrices of fewer rows than panels still get a panel of a whole tile
+    if (!panel_rows)
+        panel_rows = (n / PIPELINE_DEFAULT_PANELS + tile - 1) / tile * tile;
+    if (!panel_rows)
+        panel_rows = tile;
+    if (panel_rows % tile)
+        return CL_INVALID_VALUE;
+    if (panel_rows > n)
+        panel_rows = n;
+
+    result = ensure_transfer_queue(context);
+    CHECK_AND_RET_ERR("Error creating transfer queue", result);
+
+    cl_command_queue const compute_queue = context->command_queue;
+    cl_command_queue const transfer_queue = context->transfer_queue;
+    size_t const panels_num = (n + panel_rows - 1) / panel_rows;
+
+    cl_mem b_buf = NULL;
+    cl_mem a_slots[PIPELINE_SLOTS] = {0};
+    cl_mem c_slots[PIPELINE_SLOTS] = {0};
+    cl_event write_b_event = NULL;
+    cl_event* const events = calloc(3 * panels_num, sizeof(cl_event));
+    if (!events)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    cl_event* const write_events = events;                  //!< A panels uploads
+    cl_event* const run_events = events + panels_num;       //!< panels' kernels
+    cl_event* const read_events = events + 2 * panels_num;  //!< C panels downloads
+
+    b_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, m * k * sizeof(float), &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    for (size_t i = 0; i < PIPELINE_SLOTS && i < panels_num; ++i)
+    {
+        a_slots[i] = acquire_buffer(
+            &context->buffer_pool, CL_MEM_READ_ONLY,
+            panel_rows * m * sizeof(float), &result
+        );
+        CHECK_ERR("Error creating buffer", result, release_buffers);
+        c_slots[i] = acquire_buffer(
+            &context->buffer_pool, CL_MEM_WRITE_ONLY,
+            panel_rows * k * sizeof(float), &result
+        );
+        CHECK_ERR("Error creating buffer", result, release_buffers);
+    }
+
+    result = clEnqueueWriteBuffer(
+        transfer_queue, b_buf, false, 0, m * k * sizeof(float), b,
+        0, 0, &write_b_event
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+
+    /// Step i uploads panel i, computes panel i - 1 and downloads panel i - 2.
+    /// Transfers of both directions share the transfer queue, kernels
+    /// run in order on the compute queue, events chain them.
+    for (size_t step = 0; step < panels_num + 2; ++step)
+    {
+        if (step < panels_num)
+        {
+            size_t const i = step;
+            size_t const rows = i + 1 < panels_num ? panel_rows : n - i * panel_rows;
+            cl_uint const wait_num = i >= PIPELINE_SLOTS;
+            cl_event const* wait_list = wait_num ? &run_events[i - PIPELINE_SLOTS] : NULL;
+
+            result = clEnqueueWriteBuffer(
+                transfer_queue, a_slots[i % PIPELINE_SLOTS], false, 0,
+                rows * m * sizeof(float), a + i * panel_rows * m,
+                wait_num, wait_list, &write_events[i]
+            );
+            CHECK_ERR("clEnqueueWriteBuffer error", result, wait_queues);
+            clFlush(transfer_queue);
+        }
+
+        if (step >= 1 && step - 1 < panels_num)
+        {
+            size_t const i = step - 1;
+            size_t const rows = i + 1 < panels_num ? panel_rows : n - i * panel_rows;
+            cl_event wait_list[3] = {write_events[i], write_b_event};
+            cl_uint wait_num = 2;
+            if (i >= PIPELINE_SLOTS)
+                wait_list[wait_num++] = read_events[i - PIPELINE_SLOTS];
+
+            result = enqueue_gemm(
+                context, &config, 0, a_slots[i % PIPELINE_SLOTS], b_buf,
+                c_slots[i % PIPELINE_SLOTS], rows, m, k,
+                wait_num, wait_list, &run_events[i]
+            );
+            CHECK_ERR("Error enqueuing kernel", result, wait_queues);
+            clFlush(compute_queue);
+        }
+
+        if (step >= 2)
+        {
+            size_t const i = step - 2;
+            size_t const rows = i + 1 < panels_num ? panel_rows : n - i * panel_rows;
+
+            result = clEnqueueReadBuffer(
+                transfer_queue, c_slots[i % PIPELINE_SLOTS], false, 0,
+                rows * k * sizeof(float), c + i * panel_rows * k,
+                1, &run_events[i], &read_events[i]
+            );
+            CHECK_ERR("clEnqueueReadBuffer error", result, wait_queues);
+            clFlush(transfer_queue);
+        }
+    }
+
+wait_queues:
+    clFinish(compute_queue);
+    clFinish(transfer_queue);
+
+    if (!result && timing)
+    {
+        collect_timing(timing, start_ns, &write_b_event, 1, run_events, panels_num);
+        for (size_t i = 0; i < panels_num; ++i)
+            timing->transfer_ns += event_elapsed_ns(write_events[i])
+                                   + event_elapsed_ns(read_events[i]);
+    }
+
+release_buffers:
+    release_events(events, 3 * panels_num);
+    release_events(&write_b_event, 1);
+    free(events);
+    release_buffer(&context->buffer_pool, b_buf);
+    for (size_t i = 0; i < PIPELINE_SLOTS; ++i)
+    {
+        release_buffer(&context->buffer_pool, a_slots[i]);
+        release_buffer(&context->buffer_pool, c_slots[i]);
+    }
+    return result;
+}
+
+/// Smaller of the block size and the rest of the dimension after \p block blocks
+static inline
+size_t block_extent(size_t dim, size_t block_size, size_t block)
+{
+    size_t const rest = dim - block * block_size;
+    return rest < block_size ? rest : block_size;
+}
+
+cl_int run_gemm_out_of_core(struct gpu_context* context,
+                            float const* a, float const* b, float* c,
+                            size_t n, size_t m, size_t k,
+                            size_t device_mem_limit,
+                            struct op_timing* timing)
+{
+    assert(context);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    /// Two slots of A and B blocks overlap the uploads with the kernels,
+    /// two slots of C blocks overlap the downloads
+    enum { BLOCK_SLOTS = 2 };
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    size_t const tile = config.tile_size;
+    if (!gemm_config_valid(&config))
+        return CL_INVALID_VALUE;
+
+    if (!device_mem_limit)
+        device_mem_limit = context->global_mem_size / 2;
+
+    /// Square blocks of side s take 2 * 3 * s * s floats in all slots,
+    /// a single block must also fit CL_DEVICE_MAX_MEM_ALLOC_SIZE.
+    /// Blocks larger than every dimension are of no use.
+    size_t side = 0;
+    for (size_t next = tile;
+         2 * 3 * next * next * sizeof(float) <= device_mem_limit
+         && next * next * sizeof(float) <= context->max_mem_alloc_size
+         && (next <= n || next <= m || next <= k);
+         next += tile)
+        side = next;
+    if (!side)
+        return CL_MEM_OBJECT_ALLOCATION_FAILURE;
+
+    size_t const block_n = side < n ? side : n;
+    size_t const block_m = side < m ? side : m;
+    size_t const block_k = side < k ? side : k;
+    size_t const blocks_n = (n + block_n - 1) / block_n;
+    size_t const blocks_m = (m + block_m - 1) / block_m;
+    size_t const blocks_k = (k + block_k - 1) / block_k;
+    size_t const c_blocks_num = blocks_n * blocks_k;
+    size_t const steps_num = c_blocks_num * blocks_m;
+
+    result = ensure_transfer_queue(context);
+    CHECK_AND_RET_ERR("Error creating transfer queue", result);
+
+    cl_command_queue const compute_queue = context->command_queue;
+    cl_command_queue const transfer_queue = context->transfer_queue;
+
+    cl_mem a_slots[BLOCK_SLOTS] = {0};
+    cl_mem b_slots[BLOCK_SLOTS] = {0};
+    cl_mem c_slots[BLOCK_SLOTS] = {0};
+    cl_event* const events = calloc(3 * steps_num + c_blocks_num, sizeof(cl_event));
+    if (!events)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    cl_event* const write_a_events = events;                    //!< A blocks uploads
+    cl_event* const write_b_events = events + steps_num;        //!< B blocks uploads
+    cl_event* const run_events = events + 2 * steps_num;        //!< blocks' kernels
+    cl_event* const read_events = events + 3 * steps_num;       //!< C blocks downloads
+
+    /// Free buffers of earlier calls would compete with the blocks for memory
+    trim_buffer_pool(&context->buffer_pool);
+
+    for (size_t i = 0; i < BLOCK_SLOTS; ++i)
+    {
+        a_slots[i] = acquire_buffer(
+            &context->buffer_pool, CL_MEM_READ_ONLY,
+            block_n * block_m * sizeof(float), &result
+        );
+        CHECK_ERR("Error creating buffer", result, release_buffers);
+        b_slots[i] = acquire_buffer(
+            &context->buffer_pool, CL_MEM_READ_ONLY,
+            block_m * block_k * sizeof(float), &result
+        );
+        CHECK_ERR("Error creating buffer", result, release_buffers);
+        c_slots[i] = acquire_buffer(
+            &context->buffer_pool, CL_MEM_READ_WRITE,
+            block_n * block_k * sizeof(float), &result
+        );
+        CHECK_ERR("Error creating buffer", result, release_buffers);
+    }
+
+    fprintf(
+        stderr, "Out-of-core gemm: blocks %zux%zux%zu, %zu steps\n",
+        block_n, block_m, block_k, steps_num
+    );
+
+    /// Step s multiplies A block (bi, bj) by B block (bj, bl) into C block
+    /// (bi, bl), bj runs fastest so that a C block is finished by the
+    /// consecutive steps. Uploads run a step ahead: those of step s + 1 are
+    /// enqueued before the download of step s, the transfer queue is in order.
+    for (size_t step = 0; step < steps_num; ++step)
+    {
+        for (size_t s = step ? step + 1 : 0; s <= step + 1 && s < steps_num; ++s)
+        {
+            size_t const bj = s % blocks_m;
+            size_t const bl = s / blocks_m % blocks_k;
+            size_t const bi = s / blocks_m / blocks_k;
+            size_t const rows = block_extent(n, block_n, bi);
+            size_t const inner = block_extent(m, block_m, bj);
+            size_t const cols = block_extent(k, block_k, bl);
+            cl_uint const wait_num = s >= BLOCK_SLOTS;
+            cl_event const* wait_list = wait_num ? &run_events[s - BLOCK_SLOTS] : NULL;
+
+            size_t const zero_origin[] = {0, 0, 0};
+            size_t const a_origin[] = {bj * block_m * sizeof(float), bi * block_n, 0};
+            size_t const a_region[] = {inner * sizeof(float), rows, 1};
+            result = clEnqueueWriteBufferRect(
+                transfer_queue, a_slots[s % BLOCK_SLOTS], false,
+                zero_origin, a_origin, a_region, inner * sizeof(float), 0,
+                m * sizeof(float), 0, a, wait_num, wait_list, &write_a_events[s]
+            );
+            CHECK_ERR("clEnqueueWriteBufferRect error", result, wait_queues);
+
+            size_t const b_origin[] = {bl * block_k * sizeof(float), bj * block_m, 0};
+            size_t const b_region[] = {cols * sizeof(float), inner, 1};
+            result = clEnqueueWriteBufferRect(
+                transfer_queue, b_slots[s % BLOCK_SLOTS], false,
+                zero_origin, b_origin, b_region, cols * sizeof(float), 0,
+                k * sizeof(float), 0, b, wait_num, wait_list, &write_b_events[s]
+            );
+            CHECK_ERR("clEnqueueWriteBufferRect error", result, wait_queues);
+            clFlush(transfer_queue);
+        }
+
+        size_t const bj = step % blocks_m;
+        size_t const c_block = step / blocks_m;
+        size_t const bl = c_block % blocks_k;
+        size_t const bi = c_block / blocks_k;
+        size_t const rows = block_extent(n, block_n, bi);
+        size_t const inner = block_extent(m, block_m, bj);
+        size_t const cols = block_extent(k, block_k, bl);
+
+        /// First partial product overwrites the C slot, once its previous
+        /// block has been downloaded
+        cl_event wait_list[3] = {write_a_events[step], write_b_events[step]};
+        cl_uint wait_num = 2;
+        if (bj == 0 && c_block >= BLOCK_SLOTS)
+            wait_list[wait_num++] = read_events[c_block - BLOCK_SLOTS];
+
+        result = enqueue_gemm(
+            context, &config, bj ? GEMM_ACCUMULATE : 0,
+            a_slots[step % BLOCK_SLOTS], b_slots[step % BLOCK_SLOTS],
+            c_slots[c_block % BLOCK_SLOTS], rows, inner, cols,
+            wait_num, wait_list, &run_events[step]
+        );
+        CHECK_ERR("Error enqueuing kernel", result, wait_queues);
+        clFlush(compute_queue);
+
+        if (bj + 1 == blocks_m)
+        {
+            size_t const zero_origin[] = {0, 0, 0};
+            size_t const c_origin[] = {bl * block_k * sizeof(float), bi * block_n, 0};
+            size_t const c_region[] = {cols * sizeof(float), rows, 1};
+            result = clEnqueueReadBufferRect(
+                transfer_queue, c_slots[c_block % BLOCK_SLOTS], false,
+                zero_origin, c_origin, c_region, cols * sizeof(float), 0,
+                k * sizeof(float), 0, c, 1, &run_events[step],
+                &read_events[c_block]
+            );
+            CHECK_ERR("clEnqueueReadBufferRect error", result, wait_queues);
+            clFlush(transfer_queue);
+        }
+    }
+
+wait_queues:
+    clFinish(compute_queue);
+    clFinish(transfer_queue);
+
+    if (!result && timing)
+    {
+        collect_timing(
+            timing, start_ns, read_events, c_blocks_num, run_events, steps_num
+        );
+        for (size_t i = 0; i < steps_num; ++i)
+            timing->transfer_ns += event_elapsed_ns(write_a_events[i])
+                                   + event_elapsed_ns(write_b_events[i]);
+    }
+
+release_buffers:
+    release_events(events, 3 * steps_num + c_blocks_num);
+    free(events);
+    for (size_t i = 0; i < BLOCK_SLOTS; ++i)
+    {
+        release_buffer(&context->buffer_pool, a_slots[i]);
+        release_buffer(&context->buffer_pool, b_slots[i]);
+        release_buffer(&context->buffer_pool, c_slots[i]);
+    }
+    return result;
+}
+
+cl_int alloc_host_buffer(struct gpu_context* context, size_t size,
+                         struct host_buffer* buffer)
+{
+    assert(context);
+    assert(buffer);
+
+    cl_int result = 0;
+    memset(buffer, 0, sizeof(struct host_buffer));
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    buffer->mem = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+        size, &result
+    );
+    CHECK_AND_RET_ERR("Error creating host buffer", result);
+
+    buffer->size = size;
+    buffer->ptr = clEnqueueMapBuffer(
+        context->command_queue, buffer->mem, true,
+        CL_MAP_WRITE_INVALIDATE_REGION, 0, size, 0, 0, 0, &result
+    );
+    if (result)
+    {
+        fprintf(stderr, "Error mapping host buffer: %d\n", result);
+        release_buffer(&context->buffer_pool, buffer->mem);
+        memset(buffer, 0, sizeof(struct host_buffer));
+    }
+    return result;
+}
+
+void release_host_buffer(struct gpu_context* context,
+                         struct host_buffer* buffer)
+{
+    if (!buffer || !buffer->mem)
+        return;
+
+    if (buffer->ptr)
+    {
+        clEnqueueUnmapMemObject(
+            context->command_queue, buffer->mem, buffer->ptr, 0, 0, 0
+        );
+        clFinish(context->command_queue);
+    }
+    release_buffer(&context->buffer_pool, buffer->mem);
+    memset(buffer, 0, sizeof(struct host_buffer));
+}
+
+/// Hands the buffer over to the device
+static
+cl_int unmap_host_buffer(struct gpu_context* context,
+                         struct host_buffer* buffer, cl_event* event)
+{
+    cl_int result = clEnqueueUnmapMemObject(
+        context->command_queue, buffer->mem, buffer->ptr, 0, 0, event
+    );
+    if (!result)
+        buffer->ptr = NULL;
+    return result;
+}
+
+/// Takes the buffer back to the host, the mapping may move
+static
+cl_int map_host_buffer(struct gpu_context* context,
+                       struct host_buffer* buffer, bool blocking,
+                       cl_event* event)
+{
+    cl_int result = 0;
+    buffer->ptr = clEnqueueMapBuffer(
+        context->command_queue, buffer->mem, blocking,
+        CL_MAP_READ | CL_MAP_WRITE, 0, buffer->size, 0, 0, event, &result
+    );
+    return result;
+}
+
+cl_int run_gemm_zero_copy(struct gpu_context* context,
+                          struct host_buffer* a, struct host_buffer* b,
+                          struct host_buffer* c,
+                          size_t n, size_t m, size_t k,
+                          struct op_timing* timing)
+{
+    assert(context);
+    assert(a && b && c);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    if (!gemm_config_valid(&config))
+        return CL_INVALID_VALUE;
+
+    struct host_buffer* const buffers[] = {a, b, c};
+    cl_event transfers[6] = {0}; //!< unmap A, B, C, map A, B, C
+    cl_event run_event = NULL;
+
+    for (size_t i = 0; !result && i < 3; ++i)
+    {
+        result = unmap_host_buffer(context, buffers[i], &transfers[i]);
+        if (result)
+            fprintf(stderr, "Error unmapping buffer: %d\n", result);
+    }
+
+    if (!result)
+    {
+        result = enqueue_gemm(
+            context, &config, 0, a->mem, b->mem, c->mem, n, m, k, 0, 0, &run_event
+        );
+        if (result)
+            fprintf(stderr, "Error enqueuing kernel: %d\n", result);
+    }
+
+    /// The buffers go back to the host even if the kernel failed
+    for (size_t i = 0; i < 3; ++i)
+    {
+        if (buffers[i]->ptr)
+            continue;
+
+        cl_int map_result = map_host_buffer(
+            context, buffers[i], true, &transfers[3 + i]
+        );
+        if (map_result)
+        {
+            fprintf(stderr, "Error mapping buffer: %d\n", map_result);
+            result = result ? result : map_result;
+        }
+    }
+
+    if (!result)
+        collect_timing(timing, start_ns, transfers, 6, &run_event, 1);
+
+    release_events(transfers, 6);
+    release_events(&run_event, 1);
+    return result;
+}
+
+/// Enqueues the scan kernels and the copies around them, all owned by \p op
+static
+cl_int enqueue_scan_op(struct gpu_context* context,
+                       float const* in, float* out, size_t n,
+                       struct async_op* op)
+{
+    cl_int result = 0;
+
+    /// Every tile is scanned by one work group, so it can't exceed the device limit
+    size_t scan_tile_size = SCAN_TILE_SIZE;
+    while (scan_tile_size > context->max_work_group_size && scan_tile_size > 1)
+        scan_tile_size /= 2;
+
+    /// A single tile is scanned by one work group, bigger arrays need
+    /// local scans of every tile followed by adding the previous tiles' sums
+    bool const single_tile = n <= scan_tile_size;
+    if (!n || (!single_tile && n % scan_tile_size))
+        return CL_INVALID_VALUE;
+
+    char options[64];
+    snprintf(options, sizeof(options), "-DSCAN_TILE_SIZE=%zu", scan_tile_size);
+    struct program_variant* variant = get_program_variant(
+        context, scan_sources, sizeof(scan_sources) / sizeof(char const*),
+        options, &result
+    );
+    CHECK_AND_RET_ERR("Failed to build scan variant", result);
+
+    cl_kernel kernels[2] = {0};
+    size_t const kernels_num = single_tile ? 1 : 2;
+    if (single_tile)
+    {
+        kernels[0] = get_variant_kernel(variant, "par_scan", &result);
+        CHECK_AND_RET_ERR("Failed to create kernel", result);
+    }
+    else
+    {
+        kernels[0] = get_variant_kernel(variant, "local_scan", &result);
+        CHECK_AND_RET_ERR("Failed to create kernel", result);
+        kernels[1] = get_variant_kernel(variant, "tiles_sum", &result);
+        CHECK_AND_RET_ERR("Failed to create kernel", result);
+    }
+
+    /// Input, result and, for several tiles, the result with the sums added
+    cl_mem_flags const flags[] = {CL_MEM_READ_ONLY, CL_MEM_READ_WRITE, CL_MEM_READ_WRITE};
+    for (size_t i = 0; i < 1 + kernels_num; ++i)
+    {
+        op->buffers[op->num_buffers] = acquire_buffer(
+            &context->buffer_pool, flags[i], n * sizeof(float), &result
+        );
+        CHECK_AND_RET_ERR("Error creating buffer", result);
+        ++op->num_buffers;
+    }
+
+    cl_mem const in_array_buf = op->buffers[0];
+    cl_mem const result_array_buf = op->buffers[1];
+    cl_mem const out_buf = op->buffers[kernels_num];
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, in_array_buf, false, 0, n * sizeof(float), in,
+        0, 0, &op->transfers[op->num_transfers++]
+    );
+    CHECK_AND_RET_ERR("clEnqueueWriteBuffer error", result);
+
+    size_t work_size[] = {n};
+    size_t local_size[] = {single_tile ? n : scan_tile_size};
+
+    if (single_tile)
+    {
+        cl_uint const n_arg = n;
+        clSetKernelArg(kernels[0], 0, sizeof(cl_mem), &in_array_buf);
+        clSetKernelArg(kernels[0], 1, sizeof(cl_mem), &result_array_buf);
+        clSetKernelArg(kernels[0], 2, sizeof(cl_uint), &n_arg);
+    }
+    else
+    {
+        clSetKernelArg(kernels[0], 0, sizeof(cl_mem), &in_array_buf);
+        clSetKernelArg(kernels[0], 1, sizeof(cl_mem), &result_array_buf);
+        clSetKernelArg(kernels[1], 0, sizeof(cl_mem), &result_array_buf);
+        clSetKernelArg(kernels[1], 1, sizeof(cl_mem), &out_buf);
+    }
+
+    for (size_t i = 0; i < kernels_num; ++i)
+    {
+        result = clEnqueueNDRangeKernel(
+            context->command_queue, kernels[i], 1, NULL, work_size,
+            local_size, 0, 0, &op->kernels[op->num_kernels++]
+        );
+        CHECK_AND_RET_ERR("Error enqueuing kernel", result);
+    }
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, out_buf, false, 0, n * sizeof(float), out,
+        0, 0, &op->transfers[op->num_transfers++]
+    );
+    CHECK_AND_RET_ERR("clEnqueueReadBuffer error", result);
+
+    op->done_event = op->transfers[op->num_transfers - 1];
+    return clFlush(context->command_queue);
+}
+
+/// Enqueues \p op under the context's submit lock and starts watching it
+static
+cl_int submit_scan_op(struct gpu_context* context,
+                      float const* in, float* out, size_t n,
+                      struct async_op* op)
+{
+    pthread_mutex_lock(&context->submit_lock);
+    cl_int const result = enqueue_scan_op(context, in, out, n, op);
+    pthread_mutex_unlock(&context->submit_lock);
+    return start_async_op(op, result);
+}
+
+cl_int run_scan(struct gpu_context* context,
+                float const* in, float* out, size_t n,
+                struct op_timing* timing)
+{
+    assert(context);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return run_native_scan(in, out, n, timing);
+
+    assert(context->command_queue);
+
+    cl_int result = 0;
+    struct async_op* const op = create_async_op(context, NULL, NULL, &result);
+    if (!op)
+        return result;
+
+    result = submit_scan_op(context, in, out, n, op);
+    if (!result)
+        result = wait_async_op(op, timing);
+
+    release_async_op(op);
+    return result;
+}
+
+struct async_op* submit_scan(struct gpu_context* context,
+                             float const* in, float* out, size_t n,
+                             async_op_callback callback, void* user_data,
+                             cl_int* error)
+{
+    assert(context);
+    assert(error);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+    {
+        *error = CL_INVALID_OPERATION;
+        return NULL;
+    }
+
+    struct async_op* op = create_async_op(context, callback, user_data, error);
+    if (!op)
+        return NULL;
+
+    *error = submit_scan_op(context, in, out, n, op);
+    if (*error)
+    {
+        release_async_op(op);
+        return NULL;
+    }
+    return op;
+}
+
+cl_int run_array_sum(struct gpu_context* context,
+                     cl_int const* a, cl_int const* b, cl_int* c, size_t n,
+                     struct op_timing* timing)
+{
+    assert(context);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return run_native_array_sum(a, b, c, n, timing);
+
+    assert(context->command_queue);
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+    size_t const array_mem_sz = n * sizeof(cl_int);
+
+    cl_kernel kernel = get_kernel(context, "array_sum", &result);
+    CHECK_AND_RET_ERR("Failed to create kernel", result);
+
+    cl_mem mem1 = NULL, mem2 = NULL, mem3 = NULL;
+    cl_event transfers[3] = {0};
+    cl_event run_event = NULL;
+
+    mem1 = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, array_mem_sz, &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    mem2 = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, array_mem_sz, &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    mem3 = acquire_buffer(
+        &context->buffer_pool, CL_MEM_WRITE_ONLY, array_mem_sz, &result
+    );
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, mem1, false, 0, array_mem_sz, a,
+        0, 0, &transfers[0]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+    result = clEnqueueWriteBuffer(
+        context->command_queue, mem2, false, 0, array_mem_sz, b,
+        0, 0, &transfers[1]
+    );
+    CHECK_ERR("clEnqueueWriteBuffer error", result, release_buffers);
+
+    clSetKernelArg(kernel, 0, sizeof(cl_mem), &mem1);
+    clSetKernelArg(kernel, 1, sizeof(cl_mem), &mem2);
+    clSetKernelArg(kernel, 2, sizeof(cl_mem), &mem3);
+
+    size_t work_size = n;
+    result = clEnqueueNDRangeKernel(
+        context->command_queue, kernel, 1, NULL, &work_size, NULL,
+        0, 0, &run_event
+    );
+    CHECK_ERR("Error enqueuing kernel", result, release_buffers);
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, mem3, true, 0, array_mem_sz, c,
+        0, 0, &transfers[2]
+    );
+    CHECK_ERR("clEnqueueReadBuffer error", result, release_buffers);
+
+    collect_timing(timing, start_ns, transfers, 3, &run_event, 1);
+
+release_buffers:
+    release_events(transfers, 3);
+    release_events(&run_event, 1);
+    release_buffer(&context->buffer_pool, mem1);
+    release_buffer(&context->buffer_pool, mem2);
+    release_buffer(&context->buffer_pool, mem3);
+    return result;
+}
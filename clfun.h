@@ -0,0 +1,414 @@
+#ifndef OPENCL_FUN_CLFUN_H
+#define OPENCL_FUN_CLFUN_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <CL/opencl.h>
+
+#include "buffer_pool.h"
+#include "trace.h"
+
+#ifndef CHECK_ERR
+#define CHECK_ERR(intro, result, exit_label)        \
+do {                                                \
+    if ((result) != 0)                              \
+    {                                               \
+        fprintf(stderr, "%s: %d\n", intro, result); \
+        goto exit_label;                            \
+    }                                               \
+} while (false)
+#endif
+
+#ifndef CHECK_AND_RET_ERR
+#define CHECK_AND_RET_ERR(intro, result)            \
+do {                                                \
+    if ((result) != 0)                              \
+    {                                               \
+        fprintf(stderr, "%s: %d\n", intro, result); \
+        return result;                              \
+    }                                               \
+} while (false)
+#endif
+
+/// Sources every operation of the library is compiled from
+extern char const* const    clfun_default_sources[];
+extern size_t const         clfun_default_sources_num;
+
+/// Timings of a single library call, in nanoseconds
+struct op_timing
+{
+    cl_ulong kernel_ns;     //!< Sum of the kernels' execution times
+    cl_ulong transfer_ns;   //!< Sum of the host <-> device copies' times
+    cl_ulong total_ns;      //!< Host wall time of the whole call
+};
+
+/// Program built from a set of sources with specific build options
+struct program_variant
+{
+    char*               sources_key;    //!< Source files names, ';'-separated
+    char*               options;        //!< Build options, e.g. "-DTILE_SIZE=32"
+    cl_program          program;
+    bool                cache_hit;      //!< Program was loaded from the binary cache
+    cl_ulong            load_ns;        //!< Time spent creating and building the program
+
+    cl_kernel*          kernels;        //!< Kernels created so far
+    char**              kernel_names;   //!< Names of \ref kernels
+    size_t              num_kernels;
+};
+
+/// Gemm kernels of the library
+enum gemm_kernel
+{
+    GEMM_KERNEL_TILED,      //!< gemm4.cl: a column of rows per work item
+    GEMM_KERNEL_MICRO_TILE, //!< gemm5.cl: square register tile per work item
+    GEMM_KERNEL_VECTOR,     //!< gemm6.cl: gemm4 on VECTOR_WIDTH-wide loads and products
+    GEMM_KERNEL_DOUBLE_BUFFERED,    //!< gemm4db, gemm4.cl loading the next tile while multiplying
+    GEMM_KERNELS_NUM
+};
+
+/**
+ * Kernel and its tiling.
+ * gemm4: local size is {tile_size, tile_size / elems_per_thread}, tiles of A
+ * and B are tile_size deep.
+ * gemm5: local size is {tile_size / elems_per_thread, tile_size / elems_per_thread},
+ * blocks of A and B are GEMM5_K_BLOCK deep.
+ * gemm6: as gemm4, vector_width has to divide tile_size.
+ * gemm4db: as gemm4, with two tiles of A and B in local memory.
+ */
+struct gemm_config
+{
+    size_t tile_size;           //!< TILE_SIZE: side of the square result tile of a work group
+    size_t elems_per_thread;    //!< ELEMS_PER_THREAD: result rows, rows and columns in gemm5, of a work item
+    enum gemm_kernel kernel;    //!< Kernel the tiling is for
+    size_t vector_width;        //!< VECTOR_WIDTH of gemm6, 0 for the device's preferred one
+};
+
+/// Variants of the gemm kernels, combined with bitwise or
+enum gemm_flags
+{
+    GEMM_ACCUMULATE = 1 << 0,   //!< c += a * b instead of c = a * b
+    GEMM_BATCHED    = 1 << 1,   //!< Batch of matrices, see \ref enqueue_gemm_batched
+    GEMM_EDGES      = 1 << 2,   //!< Guarded edge tiles, set for shapes the tiles don't divide
+    GEMM_TRANS_A    = 1 << 3,   //!< a holds A^T: matrix [M x N], gemm4 and gemm4db only
+    GEMM_TRANS_B    = 1 << 4,   //!< b holds B^T: matrix [K x M], gemm4 and gemm4db only
+};
+
+/// Environment variable selecting the backend: "opencl", "native" or "auto"
+#define BACKEND_ENV "CLFUN_BACKEND"
+
+/// Implementation the operations of a context run on
+enum clfun_backend
+{
+    CLFUN_BACKEND_AUTO,     //!< OpenCL, native if no OpenCL device is found
+    CLFUN_BACKEND_OPENCL,
+    CLFUN_BACKEND_NATIVE,   //!< OpenMP host code, see native.h
+};
+
+struct tuning_entry;
+
+/**
+ * Long-lived OpenCL state. Platform enumeration, context creation and program
+ * build are paid once in \ref setup_gpu_context, after that any number of
+ * operations may be run on it.
+ */
+struct gpu_context
+{
+    /// OPENCL or NATIVE. Native contexts have no OpenCL objects and only run
+    /// run_gemm, run_gemm_with_config, run_gemm_batched, run_scan and
+    /// run_array_sum, everything else fails with CL_INVALID_OPERATION.
+    enum clfun_backend  backend;
+
+    cl_device_id        selected_device;
+
+    cl_context          context;
+    cl_command_queue    command_queue;
+    cl_command_queue    transfer_queue;     //!< Copies overlapping kernels, created on first use
+    size_t              max_work_group_size;
+    cl_ulong            global_mem_size;    //!< CL_DEVICE_GLOBAL_MEM_SIZE
+    cl_ulong            max_mem_alloc_size; //!< CL_DEVICE_MAX_MEM_ALLOC_SIZE
+    cl_ulong            local_mem_size;     //!< CL_DEVICE_LOCAL_MEM_SIZE
+    cl_uint             preferred_vector_width; //!< CL_DEVICE_PREFERRED_VECTOR_WIDTH_FLOAT
+    char                device_name[128];
+    char                driver_version[64];
+
+    /// Programs built so far, the first one is built from the setup sources
+    /// without options. The others are specialized variants of the kernels.
+    struct program_variant**    variants;
+    size_t                      num_variants;
+
+    /// Build gemm kernels for the exact shape of every call. Off by default:
+    /// each new shape costs a build and a variant kept for the context's
+    /// lifetime, so it only pays off for a few shapes run many times.
+    bool                specialize_shapes;
+
+    /// Device buffers of the operations, reused across calls
+    struct buffer_pool      buffer_pool;
+
+    /// Serializes kernel argument setting and enqueuing of the operations
+    /// which may be called from several threads
+    pthread_mutex_t         submit_lock;
+
+    /// Autotuned gemm configs of this device, see autotune.h
+    struct tuning_entry*    tuning_entries;
+    size_t                  num_tuning_entries;
+};
+
+/// Destructor for \ref gpu_context
+void release_gpu_context(struct gpu_context* context);
+
+/**
+ * Setup device for the specified \ref gpu_context.
+ * \param context Context to be initialized
+ * \return error code or zero on success
+ */
+cl_int select_device(struct gpu_context* context);
+
+/**
+ * Loads and compiles the program of the \p variant.
+ * Built binaries are kept in the on-disk program cache, see program_cache.h.
+ */
+cl_int load_program(struct gpu_context* context,
+                    char const* const* sources_list, size_t src_list_sz,
+                    char const* options, struct program_variant* variant);
+
+/**
+ * Selects a device and builds the program from the given sources.
+ * The backend is taken from BACKEND_ENV, AUTO if unset.
+ * \param sources_list Files to build, \ref clfun_default_sources if NULL
+ * \param error Set to error code or zero on success
+ * \return New context or NULL on failure
+ */
+struct gpu_context* setup_gpu_context(char const* const* sources_list,
+                                      size_t src_list_sz,
+                                      cl_int* error);
+
+/// \ref setup_gpu_context on the given backend, sources are ignored by NATIVE
+struct gpu_context* setup_gpu_context_with_backend(enum clfun_backend backend,
+                                                   char const* const* sources_list,
+                                                   size_t src_list_sz,
+                                                   cl_int* error);
+
+/// Parses backend name, returns false if it isn't one
+bool parse_backend(char const* name, enum clfun_backend* backend);
+
+/// \ref setup_gpu_context on the given device instead of the selected one
+struct gpu_context* setup_gpu_context_on_device(cl_device_id device,
+                                                char const* const* sources_list,
+                                                size_t src_list_sz,
+                                                cl_int* error);
+
+/**
+ * Returns the program built from the sources with the given options.
+ * Variants are built on first request and live as long as the context.
+ */
+struct program_variant* get_program_variant(struct gpu_context* context,
+                                            char const* const* sources_list,
+                                            size_t src_list_sz,
+                                            char const* options,
+                                            cl_int* error);
+
+/// Returns kernel \p kernel_name of the variant, created on first use
+cl_kernel get_variant_kernel(struct program_variant* variant,
+                             char const* kernel_name, cl_int* error);
+
+/// Returns kernel \p kernel_name of the context's default program
+cl_kernel get_kernel(struct gpu_context* context, char const* kernel_name,
+                     cl_int* error);
+
+/// Reads the whole file into a new zero-terminated buffer
+char* load_source_file(char const* file_name, size_t* len);
+
+/// Returns duration of the profiled command in nanoseconds
+cl_ulong event_elapsed_ns(cl_event event);
+
+/// Monotonic host clock in nanoseconds
+cl_ulong host_time_ns(void);
+
+/// TILE_SIZE and ELEMS_PER_THREAD from const.h
+struct gemm_config default_gemm_config(void);
+
+/// Default tiling of the kernel from const.h
+struct gemm_config default_gemm_kernel_config(enum gemm_kernel kernel);
+
+/// Name of the kernel's function and source file, e.g. "gemm4"
+char const* gemm_kernel_name(enum gemm_kernel kernel);
+
+/// Parses kernel name, returns false if it isn't one
+bool parse_gemm_kernel(char const* name, enum gemm_kernel* kernel);
+
+/// Depth of the blocks of A and B the config's kernel stages in local memory
+size_t gemm_config_k_block(struct gemm_config const* config);
+
+/// Local memory the config's kernel allocates with the \ref gemm_flags, in bytes
+size_t gemm_local_mem_size(struct gemm_config const* config, unsigned flags);
+
+/**
+ * VECTOR_WIDTH gemm6 is built with: the config's width or the device's
+ * preferred one, reduced to a power of two up to 16 which divides the tile.
+ */
+size_t gemm_vector_width(struct gpu_context* context,
+                         struct gemm_config const* config);
+
+/// Checks that the config can run: elems per thread divide the tile
+bool gemm_config_valid(struct gemm_config const* config);
+
+/**
+ * Checks that n and k are divisible by the config's tile and m by its
+ * block depth. Other shapes run with GEMM_EDGES, which costs a bounds check
+ * per load.
+ */
+bool gemm_config_fits(struct gemm_config const* config,
+                      size_t n, size_t m, size_t k);
+
+/**
+ * Returns gemm kernel built for the config.
+ * With \ref gpu_context::specialize_shapes the kernel is built for this exact shape.
+ * \param flags \ref gemm_flags of the variant
+ */
+cl_kernel get_gemm_kernel(struct gpu_context* context,
+                          struct gemm_config const* config, unsigned flags,
+                          size_t n, size_t m, size_t k, cl_int* error);
+
+/// Enqueues the config's kernel computing c_buf = a_buf * b_buf on the context's queue
+cl_int enqueue_gemm(struct gpu_context* context,
+                    struct gemm_config const* config, unsigned flags,
+                    cl_mem a_buf, cl_mem b_buf, cl_mem c_buf,
+                    size_t n, size_t m, size_t k,
+                    cl_uint num_events, cl_event const* wait_list,
+                    cl_event* run_event);
+
+/**
+ * Enqueues gemm on \p batch_size same-shaped matrices in a single launch.
+ * Matrices of a batch are stored one after another in their buffers,
+ * the index in the batch is the third dimension of the range.
+ */
+cl_int enqueue_gemm_batched(struct gpu_context* context,
+                            struct gemm_config const* config, unsigned flags,
+                            cl_mem a_buf, cl_mem b_buf, cl_mem c_buf,
+                            size_t n, size_t m, size_t k, size_t batch_size,
+                            cl_uint num_events, cl_event const* wait_list,
+                            cl_event* run_event);
+
+/**
+ * C = A * B with the kernel and tiling tuned for this device and shape,
+ * gemm4 with the default tiling if the shape wasn't tuned.
+ * a: matrix [N x M], b: matrix [M x K], c: matrix [N x K].
+ * Any n, m, k: shapes not divisible by TILE_SIZE run the GEMM_EDGES variant,
+ * without padding on the host.
+ * \param timing Filled if not NULL
+ */
+cl_int run_gemm(struct gpu_context* context,
+                float const* a, float const* b, float* c,
+                size_t n, size_t m, size_t k,
+                struct op_timing* timing);
+
+/// \ref run_gemm with the given kernel and tiling
+cl_int run_gemm_with_config(struct gpu_context* context,
+                            struct gemm_config const* config,
+                            float const* a, float const* b, float* c,
+                            size_t n, size_t m, size_t k,
+                            struct op_timing* timing);
+
+/**
+ * \ref run_gemm on transposed operands, read by the kernel as they are
+ * stored: with GEMM_TRANS_A \p a is matrix [M x N] holding A^T, with
+ * GEMM_TRANS_B \p b is matrix [K x M] holding B^T. Runs the tuned gemm4 or
+ * gemm4db config, the other kernels don't read transposed tiles.
+ * Transposed tiles are padded, a config they don't fit in local memory with
+ * runs with halved tiles, CL_OUT_OF_RESOURCES if none fits.
+ * \param flags GEMM_TRANS_A, GEMM_TRANS_B or both
+ */
+cl_int run_gemm_transposed(struct gpu_context* context, unsigned flags,
+                           float const* a, float const* b, float* c,
+                           size_t n, size_t m, size_t k,
+                           struct op_timing* timing);
+
+/**
+ * Strided batched \ref run_gemm: C[i] = A[i] * B[i] for i < batch_size.
+ * a: batch_size matrices [N x M], b: [M x K], c: [N x K], each stored
+ * contiguously right after the previous one. The whole batch is copied
+ * and multiplied with a single command each.
+ */
+cl_int run_gemm_batched(struct gpu_context* context,
+                        float const* a, float const* b, float* c,
+                        size_t n, size_t m, size_t k, size_t batch_size,
+                        struct op_timing* timing);
+
+/// Panels the pipelined gemm splits A and C into by default
+#define PIPELINE_DEFAULT_PANELS 8
+
+/**
+ * \ref run_gemm split into row panels of A and C. Panels are uploaded and
+ * downloaded on the transfer queue while the neighbouring panels' kernels
+ * run on the compute queue, so copies are hidden behind the computation.
+ * Reported total time is the end-to-end wall time of the whole call.
+ * \param panel_rows Rows per panel, multiple of the tile size, or 0 for
+ *        n / PIPELINE_DEFAULT_PANELS
+ */
+cl_int run_gemm_pipelined(struct gpu_context* context,
+                          float const* a, float const* b, float* c,
+                          size_t n, size_t m, size_t k, size_t panel_rows,
+                          struct op_timing* timing);
+
+/**
+ * \ref run_gemm for matrices which don't fit the device. A, B and C are cut
+ * into blocks of at most \p device_mem_limit bytes in total, the blocks of A
+ * and B are streamed through two device slots each, so that the next pair is
+ * uploaded while the current one is multiplied. C blocks stay on the device
+ * while the partial products over M are accumulated into them.
+ * \param device_mem_limit Device memory the call may use, 0 for half of
+ *        the device's global memory
+ */
+cl_int run_gemm_out_of_core(struct gpu_context* context,
+                            float const* a, float const* b, float* c,
+                            size_t n, size_t m, size_t k,
+                            size_t device_mem_limit,
+                            struct op_timing* timing);
+
+/**
+ * Host array living in a CL_MEM_ALLOC_HOST_PTR buffer. On CPU devices such
+ * buffers are shared with the host, so mapping replaces the copies.
+ */
+struct host_buffer
+{
+    cl_mem  mem;
+    float*  ptr;    //!< Host mapping, NULL while the device owns the buffer
+    size_t  size;   //!< Size in bytes
+};
+
+/// Allocates host buffer of \p size bytes, mapped for host access
+cl_int alloc_host_buffer(struct gpu_context* context, size_t size,
+                         struct host_buffer* buffer);
+
+/// Destructor for \ref host_buffer
+void release_host_buffer(struct gpu_context* context,
+                         struct host_buffer* buffer);
+
+/**
+ * \ref run_gemm on host buffers without copies: the buffers are unmapped
+ * for the kernel and mapped back after it, \ref host_buffer::ptr may change.
+ * Map and unmap commands are accounted as transfers.
+ */
+cl_int run_gemm_zero_copy(struct gpu_context* context,
+                          struct host_buffer* a, struct host_buffer* b,
+                          struct host_buffer* c,
+                          size_t n, size_t m, size_t k,
+                          struct op_timing* timing);
+
+/**
+ * Inclusive prefix sum of \p in into \p out.
+ * The scan tile is SCAN_TILE_SIZE, reduced to the device's max work group size.
+ * n is expected to be not greater than the tile or divisible by it.
+ */
+cl_int run_scan(struct gpu_context* context,
+                float const* in, float* out, size_t n,
+                struct op_timing* timing);
+
+/// Elementwise c = a + b
+cl_int run_array_sum(struct gpu_context* context,
+                     cl_int const* a, cl_int const* b, cl_int* c, size_t n,
+                     struct op_timing* timing);
+
+#endif //OPENCL_FUN_CLFUN_H
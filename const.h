@@ -1,21 +1,31 @@
 #ifndef OPENCL_FUN_CONST_H
 #define OPENCL_FUN_CONST_H
 
-#ifdef TILE_SIZE
-    #error Redefinition of TILE_SIZE
-#else
-    #define TILE_SIZE 32
+/// Defaults, kernels may be built with e.g. -DTILE_SIZE=16 instead
+
+#ifndef TILE_SIZE
+#define TILE_SIZE 32
 #endif
 
-#ifdef ELEMS_PER_THREAD
-#error Redifinition of ELEMS_PER_THREAD
-#else
+#ifndef ELEMS_PER_THREAD
 #define ELEMS_PER_THREAD 4
 #endif
 
-#ifdef SCAN_TILE_SIZE
-#error Redifinition of SCAN_TILE_SIZE
-#else
+/// gemm5 defaults: result tile of a work group, register tile side of a work
+/// item and the depth of A and B blocks staged in local memory
+#ifndef GEMM5_TILE_SIZE
+#define GEMM5_TILE_SIZE 64
+#endif
+
+#ifndef GEMM5_ELEMS_PER_THREAD
+#define GEMM5_ELEMS_PER_THREAD 4
+#endif
+
+#ifndef GEMM5_K_BLOCK
+#define GEMM5_K_BLOCK 32
+#endif
+
+#ifndef SCAN_TILE_SIZE
 #define SCAN_TILE_SIZE 1024
 #endif
 
@@ -0,0 +1,328 @@
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include "cpu_gemm.h"
+
+/// One SIMD register of floats: eight with AVX, four with SSE or NEON
+#ifdef __AVX__
+typedef float cpu_vec __attribute__((vector_size(32)));
+#else
+typedef float cpu_vec __attribute__((vector_size(16)));
+#endif
+
+#define CPU_VEC_WIDTH   (sizeof(cpu_vec) / sizeof(float))
+#define CPU_GEMM_NR_VEC (CPU_GEMM_NR / CPU_VEC_WIDTH)
+
+static inline
+size_t min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+/**
+ * Packs kc x nc panel of B into slivers of NR columns, each stored row after
+ * row, so that the micro-kernel reads it sequentially. Missing columns are zeros.
+ */
+static
+void pack_b_sliver(float const* b, size_t ldb, size_t kc, size_t nr,
+                   float* packed)
+{
+    for (size_t p = 0; p < kc; ++p)
+    {
+        size_t j = 0;
+        for (; j < nr; ++j)
+            packed[j] = b[p * ldb + j];
+        for (; j < CPU_GEMM_NR; ++j)
+            packed[j] = 0;
+        packed += CPU_GEMM_NR;
+    }
+}
+
+/// Packs mr x kc sliver of A column after column, missing rows are zeros
+static
+void pack_a_sliver(float const* a, size_t lda, size_t mr, size_t kc,
+                   float* packed)
+{
+    for (size_t p = 0; p < kc; ++p)
+    {
+        size_t i = 0;
+        for (; i < mr; ++i)
+            packed[i] = a[i * lda + p];
+        for (; i < CPU_GEMM_MR; ++i)
+            packed[i] = 0;
+        packed += CPU_GEMM_MR;
+    }
+}
+
+/**
+ * c[MR x NR] += a_sliver * b_sliver over kc. The whole tile of C is kept in
+ * MR * NR / CPU_VEC_WIDTH registers, every step broadcasts MR elements of A.
+ */
+static inline
+void micro_kernel(size_t kc, float const* a, float const* b,
+                  float* c, size_t ldc)
+{
+    cpu_vec acc[CPU_GEMM_MR][CPU_GEMM_NR_VEC];
+    memset(acc, 0, sizeof(acc));
+
+    for (size_t p = 0; p < kc; ++p)
+    {
+        cpu_vec b_row[CPU_GEMM_NR_VEC];
+        for (size_t v = 0; v < CPU_GEMM_NR_VEC; ++v)
+            memcpy(&b_row[v], b + v * CPU_VEC_WIDTH, sizeof(cpu_vec));
+
+        for (size_t i = 0; i < CPU_GEMM_MR; ++i)
+            for (size_t v = 0; v < CPU_GEMM_NR_VEC; ++v)
+                acc[i][v] += a[i] * b_row[v];
+
+        a += CPU_GEMM_MR;
+        b += CPU_GEMM_NR;
+    }
+
+    for (size_t i = 0; i < CPU_GEMM_MR; ++i)
+        for (size_t v = 0; v < CPU_GEMM_NR_VEC; ++v)
+        {
+            /// C rows aren't aligned, memcpy compiles to unaligned moves
+            cpu_vec c_row;
+            float* const dst = c + i * ldc + v * CPU_VEC_WIDTH;
+            memcpy(&c_row, dst, sizeof(cpu_vec));
+            c_row += acc[i][v];
+            memcpy(dst, &c_row, sizeof(cpu_vec));
+        }
+}
+
+/// Micro-kernel on a partial tile: computed in a full one, then added to C
+static
+void edge_kernel(size_t kc, float const* a, float const* b,
+                 float* c, size_t ldc, size_t mr, size_t nr)
+{
+    float tile[CPU_GEMM_MR * CPU_GEMM_NR] = {0};
+    micro_kernel(kc, a, b, tile, CPU_GEMM_NR);
+
+    for (size_t i = 0; i < mr; ++i)
+        for (size_t j = 0; j < nr; ++j)
+            c[i * ldc + j] += tile[i * CPU_GEMM_NR + j];
+}
+
+/// c[mc x nc] += packed A block * packed B panel
+static
+void macro_kernel(size_t mc, size_t nc, size_t kc,
+                  float const* a_packed, float const* b_packed,
+                  float* c, size_t ldc)
+{
+    for (size_t jr = 0; jr < nc; jr += CPU_GEMM_NR)
+    {
+        size_t const nr = min_size(CPU_GEMM_NR, nc - jr);
+        float const* const b_sliver = b_packed + jr * kc;
+
+        for (size_t ir = 0; ir < mc; ir += CPU_GEMM_MR)
+        {
+            size_t const mr = min_size(CPU_GEMM_MR, mc - ir);
+            float const* const a_sliver = a_packed + ir * kc;
+            float* const c_tile = c + ir * ldc + jr;
+
+            if (mr == CPU_GEMM_MR && nr == CPU_GEMM_NR)
+                micro_kernel(kc, a_sliver, b_sliver, c_tile, ldc);
+            else
+                edge_kernel(kc, a_sliver, b_sliver, c_tile, ldc, mr, nr);
+        }
+    }
+}
+
+cl_int cpu_gemm(float const* a, float const* b, float* c,
+                size_t n, size_t m, size_t k, cl_ulong* elapsed_ns)
+{
+    assert(a);
+    assert(b);
+    assert(c);
+
+    cl_ulong const start_ns = host_time_ns();
+    size_t const num_threads = omp_get_max_threads();
+
+    /// Rounded up to whole slivers, which also keeps the sizes 64-byte multiples
+    size_t const a_block_size = CPU_GEMM_MC * CPU_GEMM_KC * sizeof(float);
+    size_t const b_panel_size = CPU_GEMM_KC * CPU_GEMM_NC * sizeof(float);
+    float* const a_packed = aligned_alloc(64, num_threads * a_block_size);
+    float* const b_packed = aligned_alloc(64, b_panel_size);
+    if (!a_packed || !b_packed)
+    {
+        free(a_packed);
+        free(b_packed);
+        return CL_OUT_OF_HOST_MEMORY;
+    }
+
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i)
+        memset(c + i * k, 0, k * sizeof(float));
+
+    #pragma omp parallel
+    {
+        float* const a_block = a_packed
+            + omp_get_thread_num() * (a_block_size / sizeof(float));
+
+        for (size_t jc = 0; jc < k; jc += CPU_GEMM_NC)
+        {
+            size_t const nc = min_size(CPU_GEMM_NC, k - jc);
+
+            for (size_t pc = 0; pc < m; pc += CPU_GEMM_KC)
+            {
+                size_t const kc = min_size(CPU_GEMM_KC, m - pc);
+
+                /// The threads pack the panel together, the barrier at the
+                /// end of the loop publishes it to all of them
+                #pragma omp for
+                for (size_t jr = 0; jr < nc; jr += CPU_GEMM_NR)
+                    pack_b_sliver(
+                        b + pc * k + jc + jr, k, kc,
+                        min_size(CPU_GEMM_NR, nc - jr), b_packed + jr * kc
+                    );
+
+                #pragma omp for schedule(dynamic)
+                for (size_t ic = 0; ic < n; ic += CPU_GEMM_MC)
+                {
+                    size_t const mc = min_size(CPU_GEMM_MC, n - ic);
+                    for (size_t ir = 0; ir < mc; ir += CPU_GEMM_MR)
+                        pack_a_sliver(
+                            a + (ic + ir) * m + pc, m,
+                            min_size(CPU_GEMM_MR, mc - ir), kc, a_block + ir * kc
+                        );
+
+                    macro_kernel(
+                        mc, nc, kc, a_block, b_packed, c + ic * k + jc, k
+                    );
+                }
+            }
+        }
+    }
+
+    free(a_packed);
+    free(b_packed);
+
+    if (elapsed_ns)
+        *elapsed_ns = host_time_ns() - start_ns;
+    return 0;
+}
+
+cl_int verify_gemm_freivalds(float const* a, float const* b, float const* c,
+                             size_t n, size_t m, size_t k, size_t num_vectors,
+                             size_t block_width, size_t* bad_rows,
+                             cl_ulong* elapsed_ns)
+{
+    assert(a);
+    assert(b);
+    assert(c);
+    assert(bad_rows);
+
+    cl_ulong const start_ns = host_time_ns();
+    size_t const width = block_width && block_width < k ? block_width : k;
+    size_t const blocks = width ? (k + width - 1) / width : 0;
+    cl_int result = 0;
+    *bad_rows = 0;
+
+    float* const r = malloc(k * sizeof(float));
+    float* const br = malloc(m * blocks * sizeof(float));      //!< B * r of each block
+    float* const abr = malloc(n * blocks * sizeof(float));     //!< A * (B * r)
+    double* const a_norms = malloc(n * sizeof(double));        //!< |A_i|
+    double* const b_norms = calloc(blocks, sizeof(double));    //!< |B_J|^2, Frobenius
+    char* const bad = calloc(n, 1);
+    if (!r || !br || !abr || !a_norms || !b_norms || !bad)
+    {
+        result = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
+
+    #pragma omp parallel for
+    for (size_t i = 0; i < n; ++i)
+    {
+        double sum = 0;
+        for (size_t j = 0; j < m; ++j)
+            sum += (double) a[i * m + j] * a[i * m + j];
+        a_norms[i] = sqrt(sum);
+    }
+
+    for (size_t j = 0; j < m; ++j)
+        for (size_t l = 0; l < k; ++l)
+            b_norms[l / width] += (double) b[j * k + l] * b[j * k + l];
+    for (size_t block = 0; block < blocks; ++block)
+        b_norms[block] = sqrt(b_norms[block]);
+
+    /**
+     * C_il is an M-term float sum, its rounding error is about
+     * sqrt(M) * eps * (|A| |B|)_il <= sqrt(M) * eps * |A_i| |B_l|. With r of
+     * random signs the errors of a block add as the root of their squares,
+     * to sqrt(M) * eps * |A_i| |B_J|, while a wrong element adds in full.
+     * A * (B * r) is computed to the same error, as |(B * r)_J| ~ |B_J|
+     */
+    double const tolerance = FREIVALDS_TOLERANCE * FLT_EPSILON * sqrt((double) m);
+
+    for (size_t v = 0; v < num_vectors; ++v)
+    {
+        for (size_t l = 0; l < k; ++l)
+            r[l] = rand() & 1 ? 1.0f : -1.0f;
+
+        #pragma omp parallel for
+        for (size_t j = 0; j < m; ++j)
+            for (size_t block = 0; block < blocks; ++block)
+            {
+                size_t const last = (block + 1) * width < k ? (block + 1) * width : k;
+                double sum = 0;
+                for (size_t l = block * width; l < last; ++l)
+                    sum += b[j * k + l] * r[l];
+                br[j * blocks + block] = (float) sum;
+            }
+
+        /// A single r takes a product by a vector, narrower blocks a product
+        /// by K / width columns, which the packed gemm does
+        if (blocks > 1)
+        {
+            result = cpu_gemm(a, br, abr, n, m, blocks, NULL);
+            CHECK_ERR("Freivalds' product failed", result, free_arrays);
+        }
+        else
+        {
+            #pragma omp parallel for
+            for (size_t i = 0; i < n; ++i)
+            {
+                double sum = 0;
+                for (size_t j = 0; j < m; ++j)
+                    sum += a[i * m + j] * br[j];
+                abr[i] = (float) sum;
+            }
+        }
+
+        #pragma omp parallel for
+        for (size_t i = 0; i < n; ++i)
+            for (size_t block = 0; block < blocks; ++block)
+            {
+                size_t const last = (block + 1) * width < k ? (block + 1) * width : k;
+                double actual = 0;
+                for (size_t l = block * width; l < last; ++l)
+                    actual += c[i * k + l] * r[l];
+
+                /// Written as !(<=), so that NaNs fail too
+                double const bound = tolerance * a_norms[i] * b_norms[block];
+                if (!(fabs(abr[i * blocks + block] - actual) <= bound + FLT_MIN))
+                    bad[i] = 1;
+            }
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        *bad_rows += bad[i];
+
+free_arrays:
+    free(r);
+    free(br);
+    free(abr);
+    free(a_norms);
+    free(b_norms);
+    free(bad);
+
+    if (elapsed_ns)
+        *elapsed_ns = host_time_ns() - start_ns;
+    return result;
+}
@@ -0,0 +1,57 @@
+#ifndef OPENCL_FUN_CPU_GEMM_H
+#define OPENCL_FUN_CPU_GEMM_H
+
+#include "clfun.h"
+
+/// Rows and columns of C computed by the micro-kernel, kept in registers
+#define CPU_GEMM_MR     6
+#define CPU_GEMM_NR     16
+
+/**
+ * Cache blocking: a KC x NC panel of B stays in the shared cache,
+ * an MC x KC block of A in each core's L2, a KC x NR sliver of B in L1.
+ */
+#define CPU_GEMM_KC     256
+#define CPU_GEMM_MC     96
+#define CPU_GEMM_NC     4096
+
+/**
+ * C = A * B on the host, the reference the device results are checked against.
+ * a: matrix [N x M], b: matrix [M x K], c: matrix [N x K], any dimensions.
+ * Blocks of A and B are packed into micro-kernel order and row blocks of C
+ * are spread over the OpenMP threads.
+ * \param elapsed_ns Set to the host wall time of the call if not NULL
+ */
+cl_int cpu_gemm(float const* a, float const* b, float* c,
+                size_t n, size_t m, size_t k, cl_ulong* elapsed_ns);
+
+/// Random vectors \ref verify_gemm_freivalds checks by default
+#define FREIVALDS_DEFAULT_VECTORS 3
+
+/// Block width of \ref verify_gemm_freivalds which singles out wrong elements
+#define FREIVALDS_ELEMENT_BLOCK 16
+
+/// Allowed difference of \ref verify_gemm_freivalds, in expected rounding errors
+#define FREIVALDS_TOLERANCE 2
+
+/**
+ * Freivalds' check of C = A * B in O(N * M + M * K + N * K): compares
+ * A * (B * r) with C * r for \p num_vectors random vectors r of signs. Row i
+ * may differ by FREIVALDS_TOLERANCE * FLT_EPSILON * sqrt(M) * |A_i| |B|, the
+ * typical rounding error of its float sums, so the tolerance grows with M
+ * and the magnitudes of the inputs. A wrong element is caught once it stands
+ * out of the rounding errors of a whole row.
+ * \param block_width 0 for the check above. Otherwise every block J of
+ *        \p block_width columns of C is checked apart, against
+ *        |A_i| |B_J|, which catches single wrong elements near the rounding
+ *        error, e.g. with FREIVALDS_ELEMENT_BLOCK, in
+ *        O(N * M * K / block_width) instead.
+ * \param bad_rows Set to the number of rows failing any of the vectors
+ * \param elapsed_ns Set to the host wall time of the call if not NULL
+ */
+cl_int verify_gemm_freivalds(float const* a, float const* b, float const* c,
+                             size_t n, size_t m, size_t k, size_t num_vectors,
+                             size_t block_width, size_t* bad_rows,
+                             cl_ulong* elapsed_ns);
+
+#endif //OPENCL_FUN_CPU_GEMM_H
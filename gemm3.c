@@ -128,7 +128,10 @@ int main()
     );
     CHECK_ERR("Error creating program:", error_code, exit3);
 
-    error_code = clBuildProgram(program, 1, gpu_devices, "", 0, 0);
+    char build_options[64];
+    snprintf(build_options, sizeof(build_options), "-DTILE_SIZE=%zu", tile_size);
+
+    error_code = clBuildProgram(program, 1, gpu_devices, build_options, 0, 0);
     if (error_code)
     {
         size_t log_len = 0;
@@ -1,5 +1,3 @@
-#define TILE_SIZE 32
-
 __kernel void gemm3(__global float const* const a,      /** a: matrix [N x M] */
                     __global float const* const b,      /** b: matrix [M x K] */
                     __global float* const c,            /** c: matrix [N x K] */
@@ -16,15 +14,27 @@ __kernel void gemm3(__global float const* const a,      /** a: matrix [N x M] */
     local float B_sub[TILE_SIZE][TILE_SIZE];    //!< Local buffer for subtiles from the second input matrix
 
     float local_sum         = 0;
+
+    /// -DGEMM_EDGES takes any shape on a range rounded up to whole tiles,
+    /// elements outside the matrices are loaded as zeros and not stored
+#ifdef GEMM_EDGES
+    uint const tile_cnt     = (m + TILE_SIZE - 1) / TILE_SIZE;
+#else
     uint const tile_cnt     = m / TILE_SIZE;
+#endif
     for (uint tile_id = 0; tile_id < tile_cnt; ++tile_id)
     {
         uint tiled_col = tile_id * TILE_SIZE + tile_j;  //!< Global col id for first matrix
         uint tiled_row = tile_id * TILE_SIZE + tile_i;  //!< Global row id for second matrix
 
         /// Loading them into the current tile buffer
+#ifdef GEMM_EDGES
+        A_sub[tile_i][tile_j] = global_i < n && tiled_col < m ? a[global_i * m + tiled_col] : 0;
+        B_sub[tile_i][tile_j] = tiled_row < m && global_l < k ? b[tiled_row * k + global_l] : 0;
+#else
         A_sub[tile_i][tile_j] = a[global_i * m + tiled_col];
         B_sub[tile_i][tile_j] = b[tiled_row * k + global_l];
+#endif
 
         /// Awaiting local group to fill the buffer
         barrier(CLK_LOCAL_MEM_FENCE);
@@ -37,5 +47,8 @@ __kernel void gemm3(__global float const* const a,      /** a: matrix [N x M] */
         barrier(CLK_LOCAL_MEM_FENCE);
     }
 
+#ifdef GEMM_EDGES
+    if (global_i < n && global_l < k)
+#endif
     c[global_i * k + global_l] = local_sum;
 }
@@ -1,35 +1,16 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
 #include <omp.h>
-#include <CL/opencl.h>
-
-#include "const.h"
-
-#ifndef CHECK_ERR
-#define CHECK_ERR(intro, result, exit_label)        \
-do {                                                \
-    if ((result) != 0)                              \
-    {                                               \
-        fprintf(stderr, "%s: %d\n", intro, result); \
-        goto exit_label;                            \
-    }                                               \
-} while (false)
-#endif
-
-#ifndef CHECK_AND_RET_ERR
-#define CHECK_AND_RET_ERR(intro, result)            \
-do {                                                \
-    if ((result) != 0)                              \
-    {                                               \
-        fprintf(stderr, "%s: %d\n", intro, result); \
-        return result;                              \
-    }                                               \
-} while (false)
-#endif
+
+#include "autotune.h"
+#include "clfun.h"
+#include "cpu_gemm.h"
+#include "multi_device.h"
 
 static inline
 void fill_array(float* ptr, size_t cnt)
@@ -38,71 +19,6 @@ void fill_array(float* ptr, size_t cnt)
         ptr[i] = (float) ((double) rand() / (double) (RAND_MAX));
 }
 
-static inline
-char* load_source_file(char const* file_name, size_t* len)
-{
-    FILE* source_file = fopen(file_name, "r");
-    if (!source_file)
-    {
-        perror("Error opening source file");
-        return NULL;
-    }
-
-    size_t const file_load_sz = 1024 * 1024;
-    char* program_code = malloc(file_load_sz);
-    if (!program_code)
-    {
-        fclose(source_file);
-        return NULL;
-    }
-
-    size_t code_len = fread(program_code, 1, file_load_sz - 1, source_file);
-    program_code[code_len] = '\0';
-    *len = code_len;
-
-    return program_code;
-}
-
-struct gpu_context
-{
-    size_t n;
-    size_t m;
-    size_t k;
-
-    cl_device_id        selected_device;
-
-    cl_context          context;
-    cl_command_queue    command_queue;
-    cl_program          program;
-
-    cl_mem              fst_mattr_buff_in;
-    cl_mem              sec_mattr_buff_in;
-    cl_mem              thr_mattr_buff_out;
-    cl_kernel           kernel;
-};
-
-/// Destructor for \ref gpu_context
-void release_gpu_context(struct gpu_context* context)
-{
-    if (context->program)
-        clReleaseProgram(context->program);
-    if (context->fst_mattr_buff_in)
-        clReleaseMemObject(context->fst_mattr_buff_in);
-    if (context->sec_mattr_buff_in)
-        clReleaseMemObject(context->sec_mattr_buff_in);
-    if (context->thr_mattr_buff_out)
-        clReleaseMemObject(context->thr_mattr_buff_out);
-    if (context->kernel)
-        clReleaseKernel(context->kernel);
-    if (context->context)
-        clReleaseContext(context->context);
-    if (context->command_queue)
-        clReleaseCommandQueue(context->command_queue);
-    if (context->selected_device)
-        clReleaseDevice(context->selected_device);
-    free(context);
-}
-
 struct input_data
 {
     size_t n;
@@ -116,14 +32,27 @@ struct input_data
     float* in_A;
     float* in_B;
     float* out_C;
+
+    /// Zero-copy mode: arrays above are mappings of these buffers
+    bool                zero_copy;
+    struct host_buffer  buffers[3];
 };
 
 /// Destructor for \ref input_data
-void release_input_data(struct input_data* context)
+void release_input_data(struct gpu_context* gpu_context,
+                        struct input_data* context)
 {
     if (!context)
         return;
 
+    if (context->zero_copy)
+    {
+        for (size_t i = 0; i < 3; ++i)
+            release_host_buffer(gpu_context, &context->buffers[i]);
+        free(context);
+        return;
+    }
+
     if (context->in_A)
         free(context->in_A);
     if (context->in_B)
@@ -133,441 +62,622 @@ void release_input_data(struct input_data* context)
     free(context);
 }
 
+/// Points the arrays to the current mappings of the zero-copy buffers
 static inline
-char const* get_mem_type_str(cl_device_local_mem_type t)
+void update_mappings(struct input_data* data)
 {
-    switch (t)
-    {
-    case CL_LOCAL:
-        return "local";
-    case CL_GLOBAL:
-        return "global";
-    default:
-        return "other";
-    }
+    data->in_A = data->buffers[0].ptr;
+    data->in_B = data->buffers[1].ptr;
+    data->out_C = data->buffers[2].ptr;
 }
 
-/// Setup device for the specified \ref gpu_context
-cl_int select_device(struct gpu_context* context)
+/**
+ * Generates random input.
+ * \param zero_copy Allocate the arrays as CL_MEM_ALLOC_HOST_PTR buffers of
+ *        the context instead of the heap
+ */
+struct input_data* generate_input(struct gpu_context* context,
+                                  size_t n, size_t m, size_t k,
+                                  bool zero_copy)
 {
-    assert(context);
+    struct input_data* data = calloc(1, sizeof(struct input_data));
 
-    cl_int error_code;
-    cl_uint num_platforms;
+    data->n = n;
+    data->m = m;
+    data->k = k;
 
-    error_code = clGetPlatformIDs(0, 0, &num_platforms);
-    if (error_code)
+    data->in_A_size = n * m;
+    data->in_B_size = m * k;
+    data->out_C_size = n * k;
+
+    if (zero_copy)
     {
-        fprintf(stderr, "Error getting platforms list!\n");
-        return error_code;
+        size_t const sizes[] = {data->in_A_size, data->in_B_size, data->out_C_size};
+        data->zero_copy = true;
+        for (size_t i = 0; i < 3; ++i)
+            if (alloc_host_buffer(context, sizes[i] * sizeof(float), &data->buffers[i]))
+                goto error_return;
+        update_mappings(data);
     }
-
-    cl_platform_id* platforms = calloc(num_platforms, sizeof(cl_platform_id));
-
-    error_code = clGetPlatformIDs(num_platforms, platforms, &num_platforms);
-    if (error_code)
+    else
     {
-        fprintf(stderr, "Error getting platforms list!\n");
-        free(platforms);
-        return error_code;
+        data->in_A = calloc(data->in_A_size, sizeof(float));
+        data->in_B = calloc(data->in_B_size, sizeof(float));
+        data->out_C = calloc(data->out_C_size, sizeof(float));
+
+        if (!data->in_A || !data->in_B || !data->out_C)
+            goto error_return;
     }
 
-    cl_uint num_devices = 0;
-    size_t max_devices = 42;
-    cl_device_id device_list[max_devices];
-    char device_name[64];
+    fill_array(data->in_A, data->in_A_size);
+    fill_array(data->in_B, data->in_B_size);
 
-    cl_device_local_mem_type mem_type = CL_NONE;
-    size_t max_work_group_size = 0;
+    return data;
 
-    for (size_t i = 0; i < num_platforms; ++i)
-    {
-        error_code = clGetDeviceIDs(
-            platforms[i], CL_DEVICE_TYPE_ALL, max_devices, device_list,
-            &num_devices
-        );
+error_return:
+    release_input_data(context, data);
+    return NULL;
+}
 
-        if (error_code) continue;
+/// Checks the result against \ref cpu_gemm and prints the reference's rate
+void validate_result(struct input_data* data)
+{
+    float* const gold = (float*) malloc(data->out_C_size * sizeof(float));
+    fprintf(stderr, "Validating results...\n");
 
-        for (size_t j = 0; j < num_devices; ++j)
-        {
-            if (!context->selected_device)
-                context->selected_device = device_list[j];
+    cl_ulong elapsed_ns = 0;
+    cl_int const result = gold ? cpu_gemm(
+        data->in_A, data->in_B, gold, data->n, data->m, data->k, &elapsed_ns
+    ) : CL_OUT_OF_HOST_MEMORY;
+    assert(!result);
+    printf(
+        "cpu reference: %.4f ms, %.2f GFlops\n", elapsed_ns / 1e6,
+        2.0 * data->n * data->m * data->k / elapsed_ns
+    );
 
-            size_t ret_sz = 0;
-            cl_device_local_mem_type cur_mem_type = 0;
-            size_t work_group_size = 0;
+    for (size_t i = 0; i < data->n; ++i)
+        for (size_t l = 0; l < data->k; ++l)
+        {
+            float delta = gold[i * data->k + l] - data->out_C[i * data->k + l];
+            float abs_delta = fabsf(delta);
+            assert(abs_delta < 0.05);
+        }
 
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_LOCAL_MEM_TYPE,
-                sizeof(cl_device_local_mem_type), &cur_mem_type, &ret_sz
-            );
+    free(gold);
+}
 
-            if (error_code)
-            {
-                if (context->selected_device != device_list[j])
-                    clReleaseDevice(device_list[j]);
-                continue;
-            }
+/// Cheaper alternative to \ref validate_result, see \ref verify_gemm_freivalds
+void validate_result_freivalds(struct input_data* data)
+{
+    fprintf(stderr, "Validating results with Freivalds' check...\n");
 
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_MAX_WORK_GROUP_SIZE,
-                sizeof(size_t), &work_group_size, &ret_sz
-            );
+    size_t bad_rows = 0;
+    cl_ulong elapsed_ns = 0;
+    cl_int const result = verify_gemm_freivalds(
+        data->in_A, data->in_B, data->out_C, data->n, data->m, data->k,
+        FREIVALDS_DEFAULT_VECTORS, 0, &bad_rows, &elapsed_ns
+    );
+    assert(!result);
+    printf(
+        "freivalds: %d vectors, %.4f ms, %zu bad rows\n",
+        FREIVALDS_DEFAULT_VECTORS, elapsed_ns / 1e6, bad_rows
+    );
+    assert(!bad_rows);
+}
 
-            if (error_code)
-            {
-                if (context->selected_device != device_list[j])
-                    clReleaseDevice(device_list[j]);
-                continue;
-            }
+/**
+ * Checks that the element-wise Freivalds' check, with FREIVALDS_ELEMENT_BLOCK
+ * columns per block, catches a single element of the validated result off by
+ * a fifth of validate_result's tolerance. Sensitivity depends on M and the
+ * inputs' magnitudes, this holds for the shapes of this program.
+ */
+void check_freivalds_sensitivity(struct input_data* data)
+{
+    fprintf(stderr, "Checking Freivalds' check on a wrong element...\n");
+
+    size_t bad_rows = 0;
+    size_t const corrupted = (size_t) rand() % data->out_C_size;
+    float const saved = data->out_C[corrupted];
+    data->out_C[corrupted] += 0.01f;
+    cl_int const corrupted_result = verify_gemm_freivalds(
+        data->in_A, data->in_B, data->out_C, data->n, data->m, data->k,
+        FREIVALDS_DEFAULT_VECTORS, FREIVALDS_ELEMENT_BLOCK, &bad_rows, NULL
+    );
+    data->out_C[corrupted] = saved;
+    assert(!corrupted_result);
+    printf(
+        "freivalds: C[%zu][%zu] off by 0.01, %zu bad rows\n",
+        corrupted / data->k, corrupted % data->k, bad_rows
+    );
+    assert(bad_rows == 1);
+}
 
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_NAME, 63, device_name, &ret_sz
-            );
+/// Size of the buffers \ref check_buffer_pool_limit allocates
+#define POOL_CHECK_BUFFER_SIZE ((size_t) 1 << 20)
 
-            device_name[ret_sz] = '\0';
-            fprintf(
-                stderr,
-                "Found device \"%s\": mem type %s, max workgroup size %zu\n",
-                device_name, get_mem_type_str(cur_mem_type), work_group_size
-            );
+/**
+ * Checks that the pool keeps to its limit: the runs so far stayed under it,
+ * and with room for two buffers a third request is refused while both are in
+ * use, then served by dropping a free buffer of other flags. The pool's own
+ * limit is restored afterwards.
+ */
+void check_buffer_pool_limit(struct buffer_pool* pool)
+{
+    fprintf(stderr, "Checking buffer pool limit...\n");
 
-            if ((mem_type != CL_LOCAL && cur_mem_type == CL_LOCAL)
-                || (cur_mem_type == mem_type
-                    && max_work_group_size < work_group_size))
-            {
-                clReleaseDevice(context->selected_device);
-                context->selected_device = device_list[j];
-                max_work_group_size = work_group_size;
-                mem_type = cur_mem_type;
-            }
-            else if (context->selected_device != device_list[j])
-                clReleaseDevice(device_list[j]);
-        }
-    }
+    size_t const saved_limit = pool->limit_bytes;
+    size_t const size = POOL_CHECK_BUFFER_SIZE;
+    cl_int error = 0;
+    assert(!saved_limit || pool->high_water_mark <= saved_limit);
 
-    if (!context->selected_device)
-    {
-        free(platforms);
-        return error_code;
-    }
-    else
-    {
-        size_t ret_sz;
-        clGetDeviceInfo(
-            context->selected_device, CL_DEVICE_NAME, 63, device_name, &ret_sz
-        );
-        device_name[ret_sz] = '\0';
+    trim_buffer_pool(pool);
+    set_buffer_pool_limit(pool, pool->allocated_bytes + 2 * size);
 
-        fprintf(stderr, "Selected device: %s\n", device_name);
-    }
+    cl_mem const first = acquire_buffer(pool, CL_MEM_READ_ONLY, size, &error);
+    assert(first && !error);
+    cl_mem const second = acquire_buffer(pool, CL_MEM_READ_ONLY, size, &error);
+    assert(second && !error);
 
-    context->context = clCreateContext(
-        0, 1, &context->selected_device, 0, 0, &error_code
-    );
+    /// Nothing free to drop, the request over the limit is refused
+    cl_mem third = acquire_buffer(pool, CL_MEM_WRITE_ONLY, size, &error);
+    assert(!third && error == CL_MEM_OBJECT_ALLOCATION_FAILURE);
 
-    if (error_code)
-    {
-        release_gpu_context(context);
-        return error_code;
-    }
+    release_buffer(pool, second);
+    third = acquire_buffer(pool, CL_MEM_WRITE_ONLY, size, &error);
+    assert(third && !error);
+    assert(!pool->num_free && pool->allocated_bytes <= pool->limit_bytes);
 
-    context->command_queue = clCreateCommandQueue(
-        context->context, context->selected_device, CL_QUEUE_PROFILING_ENABLE,
-        &error_code
+    printf(
+        "buffer pool: refused and evicted at %.2f MiB limit\n",
+        pool->limit_bytes / 1048576.0
     );
 
-    if (error_code)
-    {
-        release_gpu_context(context);
-        return error_code;
-    }
-
-    return 0;
+    release_buffer(pool, first);
+    release_buffer(pool, third);
+    set_buffer_pool_limit(pool, saved_limit);
 }
 
-/// Loads and compile the kernel for the specified \ref gpu_context
-cl_int load_program(struct gpu_context* context,
-                    char const** sources_list, size_t src_list_sz,
-                    char const* kernel_name)
+/**
+ * Runs the gemm split across every device found and prints each device's share.
+ * \param timing Set to the timing of the multi-device run
+ */
+cl_int run_on_all_devices(struct input_data* data, struct op_timing* timing)
 {
-    assert(context);
-    assert(context->selected_device);
-    assert(context->context);
-
-    char const* file_data[src_list_sz];
-    size_t lens[src_list_sz];
-    cl_int result = 0;
+    cl_int error_code = 0;
+    struct device_share* shares = NULL;
 
-    memset(file_data, 0, sizeof(char const*) * src_list_sz);
+    struct device_group* group = setup_device_group(NULL, 0, NULL, 0, &error_code);
+    CHECK_AND_RET_ERR("device group setup failed", error_code);
 
-    for (size_t i = 0; i < src_list_sz; ++i)
+    shares = calloc(group->num_contexts, sizeof(struct device_share));
+    if (!shares)
     {
-        file_data[i] = load_source_file(sources_list[i], &lens[i]);
-        if (!file_data[i])
-        {
-            result = -1;
-            goto return_error;
-        }
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto release_group;
     }
 
-    context->program = clCreateProgramWithSource(
-        context->context, src_list_sz, file_data, lens, &result
-    );
-    CHECK_ERR("Failed to create clProgram", result, return_error);
-
-    result = clBuildProgram(
-        context->program, 1, &context->selected_device, "", 0, 0
+    /// Stale result of the previous runs must not pass the validation
+    memset(data->out_C, 0, data->out_C_size * sizeof(float));
+    error_code = run_gemm_multi_device(
+        group, data->in_A, data->in_B, data->out_C, data->n, data->m, data->k,
+        shares, timing
     );
+    CHECK_ERR("multi-device gemm failed", error_code, release_group);
 
-    if (result)
-    {
-        fprintf(stderr, "kernel compilation failed\n");
-        size_t log_len = 0;
-        cl_int saved_error_code = result;
-        char* build_log;
-
-        result = clGetProgramBuildInfo (
-            context->program, context->selected_device,
-            CL_PROGRAM_BUILD_LOG, 0, 0, &log_len
-        );
-        CHECK_ERR("Failed to retrieve build's log", result, return_error);
-
-        build_log = malloc(log_len);
-        result = clGetProgramBuildInfo(
-            context->program, context->selected_device,
-            CL_PROGRAM_BUILD_LOG, log_len, build_log, &log_len
-        );
-
-        if (result)
-        {
-            fprintf(stderr, "Failed to retrieve build's log: %d", result);
-            free(build_log);
-            goto return_error;
-        }
+    print_device_shares(group, shares, data->n, stdout);
 
-        fprintf(stderr, "Kernel compilation log:\n%s\n", build_log);
-        result = saved_error_code;
-        goto return_error;
-    }
-
-return_error:
-    for (size_t i = 0; i < src_list_sz; ++i)
-        free((void*) file_data[i]);
-    return result;
+release_group:
+    free(shares);
+    release_device_group(group);
+    return error_code;
 }
 
-/// Setups kernel & kernel structs like mem buffers for the \ref gpu_context
-cl_int setup_kernel(struct gpu_context* context,
-                    char const* kernel_name)
+/**
+ * Runs the gemm on the sub-devices of the context's device, with each
+ * sub-device's rows of A and C first-touched on its NUMA node.
+ * \param timing Set to the timing of the partitioned run
+ */
+cl_int run_on_sub_devices(struct gpu_context* context, struct input_data* data,
+                          struct op_timing* timing)
 {
-    size_t n = context->n;
-    size_t m = context->m;
-    size_t k = context->k;
-
-    cl_int result = 0;
-
-    assert(context);
-    assert(context->selected_device);
-    assert(context->context);
-    assert(context->command_queue);
+    cl_int error_code = 0;
+    size_t* rows = NULL;
+    struct device_share* shares = NULL;
+    float* a = NULL;
+    float* c = NULL;
+
+    struct device_group* group = setup_fission_group(
+        context->selected_device, NULL, 0, &error_code
+    );
+    CHECK_AND_RET_ERR("device fission failed", error_code);
 
-    context->kernel = clCreateKernel(context->program, kernel_name, &result);
-    CHECK_AND_RET_ERR("Failed to create kernel", result);
+    rows = calloc(group->num_contexts, sizeof(size_t));
+    shares = calloc(group->num_contexts, sizeof(struct device_share));
+    a = malloc(data->in_A_size * sizeof(float));
+    c = malloc(data->out_C_size * sizeof(float));
+    if (!rows || !shares || !a || !c)
+    {
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto release_group;
+    }
 
-    context->fst_mattr_buff_in = clCreateBuffer(
-        context->context, CL_MEM_READ_ONLY, n * m * sizeof(float), 0, &result
-    );
-    CHECK_ERR("Error creating buffer", result, release_kernel);
+    split_gemm_rows(group, data->n, data->m, data->k, rows);
+    first_touch_rows(group, a, data->m * sizeof(float), rows);
+    first_touch_rows(group, c, data->k * sizeof(float), rows);
+    memcpy(a, data->in_A, data->in_A_size * sizeof(float));
 
-    context->sec_mattr_buff_in = clCreateBuffer(
-        context->context, CL_MEM_READ_ONLY, m * k * sizeof(float), 0, &result
+    error_code = run_gemm_multi_device(
+        group, a, data->in_B, c, data->n, data->m, data->k, shares, timing
     );
-    CHECK_ERR("Error creating buffer", result, release_mem1);
+    CHECK_ERR("partitioned gemm failed", error_code, release_group);
+
+    memcpy(data->out_C, c, data->out_C_size * sizeof(float));
+    print_device_shares(group, shares, data->n, stdout);
+
+release_group:
+    free(a);
+    free(c);
+    free(rows);
+    free(shares);
+    release_device_group(group);
+    return error_code;
+}
 
-    context->thr_mattr_buff_out = clCreateBuffer(
-        context->context, CL_MEM_READ_WRITE, n * k * sizeof(float), 0, &result
-    );
-    CHECK_ERR("Error creating buffer", result, release_mem2);
+/// Runs of the co-executed gemm, the split adapts after each of them
+#define CO_EXEC_RUNS 4
 
-    clSetKernelArg(context->kernel, 0, sizeof(cl_mem), &context->fst_mattr_buff_in);
-    clSetKernelArg(context->kernel, 1, sizeof(cl_mem), &context->sec_mattr_buff_in);
-    clSetKernelArg(context->kernel, 2, sizeof(cl_mem), &context->thr_mattr_buff_out);
-    clSetKernelArg(context->kernel, 3, sizeof(cl_uint), &context->n);
-    clSetKernelArg(context->kernel, 4, sizeof(cl_uint), &context->m);
-    clSetKernelArg(context->kernel, 5, sizeof(cl_uint), &context->k);
+/**
+ * Runs the gemm CO_EXEC_RUNS times split between the device and the host
+ * threads and prints how the split converges.
+ * \param timing Set to the timing of the last run
+ */
+cl_int run_co_executed(struct gpu_context* context, struct input_data* data,
+                       struct op_timing* timing)
+{
+    cl_int error_code = 0;
+    struct co_exec_state state;
+    struct device_share shares[2];
+    init_co_exec_state(&state, CO_EXEC_DEFAULT_CPU_FRACTION);
 
+    for (size_t run = 0; run < CO_EXEC_RUNS; ++run)
+    {
+        /// Stale result of the previous runs must not pass the validation
+        memset(data->out_C, 0, data->out_C_size * sizeof(float));
+        error_code = run_gemm_co_exec(
+            context, &state, data->in_A, data->in_B, data->out_C,
+            data->n, data->m, data->k, shares, timing
+        );
+        CHECK_AND_RET_ERR("co-executed gemm failed", error_code);
+
+        printf(
+            "run %zu: device %zu rows in %.4f ms, host %zu rows in %.4f ms, "
+            "end-to-end %.4f ms, next host share %.1f%%\n",
+            run, shares[0].rows, shares[0].busy_ns / 1e6, shares[1].rows,
+            shares[1].busy_ns / 1e6, timing->total_ns / 1e6,
+            100.0 * state.cpu_fraction
+        );
+    }
     return 0;
+}
+
+/// Returns new copy of the rows x cols matrix transposed
+static
+float* transpose_matrix(float const* src, size_t rows, size_t cols)
+{
+    float* const dst = malloc(rows * cols * sizeof(float));
+    if (!dst)
+        return NULL;
 
-release_mem2:
-    clReleaseMemObject(context->sec_mattr_buff_in);
-    context->sec_mattr_buff_in = NULL;
-release_mem1:
-    clReleaseMemObject(context->fst_mattr_buff_in);
-    context->fst_mattr_buff_in = NULL;
-release_kernel:
-    clReleaseKernel(context->kernel);
-    context->kernel = NULL;
-    return result;
+    for (size_t i = 0; i < rows; ++i)
+        for (size_t j = 0; j < cols; ++j)
+            dst[j * rows + i] = src[i * cols + j];
+    return dst;
 }
 
-struct gpu_context* setup_gpu_context(size_t n, size_t m, size_t k,
-                                      char const** sources_list,
-                                      size_t src_list_sz,
-                                      char const* kernel_name,
-                                      cl_int* error)
+/**
+ * Runs the gemm on A^T and B^T stored as such, with every combination of
+ * GEMM_TRANS_A and GEMM_TRANS_B, and prints the kernel times.
+ * The last run takes both transposed, its result is left for the validation.
+ * \param timing Set to the timing of the last run
+ */
+cl_int run_transposed(struct gpu_context* context, struct input_data* data,
+                      struct op_timing* timing)
 {
-    assert(error != 0);
-    assert(kernel_name != 0);
-    assert(sources_list != 0);
+    static unsigned const flags[] = {GEMM_TRANS_A, GEMM_TRANS_B, GEMM_TRANS_A | GEMM_TRANS_B};
 
-    *error = 0;
+    cl_int error_code = 0;
+    float* const a_t = transpose_matrix(data->in_A, data->n, data->m);
+    float* const b_t = transpose_matrix(data->in_B, data->m, data->k);
+    if (!a_t || !b_t)
+    {
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
 
-    struct gpu_context* const context = calloc(1, sizeof(struct gpu_context));
+    for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); ++i)
+    {
+        /// Stale result of the previous runs must not pass the validation
+        memset(data->out_C, 0, data->out_C_size * sizeof(float));
+        error_code = run_gemm_transposed(
+            context, flags[i], flags[i] & GEMM_TRANS_A ? a_t : data->in_A,
+            flags[i] & GEMM_TRANS_B ? b_t : data->in_B, data->out_C,
+            data->n, data->m, data->k, timing
+        );
+        CHECK_ERR("transposed gemm failed", error_code, free_arrays);
 
-    context->n = n;
-    context->m = m;
-    context->k = k;
+        printf(
+            "%s: %.4f ms kernel\n",
+            flags[i] == GEMM_TRANS_A ? "A^T * B"
+                : flags[i] == GEMM_TRANS_B ? "A * B^T" : "A^T * B^T",
+            timing->kernel_ns / 1e6
+        );
+    }
 
-    *error = select_device(context);
-    if (*error)
-        goto return_error;
+free_arrays:
+    free(a_t);
+    free(b_t);
+    return error_code;
+}
 
-    *error = load_program(context, sources_list, src_list_sz, kernel_name);
-    if (*error)
-        goto return_error;
+int main(int argc, char** argv)
+{
+    /// Any n, m, k: shapes not divisible by the tiles take guarded edges.
+    size_t const n = 2048;
+    size_t const m = 512;
+    size_t const k = 1024;
 
-    *error = setup_kernel(context, kernel_name);
-    if (*error)
-        goto return_error;
+    /// "--autotune" sweeps the gemm kernels' tilings first, the winner is used
+    /// by run_gemm in this and all later runs on the device.
+    /// "--kernel gemm4|gemm4db|gemm5|gemm6" runs the kernel's tuned config
+    /// instead of the fastest one.
+    /// "--zero-copy" keeps the matrices in host-mapped device buffers and
+    /// compares the transfer time with the copying path.
+    /// "--pipelined" overlaps panels' transfers with computation and compares
+    /// the end-to-end time with the serial path.
+    /// "--out-of-core" streams blocks through a quarter of the memory the
+    /// in-core path takes, as if the matrices didn't fit the device.
+    /// "--multi-device" splits the rows across all devices of all platforms.
+    /// "--fission" splits them across NUMA sub-devices of the selected device,
+    /// each part of A and C first-touched from the CPUs of its node, see
+    /// first_touch_rows.
+    /// "--co-exec" computes a share of the rows on the host threads meanwhile.
+    /// "--transposed" multiplies transposed copies of the inputs as they are stored.
+    /// "--freivalds" validates with random vectors instead of the reference gemm.
+    /// "--freivalds-self-test" checks that Freivalds' check by blocks of columns
+    /// catches a single wrong element of the validated result.
+    /// "--specialize" builds the gemm kernels for the exact shape of each call.
+    /// "--pool-limit MIB" bounds the device memory the buffer pool holds and
+    /// checks that the pool drops free buffers and refuses requests at a limit.
+    bool autotune = false;
+    bool zero_copy = false;
+    bool pipelined = false;
+    bool out_of_core = false;
+    bool multi_device = false;
+    bool fission = false;
+    bool co_exec = false;
+    bool freivalds = false;
+    bool freivalds_self_test = false;
+    bool transposed = false;
+    bool kernel_set = false;
+    bool specialize = false;
+    size_t pool_limit = 0;
+    enum gemm_kernel kernel = GEMM_KERNEL_TILED;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--autotune"))
+            autotune = true;
+        else if (!strcmp(argv[i], "--kernel") && i + 1 < argc
+                 && parse_gemm_kernel(argv[i + 1], &kernel))
+        {
+            kernel_set = true;
+            ++i;
+        }
+        else if (!strcmp(argv[i], "--zero-copy"))
+            zero_copy = true;
+        else if (!strcmp(argv[i], "--pipelined"))
+            pipelined = true;
+        else if (!strcmp(argv[i], "--out-of-core"))
+            out_of_core = true;
+        else if (!strcmp(argv[i], "--multi-device"))
+            multi_device = true;
+        else if (!strcmp(argv[i], "--fission"))
+            fission = true;
+        else if (!strcmp(argv[i], "--co-exec"))
+            co_exec = true;
+        else if (!strcmp(argv[i], "--freivalds"))
+            freivalds = true;
+        else if (!strcmp(argv[i], "--freivalds-self-test"))
+            freivalds_self_test = true;
+        else if (!strcmp(argv[i], "--transposed"))
+            transposed = true;
+        else if (!strcmp(argv[i], "--specialize"))
+            specialize = true;
+        else if (!strcmp(argv[i], "--pool-limit") && i + 1 < argc
+                 && (pool_limit = strtoul(argv[i + 1], NULL, 10) << 20))
+            ++i;
+        else
+        {
+            fprintf(
+                stderr,
+                "Usage: %s [--autotune] [--kernel gemm4|gemm4db|gemm5|gemm6] "
+                "[--zero-copy] [--pipelined] [--out-of-core] [--multi-device] "
+                "[--fission] [--co-exec] [--transposed] [--freivalds] "
+                "[--freivalds-self-test] [--specialize] [--pool-limit MIB]\n"
+                "--fission first-touches sub-device i's rows from the CPUs of\n"
+                "NUMA node i in /sys/devices/system/node, taking the runtime's\n"
+                "NUMA sub-devices to be in node order. OMP_PLACES is not needed.\n",
+                argv[0]
+            );
+            return -1;
+        }
+    }
 
-    return context;
+    cl_int error_code;
 
-return_error:
-    release_gpu_context(context);
-    return NULL;
-}
+    struct gpu_context* context = setup_gpu_context(NULL, 0, &error_code);
+    CHECK_AND_RET_ERR("startup failed", error_code);
+    set_buffer_pool_limit(&context->buffer_pool, pool_limit);
+    context->specialize_shapes = specialize;
 
-struct input_data* generate_input(size_t n, size_t m, size_t k)
-{
-    struct input_data* data = calloc(1, sizeof(struct input_data));
+    if (autotune)
+    {
+        error_code = autotune_gemm(context, n, m, k, NULL);
+        if (error_code)
+        {
+            release_gpu_context(context);
+            return -1;
+        }
+    }
 
-    data->n = n;
-    data->m = m;
-    data->k = k;
+    cl_ulong phase_start_ns = host_time_ns();
+    struct input_data* data = generate_input(context, n, m, k, zero_copy);
+    trace_host_phase("generate_input", NULL, phase_start_ns, host_time_ns());
+    if (!data)
+    {
+        fprintf(stderr, "Input generation failed!\n");
+        release_gpu_context(context);
+        return -1;
+    }
 
-    data->in_A_size = n * m;
-    data->in_B_size = m * k;
-    data->out_C_size = n * k;
+    struct gemm_config const config = kernel_set
+        ? lookup_gemm_kernel_config(context, kernel, n, m, k)
+        : lookup_gemm_config(context, n, m, k);
 
-    data->in_A = calloc(data->in_A_size, sizeof(float));
-    data->in_B = calloc(data->in_B_size, sizeof(float));
-    data->out_C = calloc(data->out_C_size, sizeof(float));
+    /// Timing of the tuned config, the modes below report their own runs
+    struct op_timing timing;
+    error_code = run_gemm_with_config(
+        context, &config, data->in_A, data->in_B, data->out_C, n, m, k, &timing
+    );
+    CHECK_ERR("gemm failed", error_code, return_error);
 
-    if (!data->in_A || !data->in_B || !data->out_C)
-        goto error_return;
+    if (zero_copy)
+    {
+        struct op_timing zero_copy_timing;
+        error_code = run_gemm_zero_copy(
+            context, &data->buffers[0], &data->buffers[1], &data->buffers[2],
+            n, m, k, &zero_copy_timing
+        );
+        CHECK_ERR("zero-copy gemm failed", error_code, return_error);
+        update_mappings(data);
 
-    fill_array(data->in_A, data->in_A_size);
-    fill_array(data->in_B, data->in_B_size);
+        printf(
+            "transfers: copy %.4f ms, zero-copy %.4f ms, saved %.4f ms\n",
+            timing.transfer_ns / 1e6, zero_copy_timing.transfer_ns / 1e6,
+            ((double) timing.transfer_ns - (double) zero_copy_timing.transfer_ns) / 1e6
+        );
+    }
 
-    return data;
+    if (pipelined)
+    {
+        struct op_timing pipelined_timing;
+        error_code = run_gemm_pipelined(
+            context, data->in_A, data->in_B, data->out_C, n, m, k, 0, &pipelined_timing
+        );
+        CHECK_ERR("pipelined gemm failed", error_code, return_error);
 
-error_return:
-    release_input_data(data);
-    return NULL;
-}
+        printf(
+            "end-to-end: serial %.4f ms, pipelined %.4f ms "
+            "(kernels %.4f ms, transfers %.4f ms)\n",
+            timing.total_ns / 1e6, pipelined_timing.total_ns / 1e6,
+            pipelined_timing.kernel_ns / 1e6, pipelined_timing.transfer_ns / 1e6
+        );
+    }
 
-void validate_result(struct input_data* data)
-{
-    float* const gold = (float*) calloc(data->out_C_size, sizeof(float));
-    fprintf(stderr, "Validating results...\n");
-    #pragma omp parallel for
-    for (size_t i = 0; i < data->n; ++i)
-        for (size_t j = 0; j < data->m; ++j)
-            for (size_t l = 0; l < data->k; ++l)
-                gold[i * data->k + l] += data->in_A[i * data->m + j]
-                                         * data->in_B[j * data->k + l];
+    if (out_of_core)
+    {
+        struct op_timing out_of_core_timing;
+        size_t const limit = (data->in_A_size + data->in_B_size + data->out_C_size)
+                             * sizeof(float) / 4;
+
+        /// Stale result of the previous runs must not pass the validation
+        memset(data->out_C, 0, data->out_C_size * sizeof(float));
+        error_code = run_gemm_out_of_core(
+            context, data->in_A, data->in_B, data->out_C, n, m, k, limit,
+            &out_of_core_timing
+        );
+        CHECK_ERR("out-of-core gemm failed", error_code, return_error);
 
-    for (size_t i = 0; i < data->n; ++i)
-        for (size_t l = 0; l < data->k; ++l)
-        {
-            float delta = gold[i * data->k + l] - data->out_C[i * data->k + l];
-            float abs_delta = fabsf(delta);
-            assert(abs_delta < 0.05);
-        }
+        printf(
+            "end-to-end: in-core %.4f ms, out-of-core in %.2f MiB %.4f ms "
+            "(kernels %.4f ms, transfers %.4f ms)\n",
+            timing.total_ns / 1e6, limit / 1048576.0, out_of_core_timing.total_ns / 1e6,
+            out_of_core_timing.kernel_ns / 1e6, out_of_core_timing.transfer_ns / 1e6
+        );
+    }
 
-    free(gold);
-}
+    if (multi_device)
+    {
+        struct op_timing multi_timing;
+        error_code = run_on_all_devices(data, &multi_timing);
+        CHECK_ERR("multi-device gemm failed", error_code, return_error);
 
-int main()
-{
-    /// n, m, k are expected to be divisible by tile_size.
-    size_t const n = 2048;
-    size_t const m = 512;
-    size_t const k = 1024;
+        printf(
+            "end-to-end: single device %.4f ms, all devices %.4f ms\n",
+            timing.total_ns / 1e6, multi_timing.total_ns / 1e6
+        );
+    }
 
-    char const* const   kernel_name = "gemm4";
-    char const* const   sources_list[] =
+    if (fission)
     {
-        "const.h",
-        "gemm4.cl"
-    };
+        struct op_timing fission_timing;
+        error_code = run_on_sub_devices(context, data, &fission_timing);
+        CHECK_ERR("partitioned gemm failed", error_code, return_error);
+
+        printf(
+            "end-to-end: whole device %.4f ms, sub-devices %.4f ms "
+            "(kernels %.4f ms on the longest one)\n",
+            timing.total_ns / 1e6, fission_timing.total_ns / 1e6,
+            fission_timing.kernel_ns / 1e6
+        );
+    }
 
-    int exit_code = 0;
-    cl_int error_code;
+    if (co_exec)
+    {
+        struct op_timing co_exec_timing;
+        error_code = run_co_executed(context, data, &co_exec_timing);
+        CHECK_ERR("co-executed gemm failed", error_code, return_error);
 
-    struct gpu_context* context = setup_gpu_context(
-        n, m, k, sources_list, sizeof(sources_list) / sizeof(char const*),
-        kernel_name, &error_code
-    );
-    CHECK_AND_RET_ERR("startup failed", error_code);
+        printf(
+            "end-to-end: device only %.4f ms, device and host %.4f ms\n",
+            timing.total_ns / 1e6, co_exec_timing.total_ns / 1e6
+        );
+    }
 
-    struct input_data* data = generate_input(n, m, k);
-    if (!data)
+    if (transposed)
     {
-        fprintf(stderr, "Input generation failed!\n");
-        return -1;
+        struct op_timing transposed_timing;
+        error_code = run_transposed(context, data, &transposed_timing);
+        CHECK_ERR("transposed gemm failed", error_code, return_error);
+
+        printf("A * B: %.4f ms kernel\n", timing.kernel_ns / 1e6);
     }
 
-    error_code = clEnqueueWriteBuffer(
-        context->command_queue, context->fst_mattr_buff_in, true, 0,
-        n * m * sizeof(float), data->in_A, 0, 0, 0
-    );
-    CHECK_ERR("clEnqueueWriteBuffer error", error_code, return_error);
-    error_code = clEnqueueWriteBuffer(
-        context->command_queue, context->sec_mattr_buff_in, true, 0,
-        m * k * sizeof(float), data->in_B, 0, 0, 0
-    );
-    CHECK_ERR("clEnqueueWriteBuffer error", error_code, return_error);
-
-    size_t work_size[] = {k, n / ELEMS_PER_THREAD};
-    size_t local_group_size[] = {TILE_SIZE, TILE_SIZE / ELEMS_PER_THREAD};
-    cl_event run_event;
-    error_code = clEnqueueNDRangeKernel (
-            context->command_queue, context->kernel, 2, NULL,
-            work_size, local_group_size, 0, 0, &run_event
-    );
-    CHECK_ERR("Error enquing kernel", error_code, return_error);
-    clEnqueueReadBuffer(
-        context->command_queue, context->thr_mattr_buff_out, true, 0,
-        n * k * sizeof(float), data->out_C, 0, 0, 0
-    );
+    phase_start_ns = host_time_ns();
+    if (freivalds)
+        validate_result_freivalds(data);
+    else
+        validate_result(data);
+    trace_host_phase("validate_result", NULL, phase_start_ns, host_time_ns());
 
-    validate_result(data);
+    if (freivalds_self_test)
+        check_freivalds_sensitivity(data);
 
-    cl_ulong t_start = 0, t_end = 0;
-    clGetEventProfilingInfo(run_event, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, 0);
-    clGetEventProfilingInfo(run_event, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, 0);
+    if (pool_limit)
+        check_buffer_pool_limit(&context->buffer_pool);
 
-    long double elapsed_time = t_end - t_start;
+    long double elapsed_time = timing.kernel_ns;
     long double ops = (long double) n * m * k * 2;
 
+    printf(
+        "%s, tile %zu, elems per thread %zu: ", gemm_kernel_name(config.kernel),
+        config.tile_size, config.elems_per_thread
+    );
     printf("%.4Lf ms elapsed and ", elapsed_time / 1e6);
     printf("achieved %.4Lf TFlops\n", ops / elapsed_time / 1e3);
+    print_buffer_pool_stats(&context->buffer_pool, stderr);
 
 return_error:
+    release_input_data(context, data);
     release_gpu_context(context);
-    release_input_data(data);
-    return exit_code;
+    return error_code ? -1 : 0;
 }
@@ -1,47 +1,227 @@
-__kernel void gemm4(__global float const* const a,      /** a: matrix [N x M] */
-                    __global float const* const b,      /** b: matrix [M x K] */
-                    __global float* const c,            /** c: matrix [N x K] */
+/// Element of A at the row and col, zero outside the matrix with -DGEMM_EDGES.
+/// Dimensions divisible by the tile fold their checks away when the shape is
+/// fixed at build time. With -DGEMM_TRANS_A a holds A^T, matrix [M x N].
+float load_a(__global float const* a, uint const row, uint const col,
+             uint const dim_n, uint const dim_m)
+{
+#ifdef GEMM_EDGES
+    if ((dim_n % TILE_SIZE && row >= dim_n) || (dim_m % TILE_SIZE && col >= dim_m))
+        return 0;
+#endif
+#ifdef GEMM_TRANS_A
+    return a[col * dim_n + row];
+#else
+    return a[row * dim_m + col];
+#endif
+}
+
+/// Element of B at the row and col, see \ref load_a.
+/// With -DGEMM_TRANS_B b holds B^T, matrix [K x M].
+float load_b(__global float const* b, uint const row, uint const col,
+             uint const dim_m, uint const dim_k)
+{
+#ifdef GEMM_EDGES
+    if ((dim_m % TILE_SIZE && row >= dim_m) || (dim_k % TILE_SIZE && col >= dim_k))
+        return 0;
+#endif
+#ifdef GEMM_TRANS_B
+    return b[col * dim_m + row];
+#else
+    return b[row * dim_k + col];
+#endif
+}
+
+/// Tile elements a work item loads: \p shift-th of its rows in its column,
+/// or the transposed position for transposed operands. Neighbouring work
+/// items read neighbouring elements of a stored row either way.
+#ifdef GEMM_TRANS_A
+#define A_TILE_ROW(shift)   tile_j
+#define A_TILE_COL(shift)   (tile_i + (shift))
+#define A_SUB_PAD           1
+#else
+#define A_TILE_ROW(shift)   (tile_i + (shift))
+#define A_TILE_COL(shift)   tile_j
+#define A_SUB_PAD           0
+#endif
+
+#ifdef GEMM_TRANS_B
+#define B_TILE_ROW(shift)   tile_j
+#define B_TILE_COL(shift)   (tile_i + (shift))
+#define B_SUB_PAD           1
+#else
+#define B_TILE_ROW(shift)   (tile_i + (shift))
+#define B_TILE_COL(shift)   tile_j
+#define B_SUB_PAD           0
+#endif
+
+__kernel void gemm4(__global float const* a,            /** a: matrix [N x M] */
+                    __global float const* b,            /** b: matrix [M x K] */
+                    __global float* c,                  /** c: matrix [N x K] */
                     uint const n,                       /** n = N */
                     uint const m,                       /** m = M */
                     uint const k                        /** k = K */)
 {
+    /// Shape may be fixed at build time with -DGEMM_M=... -DGEMM_K=...,
+    /// then the index math below is folded by the compiler
+#ifdef GEMM_M
+    uint const dim_m        = GEMM_M;
+#else
+    uint const dim_m        = m;
+#endif
+#ifdef GEMM_K
+    uint const dim_k        = GEMM_K;
+#else
+    uint const dim_k        = k;
+#endif
+
+#ifdef GEMM_N
+    uint const dim_n        = GEMM_N;
+#else
+    uint const dim_n        = n;
+#endif
+
+#ifdef GEMM_BATCHED
+    /// -DGEMM_BATCHED multiplies a batch of matrices stored one after another,
+    /// the third dimension is the index in the batch
+    size_t const batch      = get_global_id(2);
+    a += batch * dim_n * dim_m;
+    b += batch * dim_m * dim_k;
+    c += batch * dim_n * dim_k;
+#endif
+
     uint const global_i     = get_global_id(1) * ELEMS_PER_THREAD;      //!< First row id in result matrix
     uint const global_l     = get_global_id(0);                         //!< Col id in result matrix
     uint const tile_i       = get_local_id(1) * ELEMS_PER_THREAD;       //!< First row id in the current tile
     uint const tile_j       = get_local_id(0);                          //!< Col id in the current tile
-
-    local float A_sub[TILE_SIZE][TILE_SIZE];    //!< Local buffer for subtiles from the first input matrix
-    local float B_sub[TILE_SIZE][TILE_SIZE];    //!< Local buffer for subtiles from the second input matrix
+    uint const group_i      = get_group_id(1) * TILE_SIZE;              //!< First row of the group's tile
+    uint const group_l      = get_group_id(0) * TILE_SIZE;              //!< First col of the group's tile
 
     float local_sum[ELEMS_PER_THREAD];
+    #pragma unroll
     for (uint i = 0; i < ELEMS_PER_THREAD; ++i)
         local_sum[i] = 0;
 
-    uint const tile_cnt     = m / TILE_SIZE;
+    /// -DGEMM_EDGES takes any shape: the range is rounded up to whole tiles,
+    /// elements outside the matrices are loaded as zeros and not stored.
+#ifdef GEMM_EDGES
+    uint const tile_cnt     = (dim_m + TILE_SIZE - 1) / TILE_SIZE;
+#else
+    uint const tile_cnt     = dim_m / TILE_SIZE;
+#endif
+
+#ifdef GEMM_DOUBLE_BUFFER
+    /// -DGEMM_DOUBLE_BUFFER pipelines the tiles through two local stages:
+    /// the next tile is read from global memory into registers while the
+    /// current stage is multiplied, then stored into the other stage.
+    /// A single barrier per tile separates the stages' reads and writes.
+    local float A_sub[2][TILE_SIZE][TILE_SIZE + A_SUB_PAD];     //!< Stages of subtiles from the first input matrix
+    local float B_sub[2][TILE_SIZE][TILE_SIZE + B_SUB_PAD];     //!< Stages of subtiles from the second input matrix
+
+    float a_next[ELEMS_PER_THREAD];
+    float b_next[ELEMS_PER_THREAD];
+
+    #pragma unroll
+    for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+    {
+        A_sub[0][A_TILE_ROW(shift)][A_TILE_COL(shift)]
+            = load_a(a, group_i + A_TILE_ROW(shift), A_TILE_COL(shift), dim_n, dim_m);
+        B_sub[0][B_TILE_ROW(shift)][B_TILE_COL(shift)]
+            = load_b(b, B_TILE_ROW(shift), group_l + B_TILE_COL(shift), dim_m, dim_k);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
     for (uint tile_id = 0; tile_id < tile_cnt; ++tile_id)
     {
+        uint const stage = tile_id & 1;
+        bool const has_next = tile_id + 1 < tile_cnt;
+
+        if (has_next)
+        {
+            uint const next_offset = (tile_id + 1) * TILE_SIZE;
+            #pragma unroll
+            for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+            {
+                a_next[shift] = load_a(
+                    a, group_i + A_TILE_ROW(shift), next_offset + A_TILE_COL(shift), dim_n, dim_m
+                );
+                b_next[shift] = load_b(
+                    b, next_offset + B_TILE_ROW(shift), group_l + B_TILE_COL(shift), dim_m, dim_k
+                );
+            }
+        }
+
+        #pragma unroll
         for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
         {
-            uint const tiled_row = tile_id * TILE_SIZE + tile_i + shift;    //!< Global row id for second matrix
-            uint const tiled_col = tile_id * TILE_SIZE + tile_j;            //!< Global col id for first matrix
+            #pragma unroll
+            for (uint t = 0; t < TILE_SIZE; ++t)
+                local_sum[shift] += A_sub[stage][tile_i + shift][t] * B_sub[stage][t][tile_j];
+        }
+
+        /// The other stage was last read before the previous barrier
+        if (has_next)
+        {
+            #pragma unroll
+            for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+            {
+                A_sub[stage ^ 1][A_TILE_ROW(shift)][A_TILE_COL(shift)] = a_next[shift];
+                B_sub[stage ^ 1][B_TILE_ROW(shift)][B_TILE_COL(shift)] = b_next[shift];
+            }
+        }
+
+        /// Awaiting local group to fill the next stage and to finish reading
+        /// the current one, which is overwritten by the next iteration
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+#else
+    local float A_sub[TILE_SIZE][TILE_SIZE + A_SUB_PAD];    //!< Local buffer for subtiles from the first input matrix
+    local float B_sub[TILE_SIZE][TILE_SIZE + B_SUB_PAD];    //!< Local buffer for subtiles from the second input matrix
 
+    for (uint tile_id = 0; tile_id < tile_cnt; ++tile_id)
+    {
+        uint const tile_offset = tile_id * TILE_SIZE;   //!< First col of A and row of B in the tile
+
+        #pragma unroll
+        for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+        {
             /// Loading them into the current tile buffer
-            A_sub[tile_i + shift][tile_j] = a[(global_i + shift) * m + tiled_col];
-            B_sub[tile_i + shift][tile_j] = b[tiled_row * k + global_l];
+            A_sub[A_TILE_ROW(shift)][A_TILE_COL(shift)]
+                = load_a(a, group_i + A_TILE_ROW(shift), tile_offset + A_TILE_COL(shift), dim_n, dim_m);
+            B_sub[B_TILE_ROW(shift)][B_TILE_COL(shift)]
+                = load_b(b, tile_offset + B_TILE_ROW(shift), group_l + B_TILE_COL(shift), dim_m, dim_k);
         }
 
         /// Awaiting local group to fill the buffer
         barrier(CLK_LOCAL_MEM_FENCE);
 
+        #pragma unroll
         for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+        {
+            #pragma unroll
             for (uint t = 0; t < TILE_SIZE; ++t)
                 local_sum[shift] += A_sub[tile_i + shift][t] * B_sub[t][tile_j];
+        }
 
         /// Awaiting local group, not to start loading in the buffer
         /// while it is still in use in prev. loop
         barrier(CLK_LOCAL_MEM_FENCE);
     }
+#endif
 
+    /// -DGEMM_ACCUMULATE adds the product to c, blocked drivers sum partial
+    /// products over the M dimension this way
+    #pragma unroll
     for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
-        c[(global_i + shift) * k + global_l] = local_sum[shift];
+    {
+#ifdef GEMM_EDGES
+        if ((dim_n % TILE_SIZE && global_i + shift >= dim_n)
+            || (dim_k % TILE_SIZE && global_l >= dim_k))
+            continue;
+#endif
+#ifdef GEMM_ACCUMULATE
+        c[(global_i + shift) * dim_k + global_l] += local_sum[shift];
+#else
+        c[(global_i + shift) * dim_k + global_l] = local_sum[shift];
+#endif
+    }
 }
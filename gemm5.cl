@@ -0,0 +1,139 @@
+/// Side of the work group: each work item computes ELEMS_PER_THREAD x ELEMS_PER_THREAD results
+#define GROUP_SIDE (TILE_SIZE / ELEMS_PER_THREAD)
+
+__kernel void gemm5(__global float const* a,            /** a: matrix [N x M] */
+                    __global float const* b,            /** b: matrix [M x K] */
+                    __global float* c,                  /** c: matrix [N x K] */
+                    uint const n,                       /** n = N */
+                    uint const m,                       /** m = M */
+                    uint const k                        /** k = K */)
+{
+    /// Shape may be fixed at build time with -DGEMM_N=... -DGEMM_M=... -DGEMM_K=...
+#ifdef GEMM_M
+    uint const dim_m        = GEMM_M;
+#else
+    uint const dim_m        = m;
+#endif
+#ifdef GEMM_K
+    uint const dim_k        = GEMM_K;
+#else
+    uint const dim_k        = k;
+#endif
+#ifdef GEMM_N
+    uint const dim_n        = GEMM_N;
+#else
+    uint const dim_n        = n;
+#endif
+
+#ifdef GEMM_BATCHED
+    size_t const batch      = get_global_id(2);
+    a += batch * dim_n * dim_m;
+    b += batch * dim_m * dim_k;
+    c += batch * dim_n * dim_k;
+#endif
+
+    uint const local_row    = get_local_id(1);                          //!< First row id in the current tile
+    uint const local_col    = get_local_id(0);                          //!< First col id in the current tile
+    uint const local_id     = local_row * GROUP_SIDE + local_col;
+    uint const tile_row     = get_group_id(1) * TILE_SIZE;              //!< First row of the tile in result matrix
+    uint const tile_col     = get_group_id(0) * TILE_SIZE;              //!< First col of the tile in result matrix
+
+    /// A block is stored transposed, so that both blocks are read along the
+    /// tile's side. Its rows are padded not to hit a single bank on stores.
+    local float A_sub[GEMM5_K_BLOCK][TILE_SIZE + 1];    //!< K_BLOCK columns of the tile's rows of A
+    local float B_sub[GEMM5_K_BLOCK][TILE_SIZE];        //!< K_BLOCK rows of the tile's columns of B
+
+    /// Results of the work item are rows local_row + r * GROUP_SIDE,
+    /// columns local_col + s * GROUP_SIDE of the tile
+    float local_sum[ELEMS_PER_THREAD][ELEMS_PER_THREAD];
+    float a_reg[ELEMS_PER_THREAD];
+    float b_reg[ELEMS_PER_THREAD];
+
+    #pragma unroll
+    for (uint r = 0; r < ELEMS_PER_THREAD; ++r)
+    {
+        #pragma unroll
+        for (uint s = 0; s < ELEMS_PER_THREAD; ++s)
+            local_sum[r][s] = 0;
+    }
+
+    /// -DGEMM_EDGES takes any shape, as in gemm4
+#ifdef GEMM_EDGES
+    uint const block_cnt    = (dim_m + GEMM5_K_BLOCK - 1) / GEMM5_K_BLOCK;
+#else
+    uint const block_cnt    = dim_m / GEMM5_K_BLOCK;
+#endif
+    for (uint block_id = 0; block_id < block_cnt; ++block_id)
+    {
+        uint const block_k = block_id * GEMM5_K_BLOCK;
+
+        /// Whole group loads both blocks, neighbouring items read neighbouring
+        /// elements of a row
+        #pragma unroll
+        for (uint i = local_id; i < TILE_SIZE * GEMM5_K_BLOCK; i += GROUP_SIDE * GROUP_SIDE)
+        {
+            uint const a_row = i / GEMM5_K_BLOCK;
+            uint const a_col = i % GEMM5_K_BLOCK;
+            uint const b_row = i / TILE_SIZE;
+            uint const b_col = i % TILE_SIZE;
+#ifdef GEMM_EDGES
+            bool const a_inside = (dim_n % TILE_SIZE == 0 || tile_row + a_row < dim_n)
+                                  && (dim_m % GEMM5_K_BLOCK == 0 || block_k + a_col < dim_m);
+            bool const b_inside = (dim_m % GEMM5_K_BLOCK == 0 || block_k + b_row < dim_m)
+                                  && (dim_k % TILE_SIZE == 0 || tile_col + b_col < dim_k);
+            A_sub[a_col][a_row] = a_inside ? a[(tile_row + a_row) * dim_m + block_k + a_col] : 0;
+            B_sub[b_row][b_col] = b_inside ? b[(block_k + b_row) * dim_k + tile_col + b_col] : 0;
+#else
+            A_sub[a_col][a_row] = a[(tile_row + a_row) * dim_m + block_k + a_col];
+            B_sub[b_row][b_col] = b[(block_k + b_row) * dim_k + tile_col + b_col];
+#endif
+        }
+
+        /// Awaiting local group to fill the blocks
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        /// A column of A and a row of B in registers give ELEMS_PER_THREAD^2
+        /// products for 2 * ELEMS_PER_THREAD local memory reads
+        #pragma unroll
+        for (uint t = 0; t < GEMM5_K_BLOCK; ++t)
+        {
+            #pragma unroll
+            for (uint r = 0; r < ELEMS_PER_THREAD; ++r)
+                a_reg[r] = A_sub[t][local_row + r * GROUP_SIDE];
+            #pragma unroll
+            for (uint s = 0; s < ELEMS_PER_THREAD; ++s)
+                b_reg[s] = B_sub[t][local_col + s * GROUP_SIDE];
+
+            #pragma unroll
+            for (uint r = 0; r < ELEMS_PER_THREAD; ++r)
+            {
+                #pragma unroll
+                for (uint s = 0; s < ELEMS_PER_THREAD; ++s)
+                    local_sum[r][s] += a_reg[r] * b_reg[s];
+            }
+        }
+
+        /// Awaiting local group, not to overwrite the blocks still in use
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    #pragma unroll
+    for (uint r = 0; r < ELEMS_PER_THREAD; ++r)
+    {
+        uint const row = tile_row + local_row + r * GROUP_SIDE;
+        #pragma unroll
+        for (uint s = 0; s < ELEMS_PER_THREAD; ++s)
+        {
+            uint const col = tile_col + local_col + s * GROUP_SIDE;
+#ifdef GEMM_EDGES
+            if ((dim_n % TILE_SIZE && row >= dim_n) || (dim_k % TILE_SIZE && col >= dim_k))
+                continue;
+#endif
+#ifdef GEMM_ACCUMULATE
+            c[row * dim_k + col] += local_sum[r][s];
+#else
+            c[row * dim_k + col] = local_sum[r][s];
+#endif
+        }
+    }
+}
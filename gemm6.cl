@@ -0,0 +1,129 @@
+/// gemm4 with explicit vectors: VECTOR_WIDTH elements along M are loaded
+/// with vloadn and multiplied at once, -DVECTOR_WIDTH=1, 2, 4, 8 or 16
+#ifndef VECTOR_WIDTH
+#define VECTOR_WIDTH 4
+#endif
+
+#define CONCAT_(a, b) a##b
+#define CONCAT(a, b) CONCAT_(a, b)
+
+#if VECTOR_WIDTH == 1
+typedef float floatv;
+#define vloadv(offset, p) ((p)[offset])
+#define sumv(v) (v)
+#else
+typedef CONCAT(float, VECTOR_WIDTH) floatv;
+#define vloadv CONCAT(vload, VECTOR_WIDTH)
+#define sumv CONCAT(sum, VECTOR_WIDTH)
+#endif
+
+/// Horizontal sums of the vector types
+float sum2(float2 v) { return v.x + v.y; }
+float sum4(float4 v) { return sum2(v.lo + v.hi); }
+float sum8(float8 v) { return sum4(v.lo + v.hi); }
+float sum16(float16 v) { return sum8(v.lo + v.hi); }
+
+__kernel void gemm6(__global float const* a,            /** a: matrix [N x M] */
+                    __global float const* b,            /** b: matrix [M x K] */
+                    __global float* c,                  /** c: matrix [N x K] */
+                    uint const n,                       /** n = N */
+                    uint const m,                       /** m = M */
+                    uint const k                        /** k = K */)
+{
+    /// Shape may be fixed at build time with -DGEMM_N=... -DGEMM_M=... -DGEMM_K=...
+#ifdef GEMM_M
+    uint const dim_m        = GEMM_M;
+#else
+    uint const dim_m        = m;
+#endif
+#ifdef GEMM_K
+    uint const dim_k        = GEMM_K;
+#else
+    uint const dim_k        = k;
+#endif
+#ifdef GEMM_N
+    uint const dim_n        = GEMM_N;
+#else
+    uint const dim_n        = n;
+#endif
+
+#ifdef GEMM_BATCHED
+    size_t const batch      = get_global_id(2);
+    a += batch * dim_n * dim_m;
+    b += batch * dim_m * dim_k;
+    c += batch * dim_n * dim_k;
+#endif
+
+    uint const global_i     = get_global_id(1) * ELEMS_PER_THREAD;      //!< First row id in result matrix
+    uint const global_l     = get_global_id(0);                         //!< Col id in result matrix
+    uint const tile_i       = get_local_id(1) * ELEMS_PER_THREAD;       //!< First row id in the current tile
+    uint const tile_j       = get_local_id(0);                          //!< Col id in the current tile
+
+    /// B tile is stored transposed, so that both operands of a product are
+    /// contiguous along M. Its rows are padded not to hit a single bank on stores.
+    local float A_sub[TILE_SIZE][TILE_SIZE];        //!< Local buffer for subtiles from the first input matrix
+    local float B_sub[TILE_SIZE][TILE_SIZE + 1];    //!< Local buffer for transposed subtiles from the second one
+
+    floatv local_sum[ELEMS_PER_THREAD];
+    #pragma unroll
+    for (uint i = 0; i < ELEMS_PER_THREAD; ++i)
+        local_sum[i] = (floatv) 0;
+
+    /// -DGEMM_EDGES takes any shape, as in gemm4
+#ifdef GEMM_EDGES
+    uint const tile_cnt     = (dim_m + TILE_SIZE - 1) / TILE_SIZE;
+#else
+    uint const tile_cnt     = dim_m / TILE_SIZE;
+#endif
+    for (uint tile_id = 0; tile_id < tile_cnt; ++tile_id)
+    {
+        #pragma unroll
+        for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+        {
+            uint const tiled_row = tile_id * TILE_SIZE + tile_i + shift;    //!< Global row id for second matrix
+            uint const tiled_col = tile_id * TILE_SIZE + tile_j;            //!< Global col id for first matrix
+
+#ifdef GEMM_EDGES
+            bool const a_inside = (dim_n % TILE_SIZE == 0 || global_i + shift < dim_n)
+                                  && (dim_m % TILE_SIZE == 0 || tiled_col < dim_m);
+            bool const b_inside = (dim_m % TILE_SIZE == 0 || tiled_row < dim_m)
+                                  && (dim_k % TILE_SIZE == 0 || global_l < dim_k);
+            A_sub[tile_i + shift][tile_j] = a_inside ? a[(global_i + shift) * dim_m + tiled_col] : 0;
+            B_sub[tile_j][tile_i + shift] = b_inside ? b[tiled_row * dim_k + global_l] : 0;
+#else
+            A_sub[tile_i + shift][tile_j] = a[(global_i + shift) * dim_m + tiled_col];
+            B_sub[tile_j][tile_i + shift] = b[tiled_row * dim_k + global_l];
+#endif
+        }
+
+        /// Awaiting local group to fill the buffer
+        barrier(CLK_LOCAL_MEM_FENCE);
+
+        #pragma unroll
+        for (uint t = 0; t < TILE_SIZE; t += VECTOR_WIDTH)
+        {
+            floatv const b_vec = vloadv(0, &B_sub[tile_j][t]);
+            #pragma unroll
+            for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+                local_sum[shift] = mad(vloadv(0, &A_sub[tile_i + shift][t]), b_vec, local_sum[shift]);
+        }
+
+        /// Awaiting local group, not to overwrite the buffer still in use
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+
+    #pragma unroll
+    for (uint shift = 0; shift < ELEMS_PER_THREAD; ++shift)
+    {
+#ifdef GEMM_EDGES
+        if ((dim_n % TILE_SIZE && global_i + shift >= dim_n)
+            || (dim_k % TILE_SIZE && global_l >= dim_k))
+            continue;
+#endif
+#ifdef GEMM_ACCUMULATE
+        c[(global_i + shift) * dim_k + global_l] += sumv(local_sum[shift]);
+#else
+        c[(global_i + shift) * dim_k + global_l] = sumv(local_sum[shift]);
+#endif
+    }
+}
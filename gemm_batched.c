@@ -0,0 +1,203 @@
+#include <stdbool.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include "clfun.h"
+#include "cpu_gemm.h"
+
+static inline
+void fill_array(float* ptr, size_t cnt)
+{
+    for (size_t i = 0; i < cnt; ++i)
+        ptr[i] = (float) ((double) rand() / (double) (RAND_MAX));
+}
+
+struct input_data
+{
+    size_t n;
+    size_t m;
+    size_t k;
+    size_t batch_size;
+
+    size_t in_A_size; //!< Size in floats = N * M of one matrix
+    size_t in_B_size; //!< Size in floats = M * K of one matrix
+    size_t out_C_size; //!< Size in floats = N * K of one matrix
+
+    float* in_A;
+    float* in_B;
+    float* out_C;
+};
+
+/// Destructor for \ref input_data
+void release_input_data(struct input_data* context)
+{
+    if (!context)
+        return;
+
+    if (context->in_A)
+        free(context->in_A);
+    if (context->in_B)
+        free(context->in_B);
+    if (context->out_C)
+        free(context->out_C);
+    free(context);
+}
+
+/// Generates random batch of \p batch_size multiplies
+struct input_data* generate_input(size_t n, size_t m, size_t k, size_t batch_size)
+{
+    struct input_data* data = calloc(1, sizeof(struct input_data));
+
+    data->n = n;
+    data->m = m;
+    data->k = k;
+    data->batch_size = batch_size;
+
+    data->in_A_size = n * m;
+    data->in_B_size = m * k;
+    data->out_C_size = n * k;
+
+    data->in_A = calloc(data->in_A_size * batch_size, sizeof(float));
+    data->in_B = calloc(data->in_B_size * batch_size, sizeof(float));
+    data->out_C = calloc(data->out_C_size * batch_size, sizeof(float));
+
+    if (!data->in_A || !data->in_B || !data->out_C)
+        goto error_return;
+
+    fill_array(data->in_A, data->in_A_size * batch_size);
+    fill_array(data->in_B, data->in_B_size * batch_size);
+
+    return data;
+
+error_return:
+    release_input_data(data);
+    return NULL;
+}
+
+/// Checks every matrix of the batch against \ref cpu_gemm
+void validate_result(struct input_data* data)
+{
+    fprintf(stderr, "Validating results...\n");
+
+    float* const gold = malloc(data->out_C_size * sizeof(float));
+    assert(gold);
+
+    cl_ulong total_ns = 0;
+    for (size_t b = 0; b < data->batch_size; ++b)
+    {
+        float const* const a = data->in_A + b * data->in_A_size;
+        float const* const bm = data->in_B + b * data->in_B_size;
+        float const* const c = data->out_C + b * data->out_C_size;
+
+        cl_ulong elapsed_ns = 0;
+        cl_int const result = cpu_gemm(
+            a, bm, gold, data->n, data->m, data->k, &elapsed_ns
+        );
+        assert(!result);
+        total_ns += elapsed_ns;
+
+        #pragma omp parallel for
+        for (size_t i = 0; i < data->n; ++i)
+            for (size_t l = 0; l < data->k; ++l)
+                assert(fabsf(gold[i * data->k + l] - c[i * data->k + l]) < 0.05);
+    }
+
+    printf(
+        "cpu reference: %.4f ms, %.2f GFlops\n", total_ns / 1e6,
+        2.0 * data->n * data->m * data->k * data->batch_size / total_ns
+    );
+    free(gold);
+}
+
+/// Prints time, matrices per second and TFlops of the batch
+static
+void print_throughput(char const* intro, struct input_data const* data,
+                      struct op_timing const* timing)
+{
+    long double const ops = (long double) data->n * data->m * data->k * 2
+                            * data->batch_size;
+    printf(
+        "%s: %.4f ms kernels, %.4f ms end-to-end, %.1Lf matrices/s, "
+        "%.4Lf TFlops\n",
+        intro, timing->kernel_ns / 1e6, timing->total_ns / 1e6,
+        (long double) data->batch_size / timing->total_ns * 1e9,
+        ops / timing->kernel_ns / 1e3
+    );
+}
+
+int main(int argc, char** argv)
+{
+    /// Square matrices of the size
+    size_t size = 128;
+    size_t batch_size = 256;
+
+    if (argc > 3)
+    {
+        fprintf(stderr, "Usage: %s [size] [batch size]\n", argv[0]);
+        return -1;
+    }
+    if (argc > 1)
+        size = strtoul(argv[1], NULL, 10);
+    if (argc > 2)
+        batch_size = strtoul(argv[2], NULL, 10);
+
+    cl_int error_code;
+
+    struct gpu_context* context = setup_gpu_context(NULL, 0, &error_code);
+    CHECK_AND_RET_ERR("startup failed", error_code);
+
+    cl_ulong phase_start_ns = host_time_ns();
+    struct input_data* data = generate_input(size, size, size, batch_size);
+    trace_host_phase("generate_input", NULL, phase_start_ns, host_time_ns());
+    if (!data)
+    {
+        fprintf(stderr, "Input generation failed!\n");
+        release_gpu_context(context);
+        return -1;
+    }
+
+    /// One launch per matrix, as without the batched API
+    struct op_timing looped = {0, 0, 0};
+    cl_ulong const loop_start_ns = host_time_ns();
+    for (size_t i = 0; i < batch_size; ++i)
+    {
+        struct op_timing timing;
+        error_code = run_gemm(
+            context, data->in_A + i * data->in_A_size,
+            data->in_B + i * data->in_B_size,
+            data->out_C + i * data->out_C_size, size, size, size, &timing
+        );
+        CHECK_ERR("gemm failed", error_code, return_error);
+        looped.kernel_ns += timing.kernel_ns;
+        looped.transfer_ns += timing.transfer_ns;
+    }
+    looped.total_ns = host_time_ns() - loop_start_ns;
+
+    /// Stale result of the loop must not pass the validation
+    memset(data->out_C, 0, data->out_C_size * batch_size * sizeof(float));
+
+    struct op_timing batched;
+    error_code = run_gemm_batched(
+        context, data->in_A, data->in_B, data->out_C, size, size, size,
+        batch_size, &batched
+    );
+    CHECK_ERR("batched gemm failed", error_code, return_error);
+
+    phase_start_ns = host_time_ns();
+    validate_result(data);
+    trace_host_phase("validate_result", NULL, phase_start_ns, host_time_ns());
+
+    printf("%zu multiplies of %zux%zu matrices\n", batch_size, size, size);
+    print_throughput("launch per matrix", data, &looped);
+    print_throughput("batched", data, &batched);
+
+return_error:
+    release_gpu_context(context);
+    release_input_data(data);
+    return error_code ? -1 : 0;
+}
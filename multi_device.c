@@ -0,0 +1,826 @@
+/// sched_setaffinity and CPU_SET for the first touch's binding
+#define _GNU_SOURCE
+
+#include <assert.h>
+#include <dirent.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+
+#include "multi_device.h"
+#include "autotune.h"
+#include "const.h"
+#include "cpu_gemm.h"
+#include "trace.h"
+
+cl_int list_all_devices(cl_device_id** devices, size_t* num_devices)
+{
+    assert(devices);
+    assert(num_devices);
+
+    *devices = NULL;
+    *num_devices = 0;
+
+    cl_uint num_platforms = 0;
+    cl_int result = clGetPlatformIDs(0, 0, &num_platforms);
+    CHECK_AND_RET_ERR("Error getting platforms list", result);
+
+    cl_platform_id* const platforms = calloc(num_platforms, sizeof(cl_platform_id));
+    if (!platforms)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    result = clGetPlatformIDs(num_platforms, platforms, &num_platforms);
+    CHECK_ERR("Error getting platforms list", result, free_platforms);
+
+    for (size_t i = 0; i < num_platforms; ++i)
+    {
+        cl_uint platform_devices = 0;
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 0, 0, &platform_devices)
+            || !platform_devices)
+            continue;
+
+        cl_device_id* const list = realloc(
+            *devices, (*num_devices + platform_devices) * sizeof(cl_device_id)
+        );
+        if (!list)
+        {
+            result = CL_OUT_OF_HOST_MEMORY;
+            break;
+        }
+        *devices = list;
+
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, platform_devices,
+                           *devices + *num_devices, &platform_devices))
+            continue;
+        *num_devices += platform_devices;
+    }
+
+    if (!result && !*num_devices)
+        result = CL_DEVICE_NOT_FOUND;
+    if (result)
+    {
+        free(*devices);
+        *devices = NULL;
+        *num_devices = 0;
+    }
+
+free_platforms:
+    free(platforms);
+    return result;
+}
+
+struct device_group* setup_device_group(cl_device_id const* devices,
+                                        size_t num_devices,
+                                        char const* const* sources_list,
+                                        size_t src_list_sz,
+                                        cl_int* error)
+{
+    assert(error);
+
+    cl_device_id* all_devices = NULL;
+    if (!devices)
+    {
+        *error = list_all_devices(&all_devices, &num_devices);
+        if (*error)
+            return NULL;
+        devices = all_devices;
+    }
+
+    struct device_group* group = calloc(1, sizeof(struct device_group));
+    if (group)
+    {
+        group->contexts = calloc(num_devices, sizeof(struct gpu_context*));
+        group->weights = calloc(num_devices, sizeof(double));
+    }
+    if (!group || !group->contexts || !group->weights)
+    {
+        *error = CL_OUT_OF_HOST_MEMORY;
+        goto return_error;
+    }
+
+    for (size_t i = 0; i < num_devices; ++i)
+    {
+        group->contexts[i] = setup_gpu_context_on_device(
+            devices[i], sources_list, src_list_sz, error
+        );
+        if (*error)
+            goto return_error;
+        ++group->num_contexts;
+
+        fprintf(
+            stderr, "Device %zu of the group: %s\n", i,
+            group->contexts[i]->device_name
+        );
+    }
+
+    free(all_devices);
+    return group;
+
+return_error:
+    free(all_devices);
+    release_device_group(group);
+    return NULL;
+}
+
+void release_device_group(struct device_group* group)
+{
+    if (!group)
+        return;
+
+    for (size_t i = 0; i < group->num_contexts; ++i)
+        release_gpu_context(group->contexts[i]);
+    free(group->contexts);
+    free(group->weights);
+    free(group);
+}
+
+/// Rows of every device's part have to be multiples of all tiles in use
+static
+size_t row_granularity(struct device_group const* group,
+                       size_t n, size_t m, size_t k)
+{
+    size_t granularity = default_gemm_config().tile_size;
+    for (size_t i = 0; i < group->num_contexts; ++i)
+    {
+        struct gemm_config const config = lookup_gemm_config(
+            group->contexts[i], n, m, k
+        );
+        if (config.tile_size > granularity)
+            granularity = config.tile_size;
+    }
+    return granularity;
+}
+
+cl_int calibrate_device_group(struct device_group* group,
+                              size_t n, size_t m, size_t k)
+{
+    assert(group);
+
+    size_t const granularity = row_granularity(group, n, m, k);
+    size_t rows = n / MULTI_DEVICE_CALIBRATION_FRACTION / granularity * granularity;
+    if (rows < granularity)
+        rows = granularity < n ? granularity : n;
+
+    cl_int result = 0;
+    float* const a = calloc(rows * m, sizeof(float));
+    float* const b = calloc(m * k, sizeof(float));
+    float* const c = calloc(rows * k, sizeof(float));
+    if (!a || !b || !c)
+    {
+        result = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
+
+    double total_throughput = 0;
+    for (size_t i = 0; i < group->num_contexts; ++i)
+    {
+        /// First run builds the variant and warms the device up
+        struct op_timing timing;
+        result = run_gemm(group->contexts[i], a, b, c, rows, m, k, &timing);
+        if (!result)
+            result = run_gemm(group->contexts[i], a, b, c, rows, m, k, &timing);
+        CHECK_ERR("Calibration gemm failed", result, free_arrays);
+
+        group->weights[i] = (double) rows / (double) (timing.total_ns ? timing.total_ns : 1);
+        total_throughput += group->weights[i];
+
+        fprintf(
+            stderr, "Calibrated %s: %zu rows in %.4f ms\n",
+            group->contexts[i]->device_name, rows, timing.total_ns / 1e6
+        );
+    }
+
+    for (size_t i = 0; i < group->num_contexts; ++i)
+        group->weights[i] /= total_throughput;
+
+free_arrays:
+    free(a);
+    free(b);
+    free(c);
+    return result;
+}
+
+void split_rows(struct device_group const* group, size_t n, size_t granularity,
+                size_t* rows)
+{
+    assert(group);
+    assert(rows);
+
+    bool const calibrated = group->weights[0] != 0;
+    size_t assigned = 0;
+    size_t fastest = 0;
+    for (size_t i = 0; i < group->num_contexts; ++i)
+    {
+        double const weight = calibrated
+            ? group->weights[i] : 1.0 / (double) group->num_contexts;
+        rows[i] = (size_t) (weight * (double) n) / granularity * granularity;
+        assigned += rows[i];
+        if (group->weights[i] > group->weights[fastest])
+            fastest = i;
+    }
+    rows[fastest] += n - assigned;
+}
+
+void split_gemm_rows(struct device_group* group, size_t n, size_t m, size_t k,
+                     size_t* rows)
+{
+    split_rows(group, n, row_granularity(group, n, m, k), rows);
+}
+
+/// One device's part of \ref run_gemm_multi_device
+struct device_slice
+{
+    cl_mem      a_buf;
+    cl_mem      b_buf;
+    cl_mem      c_buf;
+    cl_event    transfers[3];   //!< write A, write B, read C
+    cl_event    run_event;
+};
+
+/// Enqueues the device's gemm on \p rows rows without waiting for it
+static
+cl_int enqueue_slice(struct gpu_context* context, struct device_slice* slice,
+                     float const* a, float const* b, float* c,
+                     size_t rows, size_t m, size_t k)
+{
+    cl_int result = 0;
+    struct gemm_config const config = lookup_gemm_config(context, rows, m, k);
+
+    slice->a_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, rows * m * sizeof(float), &result
+    );
+    CHECK_AND_RET_ERR("Error creating buffer", result);
+    slice->b_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_READ_ONLY, m * k * sizeof(float), &result
+    );
+    CHECK_AND_RET_ERR("Error creating buffer", result);
+    slice->c_buf = acquire_buffer(
+        &context->buffer_pool, CL_MEM_WRITE_ONLY, rows * k * sizeof(float), &result
+    );
+    CHECK_AND_RET_ERR("Error creating buffer", result);
+
+    result = clEnqueueWriteBuffer(
+        context->command_queue, slice->a_buf, false, 0, rows * m * sizeof(float),
+        a, 0, 0, &slice->transfers[0]
+    );
+    CHECK_AND_RET_ERR("clEnqueueWriteBuffer error", result);
+    result = clEnqueueWriteBuffer(
+        context->command_queue, slice->b_buf, false, 0, m * k * sizeof(float),
+        b, 0, 0, &slice->transfers[1]
+    );
+    CHECK_AND_RET_ERR("clEnqueueWriteBuffer error", result);
+
+    result = enqueue_gemm(
+        context, &config, 0, slice->a_buf, slice->b_buf, slice->c_buf,
+        rows, m, k, 0, 0, &slice->run_event
+    );
+    CHECK_AND_RET_ERR("Error enqueuing kernel", result);
+
+    result = clEnqueueReadBuffer(
+        context->command_queue, slice->c_buf, false, 0, rows * k * sizeof(float),
+        c, 0, 0, &slice->transfers[2]
+    );
+    CHECK_AND_RET_ERR("clEnqueueReadBuffer error", result);
+
+    return clFlush(context->command_queue);
+}
+
+static
+void release_slice(struct gpu_context* context, struct device_slice* slice)
+{
+    trace_commands(slice->transfers, 3);
+    trace_command(slice->run_event);
+    for (size_t i = 0; i < 3; ++i)
+        if (slice->transfers[i])
+            clReleaseEvent(slice->transfers[i]);
+    if (slice->run_event)
+        clReleaseEvent(slice->run_event);
+    release_buffer(&context->buffer_pool, slice->a_buf);
+    release_buffer(&context->buffer_pool, slice->b_buf);
+    release_buffer(&context->buffer_pool, slice->c_buf);
+}
+
+cl_int run_gemm_multi_device(struct device_group* group,
+                             float const* a, float const* b, float* c,
+                             size_t n, size_t m, size_t k,
+                             struct device_share* shares,
+                             struct op_timing* timing)
+{
+    assert(group);
+    assert(group->num_contexts);
+
+    cl_int result = 0;
+    size_t const num = group->num_contexts;
+
+    if (group->weights[0] == 0)
+    {
+        result = calibrate_device_group(group, n, m, k);
+        CHECK_AND_RET_ERR("Calibration failed", result);
+    }
+
+    cl_ulong const start_ns = host_time_ns();
+
+    size_t* const rows = calloc(num, sizeof(size_t));
+    struct device_slice* const slices = calloc(num, sizeof(struct device_slice));
+    if (!rows || !slices)
+    {
+        result = CL_OUT_OF_HOST_MEMORY;
+        goto release_slices;
+    }
+
+    split_gemm_rows(group, n, m, k, rows);
+
+    /// All devices are enqueued before waiting for any of them
+    size_t first_row = 0;
+    for (size_t i = 0; i < num; ++i)
+    {
+        if (rows[i])
+        {
+            result = enqueue_slice(
+                group->contexts[i], &slices[i], a + first_row * m, b,
+                c + first_row * k, rows[i], m, k
+            );
+            CHECK_ERR("Error enqueuing device's part", result, wait_queues);
+        }
+        first_row += rows[i];
+    }
+
+wait_queues:
+    for (size_t i = 0; i < num; ++i)
+        clFinish(group->contexts[i]->command_queue);
+
+    if (!result && timing)
+        memset(timing, 0, sizeof(struct op_timing));
+
+    for (size_t i = 0; !result && i < num; ++i)
+    {
+        struct device_share share = {rows[i], 0, 0, 0};
+        if (rows[i])
+        {
+            share.kernel_ns = event_elapsed_ns(slices[i].run_event);
+            for (size_t j = 0; j < 3; ++j)
+                share.transfer_ns += event_elapsed_ns(slices[i].transfers[j]);
+
+            cl_ulong first_start = 0, last_end = 0;
+            clGetEventProfilingInfo(
+                slices[i].transfers[0], CL_PROFILING_COMMAND_START,
+                sizeof(cl_ulong), &first_start, 0
+            );
+            clGetEventProfilingInfo(
+                slices[i].transfers[2], CL_PROFILING_COMMAND_END,
+                sizeof(cl_ulong), &last_end, 0
+            );
+            share.busy_ns = last_end - first_start;
+        }
+
+        /// Devices run concurrently, the longest one is the critical path
+        if (shares)
+            shares[i] = share;
+        if (timing && share.kernel_ns > timing->kernel_ns)
+            timing->kernel_ns = share.kernel_ns;
+        if (timing && share.transfer_ns > timing->transfer_ns)
+            timing->transfer_ns = share.transfer_ns;
+    }
+    if (!result && timing)
+        timing->total_ns = host_time_ns() - start_ns;
+
+release_slices:
+    for (size_t i = 0; slices && i < num; ++i)
+        release_slice(group->contexts[i], &slices[i]);
+    free(slices);
+    free(rows);
+    return result;
+}
+
+void init_co_exec_state(struct co_exec_state* state, double cpu_fraction)
+{
+    assert(state);
+
+    memset(state, 0, sizeof(struct co_exec_state));
+    state->cpu_fraction = cpu_fraction;
+}
+
+/// Folds the run's rate of one side into the smoothed one
+static
+void update_rate(double* rate, size_t rows, cl_ulong elapsed_ns)
+{
+    if (!rows || !elapsed_ns)
+        return;
+
+    double const measured = (double) rows / (double) elapsed_ns;
+    *rate = *rate ? CO_EXEC_RATE_SMOOTHING * measured
+                    + (1 - CO_EXEC_RATE_SMOOTHING) * *rate
+                  : measured;
+}
+
+cl_int run_gemm_co_exec(struct gpu_context* context, struct co_exec_state* state,
+                        float const* a, float const* b, float* c,
+                        size_t n, size_t m, size_t k,
+                        struct device_share shares[2],
+                        struct op_timing* timing)
+{
+    assert(context);
+    assert(state);
+
+    if (context->backend == CLFUN_BACKEND_NATIVE)
+        return CL_INVALID_OPERATION;
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+    struct device_slice slice;
+    memset(&slice, 0, sizeof(slice));
+
+    /// The device's rows have to be whole tiles, the host takes any number
+    size_t granularity = default_gemm_config().tile_size;
+    struct gemm_config const config = lookup_gemm_config(context, n, m, k);
+    if (config.tile_size > granularity)
+        granularity = config.tile_size;
+
+    double const fraction = state->cpu_fraction < 0 ? 0
+        : state->cpu_fraction > 1 ? 1 : state->cpu_fraction;
+    size_t const device_rows = (size_t) ((1 - fraction) * (double) n)
+                               / granularity * granularity;
+    size_t const cpu_rows = n - device_rows;
+
+    if (device_rows)
+    {
+        result = enqueue_slice(context, &slice, a, b, c, device_rows, m, k);
+        CHECK_ERR("Error enqueuing device's part", result, wait_device);
+    }
+
+    /// The host computes its rows while the device's commands run
+    cl_ulong cpu_ns = 0;
+    if (cpu_rows)
+    {
+        cl_ulong const cpu_start_ns = host_time_ns();
+        result = cpu_gemm(
+            a + device_rows * m, b, c + device_rows * k, cpu_rows, m, k, &cpu_ns
+        );
+        trace_host_phase("co_exec_cpu_gemm", NULL, cpu_start_ns, cpu_start_ns + cpu_ns);
+        CHECK_ERR("Host's part of the gemm failed", result, wait_device);
+    }
+
+wait_device:
+    clFinish(context->command_queue);
+    if (result)
+        goto release;
+
+    struct device_share device_share = {device_rows, 0, 0, 0};
+    if (device_rows)
+    {
+        device_share.kernel_ns = event_elapsed_ns(slice.run_event);
+        for (size_t j = 0; j < 3; ++j)
+            device_share.transfer_ns += event_elapsed_ns(slice.transfers[j]);
+
+        cl_ulong first_start = 0, last_end = 0;
+        clGetEventProfilingInfo(
+            slice.transfers[0], CL_PROFILING_COMMAND_START,
+            sizeof(cl_ulong), &first_start, 0
+        );
+        clGetEventProfilingInfo(
+            slice.transfers[2], CL_PROFILING_COMMAND_END,
+            sizeof(cl_ulong), &last_end, 0
+        );
+        device_share.busy_ns = last_end - first_start;
+    }
+    struct device_share const cpu_share = {cpu_rows, cpu_ns, 0, cpu_ns};
+
+    /// Both sides finish together when the rows follow their rates
+    update_rate(&state->device_rate, device_rows, device_share.busy_ns);
+    update_rate(&state->cpu_rate, cpu_rows, cpu_ns);
+    if (state->device_rate && state->cpu_rate)
+        state->cpu_fraction = state->cpu_rate
+                              / (state->cpu_rate + state->device_rate);
+
+    if (shares)
+    {
+        shares[0] = device_share;
+        shares[1] = cpu_share;
+    }
+    if (timing)
+    {
+        timing->kernel_ns = device_share.kernel_ns + cpu_ns;
+        timing->transfer_ns = device_share.transfer_ns;
+        timing->total_ns = host_time_ns() - start_ns;
+    }
+
+release:
+    release_slice(context, &slice);
+    return result;
+}
+
+void print_device_shares(struct device_group const* group,
+                         struct device_share const* shares, size_t n,
+                         FILE* out)
+{
+    for (size_t i = 0; i < group->num_contexts; ++i)
+        fprintf(
+            out,
+            "%s: %zu rows (%.1f%%), kernel %.4f ms, transfers %.4f ms, "
+            "busy %.4f ms\n",
+            group->contexts[i]->device_name, shares[i].rows,
+            100.0 * shares[i].rows / n, shares[i].kernel_ns / 1e6,
+            shares[i].transfer_ns / 1e6, shares[i].busy_ns / 1e6
+        );
+}
+
+/// Number of NUMA nodes of the host, 1 if unknown
+static
+size_t numa_node_count(void)
+{
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (!dir)
+        return 1;
+
+    size_t count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)))
+        if (!strncmp(entry->d_name, "node", 4)
+            && entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+            ++count;
+
+    closedir(dir);
+    return count ? count : 1;
+}
+
+/// Splits the device's compute units into \p parts equal sub-devices
+static
+cl_int partition_by_counts(cl_device_id device, size_t parts,
+                           cl_device_id* sub_devices, cl_uint* num_sub_devices)
+{
+    cl_uint compute_units = 0;
+    cl_int result = clGetDeviceInfo(
+        device, CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint), &compute_units, 0
+    );
+    CHECK_AND_RET_ERR("Failed to get compute units", result);
+
+    if (parts > compute_units)
+        parts = compute_units;
+    if (parts < 2)
+        return CL_DEVICE_PARTITION_FAILED;
+
+    cl_device_partition_property properties[FISSION_MAX_SUB_DEVICES + 3];
+    size_t num_properties = 0;
+    properties[num_properties++] = CL_DEVICE_PARTITION_BY_COUNTS;
+    for (size_t i = 0; i < parts; ++i)
+        properties[num_properties++] = compute_units / parts
+            + (i < compute_units % parts);
+    properties[num_properties++] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+    properties[num_properties++] = 0;
+
+    return clCreateSubDevices(
+        device, properties, parts, sub_devices, num_sub_devices
+    );
+}
+
+cl_int partition_device(cl_device_id device, cl_device_id** sub_devices,
+                        size_t* num_sub_devices)
+{
+    assert(sub_devices);
+    assert(num_sub_devices);
+
+    *sub_devices = calloc(FISSION_MAX_SUB_DEVICES, sizeof(cl_device_id));
+    *num_sub_devices = 0;
+    if (!*sub_devices)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    cl_device_partition_property const numa_properties[] =
+    {
+        CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0
+    };
+
+    cl_uint num = 0;
+    cl_int result = clCreateSubDevices(
+        device, numa_properties, FISSION_MAX_SUB_DEVICES, *sub_devices, &num
+    );
+
+    /// A single NUMA domain gives nothing to split, so counts are tried too
+    if (!result && num < 2)
+    {
+        for (cl_uint i = 0; i < num; ++i)
+            clReleaseDevice((*sub_devices)[i]);
+        result = CL_DEVICE_PARTITION_FAILED;
+    }
+
+    if (result)
+    {
+        size_t const nodes = numa_node_count();
+        size_t const parts = nodes < 2 ? 2 : nodes;
+        fprintf(
+            stderr, "NUMA partitioning unavailable (%d), splitting into %zu "
+            "sub-devices by counts\n", result, parts
+        );
+        result = partition_by_counts(
+            device, parts < FISSION_MAX_SUB_DEVICES ? parts : FISSION_MAX_SUB_DEVICES,
+            *sub_devices, &num
+        );
+    }
+    else
+        fprintf(stderr, "Partitioned device into %u NUMA sub-devices\n", num);
+
+    if (result)
+    {
+        fprintf(stderr, "Device partitioning failed: %d\n", result);
+        free(*sub_devices);
+        *sub_devices = NULL;
+        return result;
+    }
+
+    *num_sub_devices = num;
+    return 0;
+}
+
+struct device_group* setup_fission_group(cl_device_id device,
+                                         char const* const* sources_list,
+                                         size_t src_list_sz,
+                                         cl_int* error)
+{
+    assert(error);
+
+    cl_device_id* sub_devices = NULL;
+    size_t num_sub_devices = 0;
+    *error = partition_device(device, &sub_devices, &num_sub_devices);
+    if (*error)
+        return NULL;
+
+    struct device_group* group = setup_device_group(
+        sub_devices, num_sub_devices, sources_list, src_list_sz, error
+    );
+
+    /// Contexts hold their own references
+    for (size_t i = 0; i < num_sub_devices; ++i)
+        clReleaseDevice(sub_devices[i]);
+    free(sub_devices);
+
+    /// Partitions are of the same size, no calibration needed
+    for (size_t i = 0; group && i < group->num_contexts; ++i)
+        group->weights[i] = 1.0 / (double) group->num_contexts;
+    return group;
+}
+
+/// Reads the CPUs of the NUMA node from its cpulist, e.g. "0-15,32-47"
+static
+bool numa_node_cpus(size_t node, cpu_set_t* cpus)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%zu/cpulist", node);
+    FILE* const file = fopen(path, "r");
+    if (!file)
+        return false;
+
+    CPU_ZERO(cpus);
+    unsigned first = 0, last = 0;
+    while (fscanf(file, "%u", &first) == 1)
+    {
+        int separator = fgetc(file);
+        last = first;
+        if (separator == '-')
+        {
+            if (fscanf(file, "%u", &last) != 1)
+                break;
+            separator = fgetc(file);
+        }
+
+        for (unsigned cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+            CPU_SET(cpu, cpus);
+        if (separator != ',')
+            break;
+    }
+
+    fclose(file);
+    return CPU_COUNT(cpus) != 0;
+}
+
+void first_touch_rows(struct device_group const* group, void* ptr,
+                      size_t row_bytes, size_t const* rows)
+{
+    assert(group);
+
+    int const num = (int) group->num_contexts;
+    size_t const nodes = numa_node_count();
+    size_t* const first_rows = calloc(group->num_contexts, sizeof(size_t));
+    if (!first_rows)
+        return;
+
+    for (size_t i = 1; i < group->num_contexts; ++i)
+        first_rows[i] = first_rows[i - 1] + rows[i - 1];
+
+    /// On a single node every page is local anyway, otherwise the parts must
+    /// be the nodes' sub-devices to be placed on them
+    bool const bind = nodes > 1 && group->num_contexts == nodes;
+    if (nodes > 1 && !bind)
+        fprintf(
+            stderr, "First touch is not bound: %zu sub-devices on %zu NUMA nodes\n",
+            group->num_contexts, nodes
+        );
+
+    int unbound = 0;
+    #pragma omp parallel for num_threads(num) schedule(static, 1) reduction(+:unbound)
+    for (int i = 0; i < num; ++i)
+    {
+        /// Part i is touched from the CPUs of node i, the thread's own
+        /// affinity is restored afterwards
+        cpu_set_t saved, node_cpus;
+        bool const bound = bind && numa_node_cpus(i, &node_cpus)
+            && !sched_getaffinity(0, sizeof(cpu_set_t), &saved)
+            && !sched_setaffinity(0, sizeof(cpu_set_t), &node_cpus);
+        unbound += bind && !bound;
+
+        memset((char*) ptr + first_rows[i] * row_bytes, 0, rows[i] * row_bytes);
+
+        if (bound)
+            sched_setaffinity(0, sizeof(cpu_set_t), &saved);
+    }
+
+    if (unbound)
+        fprintf(stderr, "First touch is not bound on %d NUMA nodes\n", unbound);
+    free(first_rows);
+}
+
+cl_int run_scan_multi_device(struct device_group* group,
+                             float const* in, float* out, size_t n,
+                             struct device_share* shares,
+                             struct op_timing* timing)
+{
+    assert(group);
+    assert(group->num_contexts);
+
+    cl_ulong const start_ns = host_time_ns();
+    cl_int result = 0;
+    int const num = (int) group->num_contexts;
+
+    size_t* const rows = calloc(num, sizeof(size_t));
+    size_t* const first_rows = calloc(num, sizeof(size_t));
+    float* const carries = calloc(num, sizeof(float));
+    cl_int* const results = calloc(num, sizeof(cl_int));
+    struct op_timing* const timings = calloc(num, sizeof(struct op_timing));
+    if (!rows || !first_rows || !carries || !results || !timings)
+    {
+        result = CL_OUT_OF_HOST_MEMORY;
+        goto free_arrays;
+    }
+
+    /// Every part but the fastest device's one, which takes the remainder,
+    /// is whole scan tiles of any device
+    split_rows(group, n, SCAN_TILE_SIZE, rows);
+    for (int i = 1; i < num; ++i)
+        first_rows[i] = first_rows[i - 1] + rows[i - 1];
+
+    /// run_scan waits for its device, so every device gets a host thread
+    #pragma omp parallel for num_threads(num) proc_bind(spread) schedule(static, 1)
+    for (int i = 0; i < num; ++i)
+        if (rows[i])
+            results[i] = run_scan(
+                group->contexts[i], in + first_rows[i], out + first_rows[i],
+                rows[i], &timings[i]
+            );
+
+    for (int i = 0; i < num; ++i)
+        if (results[i])
+        {
+            result = results[i];
+            CHECK_ERR("Device's part of the scan failed", result, free_arrays);
+        }
+
+    /// Every part is offset by the sum of the parts before it
+    for (int i = 1; i < num; ++i)
+        carries[i] = carries[i - 1]
+            + (rows[i - 1] ? out[first_rows[i - 1] + rows[i - 1] - 1] : 0);
+
+    #pragma omp parallel for num_threads(num) proc_bind(spread) schedule(static, 1)
+    for (int i = 0; i < num; ++i)
+        for (size_t j = 0; j < rows[i]; ++j)
+            out[first_rows[i] + j] += carries[i];
+
+    if (timing)
+        memset(timing, 0, sizeof(struct op_timing));
+    for (int i = 0; i < num; ++i)
+    {
+        if (shares)
+        {
+            shares[i].rows = rows[i];
+            shares[i].kernel_ns = timings[i].kernel_ns;
+            shares[i].transfer_ns = timings[i].transfer_ns;
+            shares[i].busy_ns = timings[i].total_ns;
+        }
+        /// Devices run concurrently, the longest one is the critical path
+        if (timing && timings[i].kernel_ns > timing->kernel_ns)
+            timing->kernel_ns = timings[i].kernel_ns;
+        if (timing && timings[i].transfer_ns > timing->transfer_ns)
+            timing->transfer_ns = timings[i].transfer_ns;
+    }
+    if (timing)
+        timing->total_ns = host_time_ns() - start_ns;
+
+free_arrays:
+    free(rows);
+    free(first_rows);
+    free(carries);
+    free(results);
+    free(timings);
+    return result;
+}
@@ -0,0 +1,176 @@
+#ifndef OPENCL_FUN_MULTI_DEVICE_H
+#define OPENCL_FUN_MULTI_DEVICE_H
+
+#include "clfun.h"
+
+/// Most sub-devices \ref partition_device creates
+#define FISSION_MAX_SUB_DEVICES 16
+
+/// Calibration multiplies 1 / MULTI_DEVICE_CALIBRATION_FRACTION of the rows
+#define MULTI_DEVICE_CALIBRATION_FRACTION 8
+
+/**
+ * Contexts of several devices working on one operation together.
+ * Every device has its own \ref gpu_context, so programs, buffer pools
+ * and tuned configs are per device.
+ */
+struct device_group
+{
+    struct gpu_context**    contexts;
+    size_t                  num_contexts;
+
+    /// Relative throughput of the devices measured by
+    /// \ref calibrate_device_group, sums up to 1, all zero until calibrated
+    double*                 weights;
+};
+
+/// Part of a multi-device call done by one device
+struct device_share
+{
+    size_t      rows;           //!< Rows of the result computed by the device
+    cl_ulong    kernel_ns;      //!< Device's kernel time
+    cl_ulong    transfer_ns;    //!< Device's copies time
+    cl_ulong    busy_ns;        //!< From the start of the first copy to the end of the last one
+};
+
+/**
+ * Lists the devices of all platforms.
+ * \param devices Set to a new array, to be freed by the caller
+ */
+cl_int list_all_devices(cl_device_id** devices, size_t* num_devices);
+
+/**
+ * Sets up a context on each of the devices.
+ * \param devices Devices of the group, every device of every platform if NULL
+ * \param sources_list Files to build, \ref clfun_default_sources if NULL
+ * \param error Set to error code or zero on success
+ * \return New group or NULL on failure
+ */
+struct device_group* setup_device_group(cl_device_id const* devices,
+                                        size_t num_devices,
+                                        char const* const* sources_list,
+                                        size_t src_list_sz,
+                                        cl_int* error);
+
+/// Destructor for \ref device_group
+void release_device_group(struct device_group* group);
+
+/**
+ * Sets the group's weights from a quick gemm of the shape's first rows
+ * on every device, the throughput counts copies as well as kernels.
+ */
+cl_int calibrate_device_group(struct device_group* group,
+                              size_t n, size_t m, size_t k);
+
+/**
+ * Splits \p n rows proportionally to the weights in multiples of \p granularity,
+ * the remainder goes to the fastest device. Uncalibrated groups are split evenly.
+ */
+void split_rows(struct device_group const* group, size_t n, size_t granularity,
+                size_t* rows);
+
+/// Rows of A and C every device gets in \ref run_gemm_multi_device
+void split_gemm_rows(struct device_group* group, size_t n, size_t m, size_t k,
+                     size_t* rows);
+
+/**
+ * \ref run_gemm with the rows of A and C split across the group's devices
+ * proportionally to their weights, the group is calibrated on the first call.
+ * Every device gets all of B, the devices run concurrently.
+ * \param shares Array of \ref device_group::num_contexts filled if not NULL
+ * \param timing Filled if not NULL: the longest device's kernel and transfer
+ *        times, as the devices overlap, and the wall time
+ */
+cl_int run_gemm_multi_device(struct device_group* group,
+                             float const* a, float const* b, float* c,
+                             size_t n, size_t m, size_t k,
+                             struct device_share* shares,
+                             struct op_timing* timing);
+
+/**
+ * Partitions the device into sub-devices, one per NUMA node with
+ * CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN. If the runtime can't do that,
+ * compute units are split equally between the host's NUMA nodes, or into
+ * two halves on a single node, with CL_DEVICE_PARTITION_BY_COUNTS.
+ * \param sub_devices Set to a new array, to be freed by the caller along
+ *        with the sub-devices
+ */
+cl_int partition_device(cl_device_id device, cl_device_id** sub_devices,
+                        size_t* num_sub_devices);
+
+/**
+ * \ref setup_device_group on the sub-devices of \p device, see
+ * \ref partition_device. Each sub-device gets its own context and queue,
+ * the parts are of equal size, so the weights are set without calibration.
+ */
+struct device_group* setup_fission_group(cl_device_id device,
+                                         char const* const* sources_list,
+                                         size_t src_list_sz,
+                                         cl_int* error);
+
+/**
+ * Zeroes each device's rows of \p ptr from a thread bound to the device's
+ * NUMA node, so that the first touch places the pages on the node. Thread i
+ * is bound to the CPUs of node i listed in /sys/devices/system/node, which
+ * takes sub-device i to be node i: runtimes list the NUMA sub-devices of
+ * CL_DEVICE_AFFINITY_DOMAIN_NUMA in node order. A warning is printed when
+ * the group's size is not the node count or a thread can't be bound.
+ * No binding is needed on a single node.
+ * \param rows Rows of every device, e.g. from \ref split_gemm_rows
+ */
+void first_touch_rows(struct device_group const* group, void* ptr,
+                      size_t row_bytes, size_t const* rows);
+
+/**
+ * \ref run_scan with the array split across the group's devices.
+ * Every device scans its part in a host thread of its own, then the parts
+ * are offset by the totals of the parts before them.
+ * n is expected to be not greater than SCAN_TILE_SIZE or divisible by it.
+ * \param timing Filled if not NULL as by \ref run_gemm_multi_device
+ */
+cl_int run_scan_multi_device(struct device_group* group,
+                             float const* in, float* out, size_t n,
+                             struct device_share* shares,
+                             struct op_timing* timing);
+
+/// Share of the rows the host computes in the first \ref run_gemm_co_exec
+#define CO_EXEC_DEFAULT_CPU_FRACTION 0.25
+
+/// Weight of the latest run in the rates \ref run_gemm_co_exec splits by
+#define CO_EXEC_RATE_SMOOTHING 0.5
+
+/**
+ * Split of \ref run_gemm_co_exec between the device and the host threads,
+ * carried from call to call. Rates are rows per ns, zero until measured.
+ */
+struct co_exec_state
+{
+    double cpu_fraction;    //!< Share of C's rows computed by the host
+    double device_rate;
+    double cpu_rate;
+};
+
+/// Starts with the host computing \p cpu_fraction of the rows
+void init_co_exec_state(struct co_exec_state* state, double cpu_fraction);
+
+/**
+ * \ref run_gemm with the last rows of A and C multiplied by \ref cpu_gemm on
+ * the host threads while the device computes the others. The rows are split
+ * by \ref co_exec_state::cpu_fraction, rounded to the device's tiles. After
+ * the call, the fraction is set from the measured rates of both sides, so
+ * that they finish together on the next call of the shape.
+ * \param shares Device's and host's part, filled if not NULL
+ * \param timing Filled if not NULL: sums of both parts' times and the wall time
+ */
+cl_int run_gemm_co_exec(struct gpu_context* context, struct co_exec_state* state,
+                        float const* a, float const* b, float* c,
+                        size_t n, size_t m, size_t k,
+                        struct device_share shares[2],
+                        struct op_timing* timing);
+
+/// Prints rows, share and times of every device of the call
+void print_device_shares(struct device_group const* group,
+                         struct device_share const* shares, size_t n,
+                         FILE* out);
+
+#endif //OPENCL_FUN_MULTI_DEVICE_H
@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <omp.h>
+
+#include "const.h"
+#include "cpu_gemm.h"
+#include "native.h"
+
+/// Chunks shorter than this are scanned by a single thread
+#define CPU_SCAN_MIN_CHUNK 4096
+
+cl_int cpu_scan(float const* in, float* out, size_t n, cl_ulong* elapsed_ns)
+{
+    assert(in);
+    assert(out);
+
+    cl_ulong const start_ns = host_time_ns();
+
+    size_t num_chunks = (n + CPU_SCAN_MIN_CHUNK - 1) / CPU_SCAN_MIN_CHUNK;
+    if (num_chunks > (size_t) omp_get_max_threads())
+        num_chunks = omp_get_max_threads();
+    if (!num_chunks)
+        num_chunks = 1;
+
+    float* const offsets = calloc(num_chunks + 1, sizeof(float));
+    if (!offsets)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    size_t const chunk = (n + num_chunks - 1) / num_chunks;
+
+    #pragma omp parallel for num_threads(num_chunks)
+    for (size_t t = 0; t < num_chunks; ++t)
+    {
+        size_t const begin = t * chunk < n ? t * chunk : n;
+        size_t const end = begin + chunk < n ? begin + chunk : n;
+        float sum = 0;
+        #pragma omp simd reduction(+: sum)
+        for (size_t i = begin; i < end; ++i)
+            sum += in[i];
+        offsets[t + 1] = sum;
+    }
+
+    for (size_t t = 0; t < num_chunks; ++t)
+        offsets[t + 1] += offsets[t];
+
+    #pragma omp parallel for num_threads(num_chunks)
+    for (size_t t = 0; t < num_chunks; ++t)
+    {
+        size_t const begin = t * chunk < n ? t * chunk : n;
+        size_t const end = begin + chunk < n ? begin + chunk : n;
+        float sum = offsets[t];
+        #pragma omp simd reduction(inscan, +: sum)
+        for (size_t i = begin; i < end; ++i)
+        {
+            sum += in[i];
+            #pragma omp scan inclusive(sum)
+            out[i] = sum;
+        }
+    }
+
+    free(offsets);
+
+    if (elapsed_ns)
+        *elapsed_ns = host_time_ns() - start_ns;
+    return 0;
+}
+
+void init_native_context(struct gpu_context* context)
+{
+    assert(context);
+
+    context->backend = CLFUN_BACKEND_NATIVE;
+    context->max_work_group_size = SCAN_TILE_SIZE;
+
+    long const pages = sysconf(_SC_PHYS_PAGES);
+    long const page_size = sysconf(_SC_PAGE_SIZE);
+    if (pages > 0 && page_size > 0)
+        context->global_mem_size = (cl_ulong) pages * page_size;
+    context->max_mem_alloc_size = context->global_mem_size;
+
+    snprintf(
+        context->device_name, sizeof(context->device_name),
+        "native (%d OpenMP threads)", omp_get_max_threads()
+    );
+    snprintf(
+        context->driver_version, sizeof(context->driver_version),
+        "OpenMP %d", _OPENMP
+    );
+    init_buffer_pool(&context->buffer_pool, NULL);
+
+    fprintf(stderr, "Selected device: %s\n", context->device_name);
+}
+
+/// Host computation takes the place of the kernels, nothing is transferred
+static
+void set_native_timing(struct op_timing* timing, cl_ulong start_ns,
+                       cl_ulong compute_ns)
+{
+    if (!timing)
+        return;
+
+    timing->kernel_ns = compute_ns;
+    timing->transfer_ns = 0;
+    timing->total_ns = host_time_ns() - start_ns;
+}
+
+cl_int run_native_gemm(float const* a, float const* b, float* c,
+                       size_t n, size_t m, size_t k,
+                       struct op_timing* timing)
+{
+    cl_ulong const start_ns = host_time_ns();
+    cl_ulong compute_ns = 0;
+
+    cl_int const result = cpu_gemm(a, b, c, n, m, k, &compute_ns);
+    CHECK_AND_RET_ERR("Native gemm failed", result);
+
+    trace_host_phase("native_gemm", NULL, start_ns, start_ns + compute_ns);
+    set_native_timing(timing, start_ns, compute_ns);
+    return 0;
+}
+
+cl_int run_native_scan(float const* in, float* out, size_t n,
+                       struct op_timing* timing)
+{
+    cl_ulong const start_ns = host_time_ns();
+    cl_ulong compute_ns = 0;
+
+    if (!n)
+        return CL_INVALID_VALUE;
+
+    cl_int const result = cpu_scan(in, out, n, &compute_ns);
+    CHECK_AND_RET_ERR("Native scan failed", result);
+
+    trace_host_phase("native_scan", NULL, start_ns, start_ns + compute_ns);
+    set_native_timing(timing, start_ns, compute_ns);
+    return 0;
+}
+
+cl_int run_native_array_sum(cl_int const* a, cl_int const* b, cl_int* c,
+                            size_t n, struct op_timing* timing)
+{
+    cl_ulong const start_ns = host_time_ns();
+
+    #pragma omp parallel for simd
+    for (size_t i = 0; i < n; ++i)
+        c[i] = a[i] + b[i];
+
+    cl_ulong const compute_ns = host_time_ns() - start_ns;
+    trace_host_phase("native_array_sum", NULL, start_ns, start_ns + compute_ns);
+    set_native_timing(timing, start_ns, compute_ns);
+    return 0;
+}
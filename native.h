@@ -0,0 +1,30 @@
+#ifndef OPENCL_FUN_NATIVE_H
+#define OPENCL_FUN_NATIVE_H
+
+#include "clfun.h"
+
+/**
+ * Inclusive prefix sum of \p in into \p out on the host. Every OpenMP thread
+ * sums its chunk, the chunks are then scanned with SIMD starting from
+ * the sum of the chunks before them.
+ * \param elapsed_ns Set to the host wall time of the call if not NULL
+ */
+cl_int cpu_scan(float const* in, float* out, size_t n, cl_ulong* elapsed_ns);
+
+/// Fills the context of the native backend: no OpenCL objects, host limits
+void init_native_context(struct gpu_context* context);
+
+/// \ref run_gemm with \ref cpu_gemm, takes any shape
+cl_int run_native_gemm(float const* a, float const* b, float* c,
+                       size_t n, size_t m, size_t k,
+                       struct op_timing* timing);
+
+/// \ref run_scan with \ref cpu_scan, takes any n
+cl_int run_native_scan(float const* in, float* out, size_t n,
+                       struct op_timing* timing);
+
+/// \ref run_array_sum on the host
+cl_int run_native_array_sum(cl_int const* a, cl_int const* b, cl_int* c,
+                            size_t n, struct op_timing* timing);
+
+#endif //OPENCL_FUN_NATIVE_H
@@ -1,35 +1,15 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <math.h>
 #include <string.h>
 
 #include <omp.h>
-#include <CL/opencl.h>
 
+#include "clfun.h"
 #include "const.h"
-
-#ifndef CHECK_ERR
-#define CHECK_ERR(intro, result, exit_label)        \
-do {                                                \
-    if ((result) != 0)                              \
-    {                                               \
-        fprintf(stderr, "%s: %d\n", intro, result); \
-        goto exit_label;                            \
-    }                                               \
-} while (false)
-#endif
-
-#ifndef CHECK_AND_RET_ERR
-#define CHECK_AND_RET_ERR(intro, result)            \
-do {                                                \
-    if ((result) != 0)                              \
-    {                                               \
-        fprintf(stderr, "%s: %d\n", intro, result); \
-        return result;                              \
-    }                                               \
-} while (false)
-#endif
+#include "multi_device.h"
 
 static inline
 void fill_array(float* ptr, size_t cnt)
@@ -38,78 +18,6 @@ void fill_array(float* ptr, size_t cnt)
         ptr[i] = (float) ((double) rand() / (double) (RAND_MAX)) * 1e-4;
 }
 
-static inline
-char* load_source_file(char const* file_name, size_t* len)
-{
-    FILE* source_file = fopen(file_name, "r");
-    if (!source_file)
-    {
-        perror("Error opening source file");
-        return NULL;
-    }
-
-    size_t const file_load_sz = 1024 * 1024;
-    char* program_code = malloc(file_load_sz);
-    if (!program_code)
-    {
-        fclose(source_file);
-        return NULL;
-    }
-
-    size_t code_len = fread(program_code, 1, file_load_sz - 1, source_file);
-    program_code[code_len] = '\0';
-    *len = code_len;
-
-    return program_code;
-}
-
-struct gpu_context
-{
-    size_t n;
-
-    cl_device_id selected_device;
-
-    cl_context          context;
-    cl_command_queue    command_queue;
-    cl_program          program;
-
-    cl_mem              in_array_buf;
-    cl_mem              result_array_buf;
-    cl_mem              pending_add_buf;
-
-    cl_kernel*          kernels;
-    size_t              num_kernels;
-};
-
-/// Destructor for \ref gpu_context
-void release_gpu_context(struct gpu_context* context)
-{
-    if (context->program)
-        clReleaseProgram(context->program);
-    if (context->in_array_buf)
-        clReleaseMemObject(context->in_array_buf);
-    if (context->result_array_buf)
-        clReleaseMemObject(context->result_array_buf);
-    if (context->pending_add_buf)
-        clReleaseMemObject(context->pending_add_buf);
-
-    if (context->kernels)
-    {
-        for (size_t i = 0; i < context->num_kernels; ++i)
-            if (context->kernels[i])
-                clReleaseKernel(context->kernels[i]);
-        free(context->kernels);
-    }
-
-    if (context->context)
-        clReleaseContext(context->context);
-    if (context->command_queue)
-        clReleaseCommandQueue(context->command_queue);
-    if (context->selected_device)
-        clReleaseDevice(context->selected_device);
-    free(context);
-}
-
 struct input_data
 {
     size_t n;
@@ -131,317 +39,6 @@ void release_input_data(struct input_data* context)
     free(context);
 }
 
-static inline
-char const* get_mem_type_str(cl_device_local_mem_type t)
-{
-    switch (t)
-    {
-    case CL_LOCAL:
-        return "local";
-    case CL_GLOBAL:
-        return "global";
-    default:
-        return "other";
-    }
-}
-
-/**
- * Setup device for the specified \ref gpu_context. Doesn't change over kernel.
- * \param context Context to be initialized
- * \return error code or zero on success
- */
-cl_int select_device(struct gpu_context* context)
-{
-    assert(context);
-
-    cl_int error_code;
-    cl_uint num_platforms;
-
-    error_code = clGetPlatformIDs(0, 0, &num_platforms);
-    if (error_code)
-    {
-        fprintf(stderr, "Error getting platforms list!\n");
-        return error_code;
-    }
-
-    cl_platform_id* platforms = calloc(num_platforms, sizeof(cl_platform_id));
-
-    error_code = clGetPlatformIDs(num_platforms, platforms, &num_platforms);
-    if (error_code)
-    {
-        fprintf(stderr, "Error getting platforms list!\n");
-        free(platforms);
-        return error_code;
-    }
-
-    cl_uint num_devices = 0;
-    size_t max_devices = 42;
-    cl_device_id device_list[max_devices];
-    char device_name[64];
-
-    cl_device_local_mem_type mem_type = CL_NONE;
-    size_t max_work_group_size = 0;
-
-    for (size_t i = 0; i < num_platforms; ++i)
-    {
-        error_code = clGetDeviceIDs(
-            platforms[i], CL_DEVICE_TYPE_ALL, max_devices, device_list,
-            &num_devices
-        );
-
-        if (error_code) continue;
-
-        for (size_t j = 0; j < num_devices; ++j)
-        {
-            if (!context->selected_device)
-                context->selected_device = device_list[j];
-
-            size_t ret_sz = 0;
-            cl_device_local_mem_type cur_mem_type = 0;
-            size_t work_group_size = 0;
-
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_LOCAL_MEM_TYPE,
-                sizeof(cl_device_local_mem_type), &cur_mem_type, &ret_sz
-            );
-
-            if (error_code)
-            {
-                if (context->selected_device != device_list[j])
-                    clReleaseDevice(device_list[j]);
-                continue;
-            }
-
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_MAX_WORK_GROUP_SIZE,
-                sizeof(size_t), &work_group_size, &ret_sz
-            );
-
-            if (error_code)
-            {
-                if (context->selected_device != device_list[j])
-                    clReleaseDevice(device_list[j]);
-                continue;
-            }
-
-            error_code = clGetDeviceInfo(
-                device_list[j], CL_DEVICE_NAME, 63, device_name, &ret_sz
-            );
-
-            device_name[ret_sz] = '\0';
-            fprintf(
-                stderr,
-                "Found device \"%s\": mem type %s, max workgroup size %zu\n",
-                device_name, get_mem_type_str(cur_mem_type), work_group_size
-            );
-
-            if ((mem_type != CL_LOCAL && cur_mem_type == CL_LOCAL)
-                || (cur_mem_type == mem_type
-                    && max_work_group_size < work_group_size))
-            {
-                clReleaseDevice(context->selected_device);
-                context->selected_device = device_list[j];
-                max_work_group_size = work_group_size;
-                mem_type = cur_mem_type;
-            }
-            else if (context->selected_device != device_list[j])
-                clReleaseDevice(device_list[j]);
-        }
-    }
-
-    if (!context->selected_device)
-    {
-        free(platforms);
-        return error_code;
-    }
-    else
-    {
-        size_t ret_sz;
-        clGetDeviceInfo(
-            context->selected_device, CL_DEVICE_NAME, 63, device_name, &ret_sz
-        );
-        device_name[ret_sz] = '\0';
-
-        fprintf(stderr, "Selected device: %s\n", device_name);
-    }
-
-    context->context = clCreateContext(
-        0, 1, &context->selected_device, 0, 0, &error_code
-    );
-
-    if (error_code)
-    {
-        release_gpu_context(context);
-        return error_code;
-    }
-
-    context->command_queue = clCreateCommandQueue(
-        context->context, context->selected_device, CL_QUEUE_PROFILING_ENABLE,
-        &error_code
-    );
-
-    if (error_code)
-    {
-        release_gpu_context(context);
-        return error_code;
-    }
-
-    return 0;
-}
-
-/// Loads and compile the kernel for the specified \ref gpu_context
-cl_int load_program(struct gpu_context* context,
-                    char const** sources_list, size_t src_list_sz)
-{
-    assert(context);
-    assert(context->selected_device);
-    assert(context->context);
-
-    char const* file_data[src_list_sz];
-    size_t lens[src_list_sz];
-    cl_int result = 0;
-
-    memset(file_data, 0, sizeof(char const*) * src_list_sz);
-
-    for (size_t i = 0; i < src_list_sz; ++i)
-    {
-        file_data[i] = load_source_file(sources_list[i], &lens[i]);
-        if (!file_data[i])
-        {
-            result = -1;
-            goto return_error;
-        }
-    }
-
-    context->program = clCreateProgramWithSource(
-        context->context, src_list_sz, file_data, lens, &result
-    );
-    CHECK_ERR("Failed to create clProgram", result, return_error);
-
-    result = clBuildProgram(
-        context->program, 1, &context->selected_device, "", 0, 0
-    );
-
-    if (result)
-    {
-        fprintf(stderr, "kernel compilation failed\n");
-        size_t log_len = 0;
-        cl_int saved_error_code = result;
-        char* build_log;
-
-        result = clGetProgramBuildInfo(
-            context->program, context->selected_device,
-            CL_PROGRAM_BUILD_LOG, 0, 0, &log_len
-        );
-        CHECK_ERR("Failed to retrieve build's log", result, return_error);
-
-        build_log = malloc(log_len);
-        result = clGetProgramBuildInfo(
-            context->program, context->selected_device,
-            CL_PROGRAM_BUILD_LOG, log_len, build_log, &log_len
-        );
-
-        if (result)
-        {
-            fprintf(stderr, "Failed to retrieve build's log: %d", result);
-            free(build_log);
-            goto return_error;
-        }
-
-        fprintf(stderr, "Kernel compilation log:\n%s\n", build_log);
-        result = saved_error_code;
-        goto return_error;
-    }
-
-return_error:
-    for (size_t i = 0; i < src_list_sz; ++i)
-        free((void*) file_data[i]);
-    return result;
-}
-
-/// Setups kernel & kernel structs like mem buffers for the \ref gpu_context
-cl_int setup_kernels(struct gpu_context* context,
-                     char const** kernel_names,
-                     size_t kernels_num)
-{
-    size_t n = context->n;
-
-    cl_int result = 0;
-
-    assert(context);
-    assert(context->selected_device);
-    assert(context->context);
-    assert(context->command_queue);
-
-    context->kernels = calloc(kernels_num, sizeof(cl_kernel));
-
-    if (!context->kernels)
-        return -1;
-
-    for (size_t i = 0; i < kernels_num; ++i)
-    {
-        context->kernels[i] = clCreateKernel(
-            context->program, kernel_names[i], &result
-        );
-
-        if (result)
-            return result;
-    }
-
-    context->in_array_buf = clCreateBuffer(
-        context->context, CL_MEM_READ_ONLY, n * sizeof(float), 0, &result
-    );
-    CHECK_AND_RET_ERR("Error creating buffer", result);
-
-    context->result_array_buf = clCreateBuffer(
-        context->context, CL_MEM_READ_WRITE, n * sizeof(float), 0, &result
-    );
-    CHECK_AND_RET_ERR("Error creating buffer", result);
-
-    context->pending_add_buf = clCreateBuffer(
-        context->context, CL_MEM_READ_WRITE, n * sizeof(float), 0, &result
-    );
-    CHECK_AND_RET_ERR("Error creating buffer", result);
-
-    return 0;
-}
-
-struct gpu_context* setup_gpu_context(size_t n,
-                                      char const** sources_list,
-                                      size_t src_list_sz,
-                                      char const** kernel_names,
-                                      size_t kernels_num,
-                                      cl_int* error)
-{
-    assert(error != 0);
-    assert(kernel_names != 0);
-    assert(sources_list != 0);
-
-    *error = 0;
-
-    struct gpu_context* const context = calloc(1, sizeof(struct gpu_context));
-
-    context->n = n;
-
-    *error = select_device(context);
-    if (*error)
-        goto return_error;
-
-    *error = load_program(context, sources_list, src_list_sz);
-    if (*error)
-        goto return_error;
-
-    *error = setup_kernels(context, kernel_names, kernels_num);
-    if (*error)
-        goto return_error;
-
-    return context;
-
-return_error:
-    release_gpu_context(context);
-    return NULL;
-}
-
 struct input_data* generate_input(size_t n)
 {
     struct input_data* data = calloc(1, sizeof(struct input_data));
@@ -463,44 +60,6 @@ error_return:
     return NULL;
 }
 
-void validate_first_step(struct input_data* data)
-{
-    float* const gold = (float*) calloc(data->n, sizeof(float));
-    fprintf(stderr, "Validating results...\n");
-
-    for (size_t tile_id = 0; tile_id < data->n / SCAN_TILE_SIZE; ++tile_id)
-    {
-        for (size_t j = 0; j < SCAN_TILE_SIZE; ++j)
-        {
-            gold[j] = data->in_A[j];
-            if (j)
-                gold[j] += gold[j - 1];
-
-            if (fabsf(gold[j] - data->out_B[j]) >= 0.1)
-            {
-                if (data->n < 10)
-                {
-                    fprintf(stderr, "Initial array:");
-                    for (size_t i = 0; i < data->n; ++i)
-                        fprintf(stderr, " %f", data->in_A[i]);
-
-                    fprintf(stderr, "\nGold array:");
-                    for (size_t i = 0; i < data->n; ++i)
-                        fprintf(stderr, " %f", gold[i]);
-
-                    fprintf(stderr, "\nRun result:");
-                    for (size_t i = 0; i < data->n; ++i)
-                        fprintf(stderr, " %f", data->out_B[i]);
-                }
-
-                assert(false && "Precision test failed");
-            }
-        }
-    }
-
-    free(gold);
-}
-
 void validate_result(struct input_data* data)
 {
     float* const gold = (float*) calloc(data->n, sizeof(float));
@@ -536,108 +95,119 @@ void validate_result(struct input_data* data)
     free(gold);
 }
 
-int main()
+/**
+ * Scans on the sub-devices of the context's device, with each sub-device's
+ * part of the arrays first-touched on its NUMA node.
+ */
+cl_int run_on_sub_devices(struct gpu_context* context, struct input_data* data,
+                          struct op_timing* timing)
 {
-    /// n, m, k are expected to be divisible by tile_size.
-    size_t const n = 1024 * 1024;
+    cl_int error_code = 0;
+    size_t* rows = NULL;
+    struct device_share* shares = NULL;
+    float* in = NULL;
+    float* out = NULL;
 
-    char const* const kernel_names[] =
+    struct device_group* group = setup_fission_group(
+        context->selected_device, NULL, 0, &error_code
+    );
+    CHECK_AND_RET_ERR("device fission failed", error_code);
+
+    rows = calloc(group->num_contexts, sizeof(size_t));
+    shares = calloc(group->num_contexts, sizeof(struct device_share));
+    in = malloc(data->n * sizeof(float));
+    out = malloc(data->n * sizeof(float));
+    if (!rows || !shares || !in || !out)
     {
-        "local_scan",
-        "tiles_sum"
-    };
-    size_t kernels_num = sizeof(kernel_names) / sizeof(char const*);
+        error_code = CL_OUT_OF_HOST_MEMORY;
+        goto release_group;
+    }
 
-    char const* const sources_list[] =
-        {
-            "const.h",
-            "par_scan2.cl"
-        };
+    split_rows(group, data->n, SCAN_TILE_SIZE, rows);
+    first_touch_rows(group, in, sizeof(float), rows);
+    first_touch_rows(group, out, sizeof(float), rows);
+    memcpy(in, data->in_A, data->n * sizeof(float));
 
-    int exit_code = 0;
-    cl_int error_code;
+    error_code = run_scan_multi_device(group, in, out, data->n, shares, timing);
+    CHECK_ERR("partitioned scan failed", error_code, release_group);
 
-    struct gpu_context* context = setup_gpu_context(
-        n, sources_list, sizeof(sources_list) / sizeof(char const*),
-        kernel_names, kernels_num, &error_code
-    );
-    CHECK_AND_RET_ERR("startup failed", error_code);
+    memcpy(data->out_B, out, data->n * sizeof(float));
+    print_device_shares(group, shares, data->n, stdout);
 
+release_group:
+    free(in);
+    free(out);
+    free(rows);
+    free(shares);
+    release_device_group(group);
+    return error_code;
+}
 
-    // Setting up "local_scan" kernel args
-    clSetKernelArg(
-        context->kernels[0], 0, sizeof(cl_mem), &context->in_array_buf
-    );
-    clSetKernelArg(
-        context->kernels[0], 1, sizeof(cl_mem), &context->result_array_buf
-    );
+int main(int argc, char** argv)
+{
+    size_t const n = 1024 * 1024;
 
-    // Setting up "tiles_sum" kernel
-    clSetKernelArg(
-        context->kernels[1], 0, sizeof(cl_mem), &context->result_array_buf
-    );
-    clSetKernelArg(
-        context->kernels[1], 1, sizeof(cl_mem), &context->pending_add_buf
-    );
+    /// "--fission" scans on NUMA sub-devices of the selected device, each
+    /// part first-touched from the CPUs of its node, see first_touch_rows.
+    bool fission = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--fission"))
+            fission = true;
+        else
+        {
+            fprintf(
+                stderr,
+                "Usage: %s [--fission]\n"
+                "--fission first-touches sub-device i's part from the CPUs of\n"
+                "NUMA node i in /sys/devices/system/node, taking the runtime's\n"
+                "NUMA sub-devices to be in node order. OMP_PLACES is not needed.\n",
+                argv[0]
+            );
+            return -1;
+        }
+    }
+
+    cl_int error_code;
+
+    struct gpu_context* context = setup_gpu_context(NULL, 0, &error_code);
+    CHECK_AND_RET_ERR("startup failed", error_code);
 
+    cl_ulong phase_start_ns = host_time_ns();
     struct input_data* data = generate_input(n);
+    trace_host_phase("generate_input", NULL, phase_start_ns, host_time_ns());
     if (!data)
     {
         fprintf(stderr, "Input generation failed!\n");
+        release_gpu_context(context);
         return -1;
     }
 
-    size_t work_size[] = {n};
-    size_t local_size[] = {SCAN_TILE_SIZE};
-    cl_event run_events[kernels_num];
-
-    error_code = clEnqueueWriteBuffer(
-        context->command_queue, context->in_array_buf, true, 0,
-        n * sizeof(float), data->in_A, 0, 0, 0
-    );
-    CHECK_ERR("clEnqueueWriteBuffer error", error_code, return_error);
+    /// Timing of the whole device, the sub-devices report their own run
+    struct op_timing timing;
+    error_code = run_scan(context, data->in_A, data->out_B, n, &timing);
+    CHECK_ERR("scan failed", error_code, return_error);
 
-    error_code = clEnqueueNDRangeKernel(
-        context->command_queue, context->kernels[0], 1, NULL, work_size,
-        local_size, 0, 0, &run_events[0]
-    );
-    CHECK_ERR("Error enqueuing kernel", error_code, return_error);
-
-    clEnqueueReadBuffer(
-        context->command_queue, context->result_array_buf, true, 0,
-        n * sizeof(float), data->out_B, 0, 0, 0
-    );
-
-    validate_first_step(data);
-
-    error_code = clEnqueueNDRangeKernel(
-        context->command_queue, context->kernels[1], 1, NULL, work_size,
-        local_size, 0, 0, &run_events[1]
-    );
-    CHECK_ERR("Error enqueuing kernel", error_code, return_error);
+    if (fission)
+    {
+        struct op_timing fission_timing;
+        error_code = run_on_sub_devices(context, data, &fission_timing);
+        CHECK_ERR("partitioned scan failed", error_code, return_error);
 
-    clEnqueueReadBuffer(
-        context->command_queue, context->pending_add_buf, true, 0,
-        n * sizeof(float), data->out_B, 0, 0, 0
-    );
+        printf(
+            "end-to-end: whole device %.4f ms, sub-devices %.4f ms "
+            "(kernels %.4f ms on the longest one)\n",
+            timing.total_ns / 1e6, fission_timing.total_ns / 1e6,
+            fission_timing.kernel_ns / 1e6
+        );
+    }
 
+    phase_start_ns = host_time_ns();
     validate_result(data);
+    trace_host_phase("validate_result", NULL, phase_start_ns, host_time_ns());
 
-    long double elapsed_time = 0,
-        ops = (long double) n * logl(n) / logl(2) * 2;
-
-    for (size_t i = 0; i < kernels_num; ++i)
-    {
-        cl_ulong t_start = 0, t_end = 0;
-        clGetEventProfilingInfo(
-            run_events[i], CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &t_start, 0
-        );
-        clGetEventProfilingInfo(
-            run_events[i], CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &t_end, 0
-        );
-
-        elapsed_time += t_end - t_start;
-    }
+    long double elapsed_time = timing.kernel_ns;
+    long double ops = (long double) n * logl(n) / logl(2) * 2;
 
     printf("%.4Lf ms elapsed and ", elapsed_time / 1e6);
     printf("achieved %.4Lf TFlops\n", ops / elapsed_time / 1e3);
@@ -645,5 +215,5 @@ int main()
 return_error:
     release_gpu_context(context);
     release_input_data(data);
-    return exit_code;
+    return error_code ? -1 : 0;
 }
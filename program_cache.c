@@ -0,0 +1,186 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "program_cache.h"
+
+static
+uint64_t fnv1a_update(uint64_t hash, void const* data, size_t len)
+{
+    unsigned char const* bytes = data;
+    for (size_t i = 0; i < len; ++i)
+    {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+/// Hashes zero-terminated device info string, missing info hashes as empty
+static
+uint64_t hash_device_info(uint64_t hash, cl_device_id device,
+                          cl_device_info param)
+{
+    char info[256];
+    size_t ret_sz = 0;
+    if (clGetDeviceInfo(device, param, sizeof(info) - 1, info, &ret_sz))
+        ret_sz = 0;
+    return fnv1a_update(hash, info, ret_sz);
+}
+
+uint64_t program_cache_key(cl_device_id device,
+                           char const* const* sources, size_t const* lens,
+                           size_t sources_num, char const* options)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    /// Lengths are hashed too, so that moving text between sources changes the key
+    for (size_t i = 0; i < sources_num; ++i)
+    {
+        hash = fnv1a_update(hash, &lens[i], sizeof(size_t));
+        hash = fnv1a_update(hash, sources[i], lens[i]);
+    }
+
+    hash = fnv1a_update(hash, options, strlen(options) + 1);
+    hash = hash_device_info(hash, device, CL_DEVICE_NAME);
+    hash = hash_device_info(hash, device, CL_DRIVER_VERSION);
+    return hash;
+}
+
+/// Returns cache directory or NULL if the cache is disabled
+static
+char const* cache_dir(void)
+{
+    char const* dir = getenv(PROGRAM_CACHE_DIR_ENV);
+    if (!dir)
+        return PROGRAM_CACHE_DEFAULT_DIR;
+    return *dir ? dir : NULL;
+}
+
+static
+int cache_file_name(char* buf, size_t buf_sz, uint64_t key)
+{
+    char const* dir = cache_dir();
+    if (!dir)
+        return -1;
+
+    int len = snprintf(buf, buf_sz, "%s/%016" PRIx64 ".bin", dir, key);
+    return len < 0 || (size_t) len >= buf_sz ? -1 : 0;
+}
+
+cl_program load_cached_program(cl_context context, cl_device_id device,
+                               uint64_t key, char const* options)
+{
+    char file_name[4096];
+    if (cache_file_name(file_name, sizeof(file_name), key))
+        return NULL;
+
+    FILE* file = fopen(file_name, "rb");
+    if (!file)
+        return NULL;
+
+    unsigned char* binary = NULL;
+    cl_program program = NULL;
+    long binary_sz = 0;
+
+    if (fseek(file, 0, SEEK_END) || (binary_sz = ftell(file)) <= 0
+        || fseek(file, 0, SEEK_SET))
+        goto close_file;
+
+    binary = malloc(binary_sz);
+    if (!binary || fread(binary, 1, binary_sz, file) != (size_t) binary_sz)
+        goto close_file;
+
+    cl_int result = 0;
+    cl_int binary_status = 0;
+    size_t const size = binary_sz;
+    program = clCreateProgramWithBinary(
+        context, 1, &device, &size, (unsigned char const**) &binary,
+        &binary_status, &result
+    );
+
+    if (!result && !binary_status)
+        result = clBuildProgram(program, 1, &device, options, 0, 0);
+
+    if (result || binary_status)
+    {
+        /// Stale binary from another driver, caller rebuilds from the sources
+        fprintf(stderr, "Cached program %s rejected: %d\n", file_name, result);
+        if (program)
+            clReleaseProgram(program);
+        program = NULL;
+    }
+
+close_file:
+    free(binary);
+    fclose(file);
+    return program;
+}
+
+cl_int store_cached_program(cl_program program, uint64_t key)
+{
+    char file_name[4096];
+    char tmp_name[4096 + 32];
+    if (cache_file_name(file_name, sizeof(file_name), key))
+        return 0;
+
+    if (mkdir(cache_dir(), 0755) && errno != EEXIST)
+    {
+        perror("Error creating program cache directory");
+        return -1;
+    }
+
+    cl_uint num_devices = 0;
+    cl_int result = clGetProgramInfo(
+        program, CL_PROGRAM_NUM_DEVICES, sizeof(cl_uint), &num_devices, 0
+    );
+    if (result)
+        return result;
+    if (num_devices != 1)
+        return CL_INVALID_VALUE;
+
+    size_t binary_sz = 0;
+    result = clGetProgramInfo(
+        program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t), &binary_sz, 0
+    );
+    if (result)
+        return result;
+    if (!binary_sz)
+        return CL_INVALID_BINARY;
+
+    unsigned char* binary = malloc(binary_sz);
+    if (!binary)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    result = clGetProgramInfo(
+        program, CL_PROGRAM_BINARIES, sizeof(unsigned char*), &binary, 0
+    );
+    if (result)
+        goto free_binary;
+
+    /// Written aside and renamed, so concurrent runs never see a partial file
+    snprintf(tmp_name, sizeof(tmp_name), "%s.%ld.tmp", file_name, (long) getpid());
+    FILE* file = fopen(tmp_name, "wb");
+    if (!file)
+    {
+        perror("Error creating program cache file");
+        result = -1;
+        goto free_binary;
+    }
+
+    size_t written = fwrite(binary, 1, binary_sz, file);
+    if (fclose(file) || written != binary_sz || rename(tmp_name, file_name))
+    {
+        perror("Error writing program cache file");
+        remove(tmp_name);
+        result = -1;
+    }
+
+free_binary:
+    free(binary);
+    return result;
+}
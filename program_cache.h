@@ -0,0 +1,31 @@
+#ifndef OPENCL_FUN_PROGRAM_CACHE_H
+#define OPENCL_FUN_PROGRAM_CACHE_H
+
+#include <stdint.h>
+
+#include <CL/opencl.h>
+
+/// Environment variable overriding the cache directory, empty disables the cache
+#define PROGRAM_CACHE_DIR_ENV       "CLFUN_CACHE_DIR"
+#define PROGRAM_CACHE_DEFAULT_DIR   ".clfun_cache"
+
+/**
+ * Key of the program in the cache: hash of the sources, build options,
+ * device name and driver version.
+ */
+uint64_t program_cache_key(cl_device_id device,
+                           char const* const* sources, size_t const* lens,
+                           size_t sources_num, char const* options);
+
+/**
+ * Creates and builds the program from the cached binary.
+ * \return Built program or NULL if the key isn't cached or the binary
+ *         is rejected by the driver
+ */
+cl_program load_cached_program(cl_context context, cl_device_id device,
+                               uint64_t key, char const* options);
+
+/// Stores binary of the built \p program under \p key
+cl_int store_cached_program(cl_program program, uint64_t key);
+
+#endif //OPENCL_FUN_PROGRAM_CACHE_H
@@ -0,0 +1,174 @@
+#include <assert.h>
+#include <math.h>
+#include <string.h>
+
+#include "roofline.h"
+
+static char const* const roofline_sources[] =
+{
+    "roofline.cl"
+};
+
+/// Runs the kernel ROOFLINE_REPS times, returns the fastest run in \p best_ns
+static
+cl_int time_micro_kernel(struct gpu_context* context, cl_kernel kernel,
+                         size_t work_size, cl_ulong* best_ns)
+{
+    cl_int result = 0;
+    *best_ns = 0;
+
+    /// The first run is a warm-up
+    for (size_t i = 0; i <= ROOFLINE_REPS; ++i)
+    {
+        cl_event run_event = NULL;
+        result = clEnqueueNDRangeKernel(
+            context->command_queue, kernel, 1, NULL, &work_size, NULL,
+            0, 0, &run_event
+        );
+        CHECK_AND_RET_ERR("Error enqueuing kernel", result);
+
+        result = clWaitForEvents(1, &run_event);
+        cl_ulong const elapsed_ns = event_elapsed_ns(run_event);
+        trace_command(run_event);
+        clReleaseEvent(run_event);
+        CHECK_AND_RET_ERR("Error waiting for kernel", result);
+
+        if (i && (!*best_ns || elapsed_ns < *best_ns))
+            *best_ns = elapsed_ns;
+    }
+    return result;
+}
+
+cl_int measure_device_peaks(struct gpu_context* context,
+                            struct device_peaks* peaks)
+{
+    assert(context);
+    assert(peaks);
+
+    cl_int result = 0;
+    cl_mem a_buf = NULL, c_buf = NULL;
+    cl_ulong best_ns = 0;
+
+    memset(peaks, 0, sizeof(struct device_peaks));
+
+    char options[64];
+    snprintf(options, sizeof(options), "-DROOFLINE_FLOP_ITERS=%d", ROOFLINE_FLOP_ITERS);
+    struct program_variant* variant = get_program_variant(
+        context, roofline_sources, 1, options, &result
+    );
+    CHECK_AND_RET_ERR("Failed to build roofline micro-kernels", result);
+
+    cl_kernel bandwidth_kernel = get_variant_kernel(
+        variant, "peak_bandwidth", &result
+    );
+    CHECK_AND_RET_ERR("Failed to create kernel", result);
+    cl_kernel flops_kernel = get_variant_kernel(variant, "peak_flops", &result);
+    CHECK_AND_RET_ERR("Failed to create kernel", result);
+
+    /// Two buffers of the size have to fit the device
+    size_t bytes = ROOFLINE_BANDWIDTH_BYTES;
+    while (bytes > context->max_mem_alloc_size
+           || (context->global_mem_size && 4 * bytes > context->global_mem_size))
+        bytes /= 2;
+
+    a_buf = clCreateBuffer(context->context, CL_MEM_READ_ONLY, bytes, NULL, &result);
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+    c_buf = clCreateBuffer(context->context, CL_MEM_WRITE_ONLY, bytes, NULL, &result);
+    CHECK_ERR("Error creating buffer", result, release_buffers);
+
+    clSetKernelArg(bandwidth_kernel, 0, sizeof(cl_mem), &a_buf);
+    clSetKernelArg(bandwidth_kernel, 1, sizeof(cl_mem), &c_buf);
+    result = time_micro_kernel(
+        context, bandwidth_kernel, bytes / (4 * sizeof(cl_float)), &best_ns
+    );
+    CHECK_ERR("Bandwidth measurement failed", result, release_buffers);
+    peaks->bandwidth = 2.0 * bytes / best_ns;
+
+    /// Values close to 1 keep the chains finite
+    cl_float const x = 0.999f, y = 0.001f;
+    clSetKernelArg(flops_kernel, 0, sizeof(cl_mem), &c_buf);
+    clSetKernelArg(flops_kernel, 1, sizeof(cl_float), &x);
+    clSetKernelArg(flops_kernel, 2, sizeof(cl_float), &y);
+    result = time_micro_kernel(
+        context, flops_kernel, ROOFLINE_FLOP_WORK_ITEMS, &best_ns
+    );
+    CHECK_ERR("FLOP rate measurement failed", result, release_buffers);
+    /// Every work item does ROOFLINE_FLOP_ITERS multiply-adds on 8 chains
+    peaks->flop_rate = 16.0 * ROOFLINE_FLOP_ITERS * ROOFLINE_FLOP_WORK_ITEMS / best_ns;
+
+release_buffers:
+    if (a_buf)
+        clReleaseMemObject(a_buf);
+    if (c_buf)
+        clReleaseMemObject(c_buf);
+    return result;
+}
+
+struct kernel_cost gemm_cost(size_t n, size_t m, size_t k, size_t tile)
+{
+    struct kernel_cost cost;
+    cost.flops = 2.0 * n * m * k;
+    cost.bytes = sizeof(float) * (2.0 * n * m * k / tile + (double) n * k);
+    return cost;
+}
+
+struct kernel_cost local_scan_cost(size_t n, size_t tile)
+{
+    /// Element i of a tile adds ceil(log2(i + 1)) partial sums
+    double adds_per_tile = 0;
+    for (size_t i = 1; i < tile && i < n; ++i)
+        adds_per_tile += ceil(log2((double) i + 1));
+
+    struct kernel_cost cost;
+    cost.flops = adds_per_tile * ((n + tile - 1) / tile);
+    cost.bytes = 2.0 * sizeof(float) * n;
+    return cost;
+}
+
+struct kernel_cost tiles_sum_cost(size_t n, size_t tile)
+{
+    /// Tile t reads and adds the last elements of the t tiles before it
+    double const tiles = (double) (n / tile);
+    double const adds = tile * tiles * (tiles - 1) / 2;
+
+    struct kernel_cost cost;
+    cost.flops = adds;
+    cost.bytes = sizeof(float) * (2.0 * n + adds);
+    return cost;
+}
+
+double attainable_flop_rate(struct device_peaks const* peaks,
+                            struct kernel_cost const* cost)
+{
+    double const memory_roof = cost->flops / cost->bytes * peaks->bandwidth;
+    return memory_roof < peaks->flop_rate ? memory_roof : peaks->flop_rate;
+}
+
+void print_roofline_header(struct device_peaks const* peaks, FILE* out)
+{
+    fprintf(
+        out, "Device peaks: %.2f GB/s, %.2f GFlops, ridge point %.2f flop/byte\n",
+        peaks->bandwidth, peaks->flop_rate, peaks->flop_rate / peaks->bandwidth
+    );
+    fprintf(
+        out, "%-10s %-16s %10s %10s %10s %10s %10s %8s %-7s\n",
+        "kernel", "shape", "flop/byte", "GFlops", "GB/s", "roof GF", "roof %",
+        "peak GF%", "bound"
+    );
+}
+
+void print_roofline_row(char const* name, char const* shape,
+                        struct kernel_cost const* cost, cl_ulong kernel_ns,
+                        struct device_peaks const* peaks, FILE* out)
+{
+    double const intensity = cost->flops / cost->bytes;
+    double const flop_rate = cost->flops / kernel_ns;
+    double const roof = attainable_flop_rate(peaks, cost);
+
+    fprintf(
+        out, "%-10s %-16s %10.3f %10.2f %10.2f %10.2f %9.1f%% %7.1f%% %-7s\n",
+        name, shape, intensity, flop_rate, cost->bytes / kernel_ns, roof,
+        100.0 * flop_rate / roof, 100.0 * flop_rate / peaks->flop_rate,
+        roof < peaks->flop_rate ? "memory" : "compute"
+    );
+}
@@ -0,0 +1,39 @@
+/// Micro-kernels measuring the device's peaks for the roofline model
+
+#ifndef ROOFLINE_FLOP_ITERS
+#define ROOFLINE_FLOP_ITERS 512
+#endif
+
+/// Copies a to c, one float4 per work item: bound by global memory bandwidth
+__kernel void peak_bandwidth(__global float4 const* a,
+                             __global float4* c)
+{
+    size_t const i = get_global_id(0);
+    c[i] = a[i];
+}
+
+/// Eight independent chains of multiply-adds in registers: bound by the ALUs.
+/// Every work item does 16 * ROOFLINE_FLOP_ITERS floating point operations.
+__kernel void peak_flops(__global float* c,
+                         float const x,
+                         float const y)
+{
+    float v0 = get_global_id(0);
+    float v1 = v0 + 1, v2 = v0 + 2, v3 = v0 + 3;
+    float v4 = v0 + 4, v5 = v0 + 5, v6 = v0 + 6, v7 = v0 + 7;
+
+    for (uint i = 0; i < ROOFLINE_FLOP_ITERS; ++i)
+    {
+        v0 = mad(v0, x, y);
+        v1 = mad(v1, x, y);
+        v2 = mad(v2, x, y);
+        v3 = mad(v3, x, y);
+        v4 = mad(v4, x, y);
+        v5 = mad(v5, x, y);
+        v6 = mad(v6, x, y);
+        v7 = mad(v7, x, y);
+    }
+
+    /// Stored, so that the compiler can't drop the chains
+    c[get_global_id(0)] = v0 + v1 + v2 + v3 + v4 + v5 + v6 + v7;
+}
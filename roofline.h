@@ -0,0 +1,62 @@
+#ifndef OPENCL_FUN_ROOFLINE_H
+#define OPENCL_FUN_ROOFLINE_H
+
+#include "clfun.h"
+
+/// Bytes streamed by the bandwidth micro-kernel, halved until they fit the device
+#define ROOFLINE_BANDWIDTH_BYTES    (64ull << 20)
+
+/// Work items of the FLOP rate micro-kernel and multiply-adds per chain of each
+#define ROOFLINE_FLOP_WORK_ITEMS    (1ull << 18)
+#define ROOFLINE_FLOP_ITERS         512
+
+/// Micro-kernel runs, the fastest one counts
+#define ROOFLINE_REPS               3
+
+/// Device limits measured by \ref measure_device_peaks
+struct device_peaks
+{
+    double bandwidth;   //!< Global memory bandwidth, bytes per ns = GB/s
+    double flop_rate;   //!< Floating point operations per ns = GFlops
+};
+
+/**
+ * Work of a kernel launch. Bytes are what the kernel requests from global
+ * memory, hits in the device's caches are not accounted for.
+ */
+struct kernel_cost
+{
+    double flops;
+    double bytes;
+};
+
+/// Measures the device's peaks with the micro-kernels of roofline.cl
+cl_int measure_device_peaks(struct gpu_context* context,
+                            struct device_peaks* peaks);
+
+/**
+ * Cost of [N x M] * [M x K] by a kernel keeping square tiles of side \p tile
+ * in local memory, so that A and B are read K / tile and N / tile times.
+ * Naive kernels are tiles of 1.
+ */
+struct kernel_cost gemm_cost(size_t n, size_t m, size_t k, size_t tile);
+
+/// Cost of par_scan and local_scan on n elements in tiles of \p tile
+struct kernel_cost local_scan_cost(size_t n, size_t tile);
+
+/// Cost of tiles_sum on n elements: every element adds the previous tiles' last elements
+struct kernel_cost tiles_sum_cost(size_t n, size_t tile);
+
+/// Roof of the kernel: min(peak FLOP rate, arithmetic intensity * bandwidth), in GFlops
+double attainable_flop_rate(struct device_peaks const* peaks,
+                            struct kernel_cost const* cost);
+
+/// Prints peaks and the header of \ref print_roofline_row
+void print_roofline_header(struct device_peaks const* peaks, FILE* out);
+
+/// Prints intensity, achieved rates and percent of the roof of the kernel run
+void print_roofline_row(char const* name, char const* shape,
+                        struct kernel_cost const* cost, cl_ulong kernel_ns,
+                        struct device_peaks const* peaks, FILE* out);
+
+#endif //OPENCL_FUN_ROOFLINE_H
@@ -0,0 +1,464 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clfun.h"
+#include "trace.h"
+
+/// Recorded command or host phase, timestamps on the host_time_ns clock
+struct trace_record
+{
+    char*       name;
+    char*       detail;
+    size_t      track;          //!< 0 for the host, queue's track otherwise
+    cl_ulong    queued_ns;      //!< Same as start_ns for host phases
+    cl_ulong    submit_ns;
+    cl_ulong    start_ns;
+    cl_ulong    end_ns;
+};
+
+/// Queue's track, device timestamps are shifted by offset_ns to the host clock
+struct trace_track
+{
+    cl_command_queue    queue;
+    char                name[160];
+    cl_long             offset_ns;
+    bool                aligned;    //!< offset_ns is set
+};
+
+static struct
+{
+    pthread_mutex_t         lock;
+    char*                   path;       //!< Written at exit, NULL if disabled
+
+    struct trace_record*    records;
+    size_t                  num_records;
+    size_t                  records_cap;
+
+    struct trace_track*     tracks;     //!< Track i + 1 is tracks[i]
+    size_t                  num_tracks;
+    size_t                  tracks_cap;
+} trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+static pthread_once_t trace_atexit_once = PTHREAD_ONCE_INIT;
+
+/// Frees the records and tracks, expects the lock held
+static
+void clear_trace(void)
+{
+    for (size_t i = 0; i < trace.num_records; ++i)
+    {
+        free(trace.records[i].name);
+        free(trace.records[i].detail);
+    }
+    free(trace.records);
+    free(trace.tracks);
+    trace.records = NULL;
+    trace.tracks = NULL;
+    trace.num_records = trace.records_cap = 0;
+    trace.num_tracks = trace.tracks_cap = 0;
+}
+
+static
+void write_trace_at_exit(void)
+{
+    pthread_mutex_lock(&trace.lock);
+    char* const path = trace.path;
+    pthread_mutex_unlock(&trace.lock);
+
+    if (!path)
+        return;
+    if (!write_trace(path))
+        fprintf(stderr, "Trace written to %s\n", path);
+
+    pthread_mutex_lock(&trace.lock);
+    trace.path = NULL;
+    clear_trace();
+    pthread_mutex_unlock(&trace.lock);
+    free(path);
+}
+
+static
+void register_atexit(void)
+{
+    atexit(write_trace_at_exit);
+}
+
+static
+cl_int set_trace_path(char const* path)
+{
+    char* const copy = strdup(path);
+    if (!copy)
+        return CL_OUT_OF_HOST_MEMORY;
+
+    pthread_once(&trace_atexit_once, register_atexit);
+
+    pthread_mutex_lock(&trace.lock);
+    free(trace.path);
+    trace.path = copy;
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+}
+
+static
+void enable_trace_from_env(void)
+{
+    char const* const path = getenv(TRACE_FILE_ENV);
+    if (path && *path)
+        set_trace_path(path);
+}
+
+cl_int enable_trace(char const* path)
+{
+    /// Explicit file wins over the environment's
+    pthread_once(&trace_env_once, enable_trace_from_env);
+    return set_trace_path(path);
+}
+
+bool trace_enabled(void)
+{
+    pthread_once(&trace_env_once, enable_trace_from_env);
+
+    pthread_mutex_lock(&trace.lock);
+    bool const enabled = trace.path != NULL;
+    pthread_mutex_unlock(&trace.lock);
+    return enabled;
+}
+
+/// Appends the record, takes ownership of its strings, expects the lock held
+static
+void append_record(struct trace_record const* record)
+{
+    if (trace.num_records == trace.records_cap)
+    {
+        size_t const cap = trace.records_cap ? 2 * trace.records_cap : 256;
+        struct trace_record* const records = realloc(
+            trace.records, cap * sizeof(struct trace_record)
+        );
+        if (!records)
+        {
+            free(record->name);
+            free(record->detail);
+            return;
+        }
+        trace.records = records;
+        trace.records_cap = cap;
+    }
+    trace.records[trace.num_records++] = *record;
+}
+
+/// Returns the queue's track or adds a new one, 0 on failure, expects the lock held
+static
+size_t find_track(cl_command_queue queue)
+{
+    for (size_t i = 0; i < trace.num_tracks; ++i)
+        if (trace.tracks[i].queue == queue)
+            return i + 1;
+
+    if (trace.num_tracks == trace.tracks_cap)
+    {
+        size_t const cap = trace.tracks_cap ? 2 * trace.tracks_cap : 8;
+        struct trace_track* const tracks = realloc(
+            trace.tracks, cap * sizeof(struct trace_track)
+        );
+        if (!tracks)
+            return 0;
+        trace.tracks = tracks;
+        trace.tracks_cap = cap;
+    }
+
+    struct trace_track* const track = &trace.tracks[trace.num_tracks++];
+    memset(track, 0, sizeof(struct trace_track));
+    track->queue = queue;
+
+    char device_name[128] = "unknown device";
+    cl_device_id device = NULL;
+    size_t ret_sz = 0;
+    if (!clGetCommandQueueInfo(queue, CL_QUEUE_DEVICE, sizeof(cl_device_id),
+                               &device, NULL)
+        && !clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name) - 1,
+                            device_name, &ret_sz))
+        device_name[ret_sz] = '\0';
+    snprintf(
+        track->name, sizeof(track->name), "%s, queue %zu",
+        device_name, trace.num_tracks
+    );
+
+    return trace.num_tracks;
+}
+
+void trace_queue(cl_command_queue queue)
+{
+    if (!queue || !trace_enabled())
+        return;
+
+    /// QUEUED is taken by the runtime on enqueue, right after host_ns
+    cl_event marker = NULL;
+    cl_ulong queued_ns = 0;
+    cl_ulong const host_ns = host_time_ns();
+    cl_int result = clEnqueueMarkerWithWaitList(queue, 0, NULL, &marker);
+    if (!result)
+        result = clWaitForEvents(1, &marker);
+    if (!result)
+        result = clGetEventProfilingInfo(
+            marker, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &queued_ns, 0
+        );
+    if (marker)
+        clReleaseEvent(marker);
+
+    pthread_mutex_lock(&trace.lock);
+    size_t const track = find_track(queue);
+    /// Freed queue's handle may be reused, so a known queue is realigned too
+    if (track)
+    {
+        trace.tracks[track - 1].offset_ns = (cl_long) host_ns - (cl_long) queued_ns;
+        trace.tracks[track - 1].aligned = !result;
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+static
+char const* command_name(cl_command_type type)
+{
+    switch (type)
+    {
+    case CL_COMMAND_NDRANGE_KERNEL:
+        return "kernel";
+    case CL_COMMAND_READ_BUFFER:
+        return "read buffer";
+    case CL_COMMAND_WRITE_BUFFER:
+        return "write buffer";
+    case CL_COMMAND_READ_BUFFER_RECT:
+        return "read buffer rect";
+    case CL_COMMAND_WRITE_BUFFER_RECT:
+        return "write buffer rect";
+    case CL_COMMAND_COPY_BUFFER:
+        return "copy buffer";
+    case CL_COMMAND_FILL_BUFFER:
+        return "fill buffer";
+    case CL_COMMAND_MAP_BUFFER:
+        return "map buffer";
+    case CL_COMMAND_UNMAP_MEM_OBJECT:
+        return "unmap";
+    case CL_COMMAND_MARKER:
+        return "marker";
+    case CL_COMMAND_BARRIER:
+        return "barrier";
+    default:
+        return "command";
+    }
+}
+
+void trace_command(cl_event event)
+{
+    if (!event || !trace_enabled())
+        return;
+
+    cl_int status = -1;
+    cl_command_type type = 0;
+    cl_command_queue queue = NULL;
+    cl_profiling_info const params[] =
+    {
+        CL_PROFILING_COMMAND_QUEUED, CL_PROFILING_COMMAND_SUBMIT,
+        CL_PROFILING_COMMAND_START, CL_PROFILING_COMMAND_END
+    };
+    cl_ulong times[4] = {0};
+
+    clGetEventInfo(
+        event, CL_EVENT_COMMAND_EXECUTION_STATUS, sizeof(cl_int), &status, NULL
+    );
+    if (status != CL_COMPLETE)
+        return;
+    if (clGetEventInfo(event, CL_EVENT_COMMAND_TYPE, sizeof(cl_command_type),
+                       &type, NULL)
+        || clGetEventInfo(event, CL_EVENT_COMMAND_QUEUE,
+                          sizeof(cl_command_queue), &queue, NULL))
+        return;
+    for (size_t i = 0; i < 4; ++i)
+        if (clGetEventProfilingInfo(event, params[i], sizeof(cl_ulong),
+                                    &times[i], NULL))
+            return;
+
+    cl_ulong const now_ns = host_time_ns();
+
+    pthread_mutex_lock(&trace.lock);
+    size_t const track = find_track(queue);
+    if (track)
+    {
+        /// Unaligned queue: the command is assumed to have just ended
+        if (!trace.tracks[track - 1].aligned)
+        {
+            trace.tracks[track - 1].offset_ns = (cl_long) now_ns - (cl_long) times[3];
+            trace.tracks[track - 1].aligned = true;
+        }
+
+        cl_long const offset_ns = trace.tracks[track - 1].offset_ns;
+        struct trace_record record =
+        {
+            .name = strdup(command_name(type)),
+            .detail = NULL,
+            .track = track,
+            .queued_ns = times[0] + offset_ns,
+            .submit_ns = times[1] + offset_ns,
+            .start_ns = times[2] + offset_ns,
+            .end_ns = times[3] + offset_ns
+        };
+        if (record.name)
+            append_record(&record);
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+void trace_commands(cl_event const* events, size_t events_num)
+{
+    for (size_t i = 0; i < events_num; ++i)
+        if (events[i])
+            trace_command(events[i]);
+}
+
+void trace_host_phase(char const* name, char const* detail,
+                      cl_ulong start_ns, cl_ulong end_ns)
+{
+    if (!trace_enabled())
+        return;
+
+    struct trace_record record =
+    {
+        .name = strdup(name),
+        .detail = detail ? strdup(detail) : NULL,
+        .track = 0,
+        .queued_ns = start_ns,
+        .submit_ns = start_ns,
+        .start_ns = start_ns,
+        .end_ns = end_ns
+    };
+    if (!record.name)
+    {
+        free(record.detail);
+        return;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+    append_record(&record);
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/// Writes JSON string, escaping quotes, backslashes and control characters
+static
+void write_json_string(FILE* out, char const* str)
+{
+    fputc('"', out);
+    for (; *str; ++str)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(out, "\\%c", *str);
+        else if ((unsigned char) *str < 0x20)
+            fprintf(out, "\\u%04x", *str);
+        else
+            fputc(*str, out);
+    }
+    fputc('"', out);
+}
+
+/// Timestamp in microseconds since the origin, as Chrome traces expect
+static inline
+double trace_us(cl_ulong ns, cl_ulong origin_ns)
+{
+    return ((double) ns - (double) origin_ns) / 1e3;
+}
+
+/**
+ * Host phases go to process 1, queues to process 2 with a thread per queue.
+ * Every command is a complete event from START to END, and a pair of async
+ * events with its QUEUED -> SUBMIT and SUBMIT -> START latencies, as these
+ * overlap between commands.
+ */
+cl_int write_trace(char const* path)
+{
+    FILE* out = fopen(path, "w");
+    if (!out)
+    {
+        perror("Error opening trace file");
+        return -1;
+    }
+
+    pthread_mutex_lock(&trace.lock);
+
+    cl_ulong origin_ns = ~0ull;
+    for (size_t i = 0; i < trace.num_records; ++i)
+        if (trace.records[i].queued_ns < origin_ns)
+            origin_ns = trace.records[i].queued_ns;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(
+        out, "{\"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"name\": \"process_name\", "
+        "\"args\": {\"name\": \"host\"}},\n"
+        "{\"ph\": \"M\", \"pid\": 2, \"tid\": 0, \"name\": \"process_name\", "
+        "\"args\": {\"name\": \"devices\"}}"
+    );
+    for (size_t i = 0; i < trace.num_tracks; ++i)
+    {
+        fprintf(
+            out, ",\n{\"ph\": \"M\", \"pid\": 2, \"tid\": %zu, "
+            "\"name\": \"thread_name\", \"args\": {\"name\": ", i + 1
+        );
+        write_json_string(out, trace.tracks[i].name);
+        fprintf(out, "}}");
+    }
+
+    for (size_t i = 0; i < trace.num_records; ++i)
+    {
+        struct trace_record const* const record = &trace.records[i];
+        int const pid = record->track ? 2 : 1;
+
+        fprintf(out, ",\n{\"ph\": \"X\", \"name\": ");
+        write_json_string(out, record->name);
+        fprintf(
+            out, ", \"pid\": %d, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f",
+            pid, record->track, trace_us(record->start_ns, origin_ns),
+            trace_us(record->end_ns, record->start_ns)
+        );
+
+        if (record->track)
+        {
+            fprintf(
+                out, ", \"args\": {\"queued_to_submit_ns\": %llu, "
+                "\"submit_to_start_ns\": %llu, \"start_to_end_ns\": %llu}}",
+                (unsigned long long) (record->submit_ns - record->queued_ns),
+                (unsigned long long) (record->start_ns - record->submit_ns),
+                (unsigned long long) (record->end_ns - record->start_ns)
+            );
+
+            char const* const phases[] = {"queued", "submitted"};
+            cl_ulong const bounds[] =
+            {
+                record->queued_ns, record->submit_ns, record->start_ns
+            };
+            for (size_t p = 0; p < 2; ++p)
+                fprintf(
+                    out, ",\n{\"ph\": \"b\", \"cat\": \"latency\", \"id\": %zu, "
+                    "\"name\": \"%s\", \"pid\": 2, \"tid\": %zu, \"ts\": %.3f},\n"
+                    "{\"ph\": \"e\", \"cat\": \"latency\", \"id\": %zu, "
+                    "\"name\": \"%s\", \"pid\": 2, \"tid\": %zu, \"ts\": %.3f}",
+                    i, phases[p], record->track, trace_us(bounds[p], origin_ns),
+                    i, phases[p], record->track, trace_us(bounds[p + 1], origin_ns)
+                );
+        }
+        else if (record->detail)
+        {
+            fprintf(out, ", \"args\": {\"detail\": ");
+            write_json_string(out, record->detail);
+            fprintf(out, "}}");
+        }
+        else
+            fprintf(out, "}");
+    }
+    fprintf(out, "\n]}\n");
+
+    pthread_mutex_unlock(&trace.lock);
+
+    fclose(out);
+    return 0;
+}
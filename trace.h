@@ -0,0 +1,48 @@
+#ifndef OPENCL_FUN_TRACE_H
+#define OPENCL_FUN_TRACE_H
+
+#include <stdbool.h>
+
+#include <CL/opencl.h>
+
+/// Environment variable naming the trace file, tracing is off if unset or empty
+#define TRACE_FILE_ENV "CLFUN_TRACE"
+
+/**
+ * Starts recording and writes the trace to \p path at exit. Called on first
+ * use of the functions below with the file from TRACE_FILE_ENV, programs
+ * may call it earlier to trace to a file of their own.
+ */
+cl_int enable_trace(char const* path);
+
+/// Checks whether commands and phases are recorded
+bool trace_enabled(void);
+
+/**
+ * Names the queue's track after its device and aligns the device's clock to
+ * host_time_ns with a marker. Queues met by \ref trace_command before being
+ * registered are aligned by their first command's end.
+ */
+void trace_queue(cl_command_queue queue);
+
+/**
+ * Records QUEUED, SUBMIT, START and END of the command, which must have
+ * completed. Called before the event is released, commands which didn't
+ * complete are skipped.
+ */
+void trace_command(cl_event event);
+
+/// \ref trace_command for each of the events, NULL events are skipped
+void trace_commands(cl_event const* events, size_t events_num);
+
+/**
+ * Records host-side phase between the host_time_ns timestamps.
+ * \param detail Shown along with the phase if not NULL, e.g. build options
+ */
+void trace_host_phase(char const* name, char const* detail,
+                      cl_ulong start_ns, cl_ulong end_ns);
+
+/// Writes everything recorded so far as Chrome trace event JSON
+cl_int write_trace(char const* path);
+
+#endif //OPENCL_FUN_TRACE_H